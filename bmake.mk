@@ -14,12 +14,12 @@ FULL_LIB     = lib${LIB_NAME}.so
 
 STATIC_LIB   = lib${LIB_NAME}.a
 
-LDFLAGS_PLAT = -ldl
+LDFLAGS_PLAT = -ldl -lpthread
 CFLAGS_PLAT  = -fPIC
 CFLAGS_BASE  = -Wall -Wpedantic -I${.CURDIR}/${INC_DIR} -std=c89 ${CFLAGS_PLAT}
 CFLAGS_STATIC =
 
-.PHONY: all debug release clean test install uninstall
+.PHONY: all debug release clean test bench install uninstall
 
 all: debug
 
@@ -72,6 +72,10 @@ test: debug
 	@echo "=== Building and running stk tests ==="
 	cd ${.CURDIR}/test && ${MAKE} -f bmake.mk
 
+bench: release
+	@echo "=== Building and running stk benchmarks ==="
+	cd ${.CURDIR}/test && ${MAKE} -f bmake.mk bench
+
 install:
 	@test -f ${.CURDIR}/${BIN_DIR}/release/${FULL_LIB} || { echo "Run 'make -f bmake.mk release' before installing."; exit 1; }
 	install -d ${LIBDIR} ${INCDIR}/stk
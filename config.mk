@@ -6,7 +6,11 @@ BIN_DIR = bin
 LIB_NAME = stk
 STATIC_LIB = lib$(LIB_NAME).a
 
-SRCS = src/module.c \
+SRCS = src/index.c \
+       src/module.c \
        src/platform.c \
+       src/preload.c \
+       src/settle.c \
        src/stk.c \
-       src/stk_log.c
+       src/stk_log.c \
+       src/watcher.c
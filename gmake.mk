@@ -12,7 +12,7 @@ ifeq ($(OS),Windows_NT)
 else
     FULL_LIB := lib$(LIB_NAME).so
     STATIC_LIB := lib$(LIB_NAME).a
-    LDFLAGS_PLAT := -ldl
+    LDFLAGS_PLAT := -ldl -lpthread
     CFLAGS_PLAT := -fPIC
     CFLAGS_STATIC :=
     MKDIR = mkdir -p $(1)
@@ -26,7 +26,7 @@ PREFIX ?= /usr
 LIBDIR ?= $(PREFIX)/lib
 INCDIR ?= $(PREFIX)/include
 
-.PHONY: all debug release clean test install uninstall
+.PHONY: all debug release clean test bench install uninstall
 
 all: debug
 
@@ -80,6 +80,10 @@ test: debug
 	@echo "=== Building and running stk tests ==="
 	@$(MAKE) -C test -f gmake.mk
 
+bench: release
+	@echo "=== Building and running stk benchmarks ==="
+	@$(MAKE) -C test -f gmake.mk bench
+
 ifneq ($(OS),Windows_NT)
 install:
 	@test -f $(BIN_DIR)/release/$(FULL_LIB) || { echo "Run 'make -f gmake.mk release' before installing."; exit 1; }
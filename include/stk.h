@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 /* Buffers */
+#define STK_DIGEST_LANES 4
 #define STK_LOG_PREFIX_BUFFER 64
 #define STK_MOD_DEP_OPERATOR_BUFFER 3
 #define STK_MOD_DEP_LOG_BUFFER 2048
@@ -12,6 +13,7 @@
 #define STK_MOD_DIR_BUFFER 256
 #define STK_MOD_ID_BUFFER 64
 #define STK_MOD_NAME_BUFFER 128
+#define STK_MOD_ROOTS_MAX 8
 #define STK_MOD_VERSION_BUFFER 32
 #define STK_PATH_MAX 256
 #define STK_PATH_MAX_OS 4096
@@ -38,16 +40,28 @@
 #define STK_PLATFORM_MKDIR_ERROR 2
 #define STK_PLATFORM_REMOVE_DIR_ERROR 3
 #define STK_PLATFORM_REMOVE_FILE_ERROR 4
+#define STK_PLATFORM_FORMAT_ERROR 5
+#define STK_PLATFORM_FILE_UNCHANGED 6
+#define STK_PLATFORM_IMAGE_UNCHANGED 7
 
 /* Settings flags */
 #define STK_FLAG_INITIALIZED 0x01
 #define STK_FLAG_LOGGING_ENABLED 0x02
+#define STK_FLAG_WATCH_THREAD 0x04
+#define STK_FLAG_MEMFD_SHADOWS 0x08
 
 /* Dependency constraint operators */
 #define STK_DEP_MIN 0
 #define STK_DEP_EXACT 1
 #define STK_DEP_COMPAT 2
 
+/* Shadow copy strategies, indexes into stk_stats_t.copies */
+#define STK_COPY_CLONE 0
+#define STK_COPY_RANGE 1
+#define STK_COPY_SENDFILE 2
+#define STK_COPY_BUFFER 3
+#define STK_COPY_STRATEGY_COUNT 4
+
 #if defined(__linux__) || defined(_WIN32)
 #define STK_EVENT_BUFFER 4096
 #endif
@@ -77,12 +91,110 @@ typedef struct {
 	char version[STK_MOD_VERSION_BUFFER];
 } stk_dep_t;
 
+/* Layout of stk_mod_descriptor_t this header describes. Later layouts
+ * only append fields, so any descriptor at least this large is read. */
+#define STK_MOD_DESCRIPTOR_VERSION 1
+
+/* Everything stk reads from a module in one exported object, found with
+ * a single symbol lookup instead of one per entry point. deps holds
+ * dep_count entries with no terminating entry. Modules without a
+ * descriptor are read through the separate stk_mod_* symbols. */
+typedef struct {
+	unsigned long abi;
+	size_t size;
+	int (*init)(void);
+	void (*shutdown)(void);
+	const char *name;
+	const char *version;
+	const char *description;
+	const stk_dep_t *deps;
+	size_t dep_count;
+	unsigned char threadsafe;
+} stk_mod_descriptor_t;
+
+/* Define a module's stk_mod_descriptor. name, version and description may
+ * be NULL; threadsafe is nonzero if init may run alongside other inits.
+ * init and shutdown should be static: where the loader does not bind a
+ * module to itself first, an exported name is bound to whichever loaded
+ * module exported it first. stk then falls back to the module's own
+ * stk_mod_init and stk_mod_shutdown exports, and refuses a descriptor
+ * that still points into another module */
+#define STK_MOD_DESCRIPTOR(init, shutdown, name, version, description,      \
+			   threadsafe)                                        \
+	stk_mod_descriptor_t stk_mod_descriptor = {                           \
+	    STK_MOD_DESCRIPTOR_VERSION, sizeof(stk_mod_descriptor_t), init,   \
+	    shutdown, name, version, description, NULL, 0, threadsafe}
+
+/* Same, with deps an array of stk_dep_t whose length is taken at compile
+ * time. Naming the array stk_mod_deps also lets stk read it straight from
+ * the file when it sorts modules, without loading the module */
+#define STK_MOD_DESCRIPTOR_DEPS(init, shutdown, name, version, description, \
+				threadsafe, deps)                             \
+	stk_mod_descriptor_t stk_mod_descriptor = {                           \
+	    STK_MOD_DESCRIPTOR_VERSION, sizeof(stk_mod_descriptor_t), init,   \
+	    shutdown, name, version, description, deps,                       \
+	    sizeof(deps) / sizeof((deps)[0]), threadsafe}
+
+/* Opaque reference to a loaded module. Stays valid until that module is
+ * unloaded or reloaded; a zeroed handle is never valid. */
+typedef struct {
+	size_t slot;
+	unsigned long generation;
+} stk_module_handle_t;
+
+/* Symbol name interned by stk_symbol_register(), valid until
+ * stk_shutdown(). */
+typedef size_t stk_symbol_id_t;
+#define STK_SYMBOL_NONE ((stk_symbol_id_t)-1)
+
+/* Work done by the most recent stk_poll(), reset at the start of each
+ * poll. Lets callers check that a poll costs in proportion to what
+ * changed rather than to the number of loaded modules. copies counts
+ * the shadow copies made, indexed by the STK_COPY_* strategy used, and
+ * reused the shadows found already in the shadow store. */
+typedef struct {
+	size_t events;
+	size_t loaded;
+	size_t reloaded;
+	size_t skipped;
+	size_t unloaded;
+	size_t revalidated;
+	size_t reordered;
+	size_t pending_checked;
+	size_t rescans;
+	size_t coalesced;
+	size_t copies[STK_COPY_STRATEGY_COUNT];
+	size_t reused;
+} stk_stats_t;
+
 unsigned char stk_init(void);
 void stk_shutdown(void);
 size_t stk_module_count(void);
 size_t stk_poll(void);
+size_t stk_wait(int timeout_ms);
+int stk_get_wait_fd(void);
+int stk_get_wait_timeout(void);
+void stk_get_stats(stk_stats_t *out);
+stk_module_handle_t stk_module_find(const char *id);
+unsigned char stk_module_valid(stk_module_handle_t handle);
+size_t stk_module_list(stk_module_handle_t *out, size_t max);
+const char *stk_module_get_id(stk_module_handle_t handle);
+const char *stk_module_get_name(stk_module_handle_t handle);
+const char *stk_module_get_version(stk_module_handle_t handle);
+const char *stk_module_get_description(stk_module_handle_t handle);
+stk_symbol_id_t stk_symbol_register(const char *name);
+void *stk_module_symbol(stk_module_handle_t handle, const char *name);
+void *stk_module_symbol_id(stk_module_handle_t handle, stk_symbol_id_t id);
 void stk_set_mod_dir(const char *path);
+void stk_add_mod_dir(const char *path);
 void stk_set_tmp_dir_name(const char *name);
+void stk_set_settle_ms(unsigned long ms);
+void stk_set_watch_thread(unsigned char enabled);
+void stk_set_preload_threads(size_t count);
+void stk_set_init_threads(size_t count);
+void stk_set_memfd_shadows(unsigned char enabled);
+void stk_set_shadow_store(const char *path);
+void stk_set_shadow_store_max_age(unsigned long seconds);
 void stk_set_module_init_fn(const char *name);
 void stk_set_module_shutdown_fn(const char *name);
 void stk_set_logging_enabled(unsigned char enabled);
@@ -90,6 +202,8 @@ void stk_set_module_name_fn(const char *name);
 void stk_set_module_version_fn(const char *name);
 void stk_set_module_description_fn(const char *name);
 void stk_set_module_deps_sym(const char *name);
+void stk_set_module_threadsafe_sym(const char *name);
+void stk_set_module_descriptor_sym(const char *name);
 unsigned char stk_is_logging_enabled(void);
 
 #ifdef __cplusplus
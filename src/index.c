@@ -0,0 +1,431 @@
+#include "platform.h"
+#include "stk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Module index: every module file found under the module roots, merged
+ * into one entry per module file name. An entry keeps the list of files
+ * that provide it and which of them wins: the one in the root added last,
+ * then the lowest relative path. Watch events update it one file at a
+ * time, and only a change of winner, or a write to the winner, becomes a
+ * module event. */
+
+#define STK_INDEX_NONE ((size_t)-1)
+
+typedef struct {
+	unsigned long hash;
+	size_t sources;
+	size_t winner;
+	unsigned char dirty;
+	char name[STK_PATH_MAX];
+} stk_index_entry_t;
+
+typedef struct {
+	size_t root;
+	/* owning entry, STK_INDEX_NONE for a free slot */
+	size_t entry;
+	/* next source of the same entry, or next free slot */
+	size_t next;
+	unsigned char seen;
+	char rel[STK_PATH_MAX];
+} stk_index_source_t;
+
+unsigned long stk_hash_id(const char *id);
+
+static char stk_index_roots[STK_MOD_ROOTS_MAX][STK_PATH_MAX_OS];
+static size_t stk_index_root_total = 0;
+
+static stk_index_entry_t *stk_index = NULL;
+static size_t stk_index_count = 0;
+static size_t stk_index_capacity = 0;
+static size_t *stk_index_table = NULL;
+static size_t stk_index_table_capacity = 0;
+
+static stk_index_source_t *stk_sources = NULL;
+static size_t stk_source_count = 0;
+static size_t stk_source_capacity = 0;
+static size_t stk_source_free = STK_INDEX_NONE;
+
+static void stk_index_put(size_t e)
+{
+	size_t mask = stk_index_table_capacity - 1;
+	size_t slot = stk_index[e].hash & mask;
+
+	while (stk_index_table[slot] != STK_INDEX_NONE)
+		slot = (slot + 1) & mask;
+	stk_index_table[slot] = e;
+}
+
+static unsigned char stk_index_reserve(size_t count)
+{
+	size_t new_capacity, i;
+	size_t *new_table;
+	stk_index_entry_t *new_entries;
+
+	if (count > stk_index_capacity) {
+		new_capacity = stk_index_capacity ? stk_index_capacity : 16;
+		while (new_capacity < count)
+			new_capacity *= 2;
+
+		new_entries =
+		    realloc(stk_index, new_capacity * sizeof(stk_index_entry_t));
+		if (!new_entries)
+			return 0;
+		stk_index = new_entries;
+		stk_index_capacity = new_capacity;
+	}
+
+	if (count * 2 <= stk_index_table_capacity)
+		return 1;
+
+	new_capacity = stk_index_table_capacity ? stk_index_table_capacity : 32;
+	while (new_capacity < count * 2)
+		new_capacity *= 2;
+
+	new_table = malloc(new_capacity * sizeof(size_t));
+	if (!new_table)
+		return 0;
+
+	free(stk_index_table);
+	stk_index_table = new_table;
+	stk_index_table_capacity = new_capacity;
+	for (i = 0; i < new_capacity; i++)
+		stk_index_table[i] = STK_INDEX_NONE;
+	for (i = 0; i < stk_index_count; i++)
+		stk_index_put(i);
+
+	return 1;
+}
+
+static size_t stk_index_find(const char *name)
+{
+	size_t slot, mask, e;
+	unsigned long hash;
+
+	if (!stk_index_table_capacity)
+		return STK_INDEX_NONE;
+
+	hash = stk_hash_id(name);
+	mask = stk_index_table_capacity - 1;
+	slot = hash & mask;
+	while ((e = stk_index_table[slot]) != STK_INDEX_NONE) {
+		if (stk_index[e].hash == hash &&
+		    strcmp(stk_index[e].name, name) == 0)
+			return e;
+		slot = (slot + 1) & mask;
+	}
+
+	return STK_INDEX_NONE;
+}
+
+/* entries live as long as the index, the same way module ids are
+ * interned */
+static size_t stk_index_intern(const char *name)
+{
+	size_t e = stk_index_find(name);
+
+	if (e != STK_INDEX_NONE)
+		return e;
+
+	if (!stk_index_reserve(stk_index_count + 1))
+		return STK_INDEX_NONE;
+
+	e = stk_index_count++;
+	strncpy(stk_index[e].name, name, STK_PATH_MAX - 1);
+	stk_index[e].name[STK_PATH_MAX - 1] = '\0';
+	stk_index[e].hash = stk_hash_id(name);
+	stk_index[e].sources = STK_INDEX_NONE;
+	stk_index[e].winner = STK_INDEX_NONE;
+	stk_index[e].dirty = 0;
+	stk_index_put(e);
+
+	return e;
+}
+
+static size_t stk_source_alloc(void)
+{
+	size_t s, new_capacity;
+	stk_index_source_t *grown;
+
+	if (stk_source_free != STK_INDEX_NONE) {
+		s = stk_source_free;
+		stk_source_free = stk_sources[s].next;
+		return s;
+	}
+
+	if (stk_source_count == stk_source_capacity) {
+		new_capacity = stk_source_capacity ? stk_source_capacity * 2 : 16;
+		grown = realloc(stk_sources,
+				new_capacity * sizeof(stk_index_source_t));
+		if (!grown)
+			return STK_INDEX_NONE;
+		stk_sources = grown;
+		stk_source_capacity = new_capacity;
+	}
+
+	return stk_source_count++;
+}
+
+static void stk_source_release(size_t s)
+{
+	stk_index_entry_t *entry = &stk_index[stk_sources[s].entry];
+	size_t *link = &entry->sources;
+
+	while (*link != s)
+		link = &stk_sources[*link].next;
+	*link = stk_sources[s].next;
+
+	if (entry->winner == s)
+		entry->winner = STK_INDEX_NONE;
+
+	stk_sources[s].entry = STK_INDEX_NONE;
+	stk_sources[s].next = stk_source_free;
+	stk_source_free = s;
+}
+
+static size_t stk_source_find(size_t e, size_t root, const char *rel)
+{
+	size_t s;
+
+	for (s = stk_index[e].sources; s != STK_INDEX_NONE;
+	     s = stk_sources[s].next)
+		if (stk_sources[s].root == root &&
+		    strcmp(stk_sources[s].rel, rel) == 0)
+			return s;
+
+	return STK_INDEX_NONE;
+}
+
+/* later roots override earlier ones; within a root the lowest relative
+ * path wins so that the choice does not depend on scan order */
+static void stk_index_elect(size_t e)
+{
+	size_t s, best = STK_INDEX_NONE;
+
+	for (s = stk_index[e].sources; s != STK_INDEX_NONE;
+	     s = stk_sources[s].next) {
+		if (best == STK_INDEX_NONE ||
+		    stk_sources[s].root > stk_sources[best].root ||
+		    (stk_sources[s].root == stk_sources[best].root &&
+		     strcmp(stk_sources[s].rel, stk_sources[best].rel) < 0))
+			best = s;
+	}
+
+	stk_index[e].winner = best;
+}
+
+static const char *stk_index_basename(const char *rel)
+{
+	const char *base = strrchr(rel, STK_PATH_SEP);
+	return base ? base + 1 : rel;
+}
+
+size_t stk_index_add_root(const char *path)
+{
+	if (stk_index_root_total == STK_MOD_ROOTS_MAX)
+		return STK_INDEX_NONE;
+
+	strncpy(stk_index_roots[stk_index_root_total], path,
+		STK_PATH_MAX_OS - 1);
+	stk_index_roots[stk_index_root_total][STK_PATH_MAX_OS - 1] = '\0';
+	return stk_index_root_total++;
+}
+
+size_t stk_index_root_count(void)
+{
+	return stk_index_root_total;
+}
+
+const char *stk_index_root(size_t root)
+{
+	return stk_index_roots[root];
+}
+
+/* Records that the file rel under root was written (present) or removed.
+ * Returns 1 with the module file name and event in out_name and out_type
+ * when that changes what the module should be loaded from. */
+unsigned char stk_index_update(size_t root, const char *rel,
+			       unsigned char present, char *out_name,
+			       stk_module_event_t *out_type)
+{
+	const char *name = stk_index_basename(rel);
+	size_t e, s;
+
+	if (!present) {
+		e = stk_index_find(name);
+		if (e == STK_INDEX_NONE)
+			return 0;
+		s = stk_source_find(e, root, rel);
+		if (s == STK_INDEX_NONE)
+			return 0;
+
+		if (stk_index[e].winner != s) {
+			stk_source_release(s);
+			return 0;
+		}
+
+		stk_source_release(s);
+		stk_index_elect(e);
+		*out_type = stk_index[e].winner == STK_INDEX_NONE
+				? STK_MOD_UNLOAD
+				: STK_MOD_LOAD;
+		strcpy(out_name, stk_index[e].name);
+		return 1;
+	}
+
+	e = stk_index_intern(name);
+	if (e == STK_INDEX_NONE)
+		return 0;
+
+	s = stk_source_find(e, root, rel);
+	if (s == STK_INDEX_NONE) {
+		s = stk_source_alloc();
+		if (s == STK_INDEX_NONE)
+			return 0;
+		stk_sources[s].root = root;
+		stk_sources[s].entry = e;
+		strncpy(stk_sources[s].rel, rel, STK_PATH_MAX - 1);
+		stk_sources[s].rel[STK_PATH_MAX - 1] = '\0';
+		stk_sources[s].next = stk_index[e].sources;
+		stk_index[e].sources = s;
+		stk_index_elect(e);
+	}
+	stk_sources[s].seen = 1;
+
+	/* a write to a file that some other root overrides changes nothing */
+	if (stk_index[e].winner != s)
+		return 0;
+
+	*out_type = STK_MOD_LOAD;
+	strcpy(out_name, stk_index[e].name);
+	return 1;
+}
+
+/* full path of the file the module file name is loaded from. Returns 0 if
+ * no root provides it */
+unsigned char stk_index_path(const char *name, char *out_path)
+{
+	size_t e = stk_index_find(name), s;
+
+	if (e == STK_INDEX_NONE || stk_index[e].winner == STK_INDEX_NONE)
+		return 0;
+
+	s = stk_index[e].winner;
+	out_path[0] = '\0';
+	strncat(out_path, stk_index_roots[stk_sources[s].root],
+		STK_PATH_MAX_OS - 1);
+	strncat(out_path, STK_PATH_SEP_STR,
+		STK_PATH_MAX_OS - strlen(out_path) - 1);
+	strncat(out_path, stk_sources[s].rel,
+		STK_PATH_MAX_OS - strlen(out_path) - 1);
+	return 1;
+}
+
+/* starts a rescan: every file has to be reported again through
+ * stk_index_update() or stk_index_sweep() drops it */
+void stk_index_mark(void)
+{
+	size_t s;
+
+	for (s = 0; s < stk_source_count; s++)
+		stk_sources[s].seen = 0;
+}
+
+/* drops the files a rescan did not see and returns an event for every
+ * module whose winner went with them */
+size_t stk_index_sweep(stk_module_event_t **out_events,
+		       char (**out_names)[STK_PATH_MAX])
+{
+	size_t s, e, count = 0, i = 0;
+
+	*out_events = NULL;
+	*out_names = NULL;
+
+	for (s = 0; s < stk_source_count; s++) {
+		if (stk_sources[s].entry == STK_INDEX_NONE ||
+		    stk_sources[s].seen)
+			continue;
+
+		e = stk_sources[s].entry;
+		if (stk_index[e].winner == s && !stk_index[e].dirty) {
+			stk_index[e].dirty = 1;
+			count++;
+		}
+		stk_source_release(s);
+	}
+
+	if (count == 0)
+		return 0;
+
+	*out_events = malloc(count * sizeof(**out_events));
+	*out_names = malloc(count * sizeof(**out_names));
+
+	for (e = 0; e < stk_index_count && i < count; e++) {
+		if (!stk_index[e].dirty)
+			continue;
+
+		stk_index[e].dirty = 0;
+		stk_index_elect(e);
+		if (!*out_events || !*out_names)
+			continue;
+
+		(*out_events)[i] = stk_index[e].winner == STK_INDEX_NONE
+				       ? STK_MOD_UNLOAD
+				       : STK_MOD_LOAD;
+		memcpy((*out_names)[i], stk_index[e].name, STK_PATH_MAX);
+		i++;
+	}
+
+	if (i == 0) {
+		free(*out_events);
+		free(*out_names);
+		*out_events = NULL;
+		*out_names = NULL;
+	}
+
+	return i;
+}
+
+/* module file names that some root currently provides */
+size_t stk_index_winners(char (**out_names)[STK_PATH_MAX])
+{
+	size_t e, count = 0;
+
+	*out_names = NULL;
+	if (stk_index_count == 0)
+		return 0;
+
+	*out_names = malloc(stk_index_count * sizeof(**out_names));
+	if (!*out_names)
+		return 0;
+
+	for (e = 0; e < stk_index_count; e++)
+		if (stk_index[e].winner != STK_INDEX_NONE)
+			memcpy((*out_names)[count++], stk_index[e].name,
+			       STK_PATH_MAX);
+
+	if (count == 0) {
+		free(*out_names);
+		*out_names = NULL;
+	}
+
+	return count;
+}
+
+void stk_index_free(void)
+{
+	free(stk_index);
+	free(stk_index_table);
+	free(stk_sources);
+	stk_index = NULL;
+	stk_index_table = NULL;
+	stk_sources = NULL;
+	stk_index_count = 0;
+	stk_index_capacity = 0;
+	stk_index_table_capacity = 0;
+	stk_source_count = 0;
+	stk_source_capacity = 0;
+	stk_source_free = STK_INDEX_NONE;
+	stk_index_root_total = 0;
+}
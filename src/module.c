@@ -5,36 +5,135 @@
 #include <string.h>
 
 #define STK_MOD_FUNC_NAME_BUFFER 64
+#define STK_MOD_MIN_CAPACITY 16
 
 typedef int (*stk_init_mod_func)(void);
 typedef void (*stk_shutdown_mod_func)(void);
 
+#define STK_VERSION_PART_MAX ((unsigned long)-1)
+
 typedef struct {
-	unsigned char major;
-	unsigned char minor;
-	unsigned char patch;
-	char op;
+	unsigned long major;
+	unsigned long minor;
+	unsigned long patch;
 } stk_version_t;
 
+/* half-open interval [min, max) of acceptable versions. Every operator,
+ * and any combination of them, compiles down to one at preload */
+typedef struct {
+	stk_version_t min;
+	stk_version_t max;
+} stk_constraint_t;
+
+#define STK_MOD_META_NONE ((size_t)-1)
+#define STK_MOD_SLOT_NONE ((size_t)-1)
+#define STK_ATOM_NONE ((size_t)-1)
+#define STK_META(i) (stk_meta[stk_modules[i].meta])
+#define STK_ATOM_ID(a) (stk_atoms[a].id)
+#define STK_DEP_SLOT(i, d) (stk_atoms[stk_modules[i].deps[d].atom].slot)
+
 typedef struct {
 	char desc[STK_MOD_DESC_BUFFER];
 	char name[STK_MOD_NAME_BUFFER];
 	char id[STK_MOD_ID_BUFFER];
 	char version[STK_MOD_VERSION_BUFFER];
+} stk_mod_meta_t;
+
+typedef struct {
+	size_t atom;
+	stk_constraint_t constraint;
+	char version[STK_MOD_VERSION_BUFFER];
+} stk_mod_dep_t;
+
+typedef struct {
 	void *handle;
 	stk_init_mod_func init;
 	stk_shutdown_mod_func shutdown;
-	stk_dep_t *deps;
+	stk_mod_dep_t *deps;
 	size_t dep_count;
+	size_t meta;
+	size_t atom;
+	size_t order_pos;
+	unsigned long generation;
+	unsigned long mark;
+	stk_version_t version;
+	/* the module exports stk_mod_threadsafe_sym: its init may run on any
+	 * thread, alongside other inits */
+	unsigned char threadsafe;
+	/* symbol cache indexed by stk_symbol_id_t */
+	void **syms;
+	size_t sym_count;
 } stk_mod_t;
 
+typedef struct {
+	unsigned long hash;
+	char *name;
+} stk_symbol_t;
+
+typedef struct {
+	size_t entry;
+	unsigned long generation;
+} stk_waiter_t;
+
+typedef struct {
+	unsigned long hash;
+	int slot;
+	size_t pending;
+	size_t *users;
+	size_t user_count;
+	size_t user_capacity;
+	stk_waiter_t *waiters;
+	size_t waiter_count;
+	size_t waiter_capacity;
+	char id[STK_MOD_ID_BUFFER];
+} stk_atom_t;
+
+typedef struct {
+	char path[STK_PATH_MAX_OS];
+	size_t atom;
+	unsigned long generation;
+	unsigned char ready;
+} stk_pending_t;
+
+/* dependency graph in compressed sparse row form: node i depends on
+ * deps[dep_start[i] .. dep_start[i + 1]) and is required by
+ * users[user_start[i] .. user_start[i + 1]). node[] maps each dense node
+ * back to whatever the caller sorted (a slot or a batch position) */
+typedef struct {
+	size_t count;
+	size_t *node;
+	size_t *dense;
+	size_t *dep_start;
+	size_t *deps;
+	size_t *user_start;
+	size_t *users;
+} stk_graph_t;
+
 void *platform_load_library(const char *path);
 void platform_unload_library(void *handle);
 void *platform_get_symbol(void *handle, const char *symbol);
+unsigned char platform_same_library(const void *a, const void *b);
+size_t platform_symbol_size(const void *addr);
+unsigned char platform_read_module_deps(const char *path, const char *symbol,
+					const char *descriptor,
+					stk_dep_t **out_deps, size_t *out_count);
+void stk_parallel_run(size_t count, size_t threads,
+		      void (*fn)(void *arg, size_t i), void *arg);
+unsigned char platform_shadow_stage(const char *path, char *out, size_t size);
+void platform_shadow_unstage(const char *path, const char *staged,
+			     unsigned char loaded);
 
 stk_mod_t *stk_modules = NULL;
 
+/* cold metadata strings live in their own arena so registry scans and
+ * slot walks only touch the small hot records above */
+static stk_mod_meta_t *stk_meta = NULL;
+static size_t *stk_meta_free = NULL;
+static size_t stk_meta_capacity = 0;
+static size_t stk_meta_free_count = 0;
+
 extern unsigned char stk_flags;
+extern stk_stats_t stk_stats;
 
 static char stk_mod_init_name[STK_MOD_FUNC_NAME_BUFFER] = "stk_mod_init";
 static char stk_mod_shutdown_name[STK_MOD_FUNC_NAME_BUFFER] =
@@ -44,78 +143,279 @@ static char stk_mod_version_fn[STK_MOD_FUNC_NAME_BUFFER] = "stk_mod_version";
 static char stk_mod_description_fn[STK_MOD_FUNC_NAME_BUFFER] =
     "stk_mod_description";
 static char stk_mod_deps_sym[STK_MOD_FUNC_NAME_BUFFER] = "stk_mod_deps";
+static char stk_mod_threadsafe_sym[STK_MOD_FUNC_NAME_BUFFER] =
+    "stk_mod_init_threadsafe";
+static char stk_mod_descriptor_sym[STK_MOD_FUNC_NAME_BUFFER] =
+    "stk_mod_descriptor";
 
-size_t module_count = 0;
+/* threads running thread-safe inits, 0 or 1 to run every init in turn */
+static size_t stk_init_threads = 0;
 
-static char (*stk_pending)[STK_PATH_MAX_OS] = NULL;
+/* slot map: live modules never move. Freed slots go on a LIFO free list
+ * and every occupant gets a fresh generation from a global counter, so a
+ * stale handle can never match a later occupant of the same slot */
+size_t module_count = 0;
+size_t module_slots = 0;
+static size_t module_capacity = 0;
+static size_t *stk_slot_free = NULL;
+static size_t stk_slot_free_count = 0;
+static unsigned long stk_generation = 0;
+static unsigned char stk_slots_dirty = 0;
+
+/* every module id ever seen, either as a module or as a dependency, is
+ * interned once into an atom that records the slot currently holding it.
+ * Dependencies store atoms, so resolving an edge is a single array read
+ * and survives the target being unloaded and loaded into another slot */
+static stk_atom_t *stk_atoms = NULL;
+static size_t stk_atom_count = 0;
+static size_t stk_atom_capacity = 0;
+static size_t *stk_atom_table = NULL;
+static size_t stk_atom_table_capacity = 0;
+
+/* symbol names interned by stk_symbol_register(). Each module caches its
+ * lookups in an array indexed by symbol id that is filled in on first use
+ * and dropped with the module, so a reloaded module starts empty. Cache
+ * entries not looked up yet point at stk_symbol_unresolved; NULL is a
+ * symbol the module does not export */
+static stk_symbol_t *stk_symbols = NULL;
+static size_t stk_symbol_count = 0;
+static size_t stk_symbol_capacity = 0;
+/* stk_symbols index + 1 per slot, 0 for an empty one */
+static size_t *stk_symbol_table = NULL;
+static size_t stk_symbol_table_capacity = 0;
+static char stk_symbol_unresolved;
+
+/* load order kept between polls. Removal leaves a hole that is squeezed
+ * out once holes outnumber live entries; a newly activated module is
+ * appended and only its transitive dependents are moved behind it */
+static size_t *stk_order = NULL;
+static size_t stk_order_len = 0;
+static size_t stk_order_live = 0;
+static size_t stk_order_capacity = 0;
+static unsigned char stk_order_valid = 0;
+
+/* atoms whose module went away since the last revalidation; only their
+ * users need their dependencies rechecked */
+static size_t *stk_dirty = NULL;
+static size_t stk_dirty_count = 0;
+static size_t stk_dirty_capacity = 0;
+static unsigned char stk_dirty_overflow = 0;
+
+static unsigned long stk_mark = 0;
+
+/* deferred modules. An entry is examined (opened) only while it sits on
+ * the ready queue; otherwise it waits on the atoms of the dependencies it
+ * was missing and is put back on the queue when one of them activates.
+ * Each examination bumps the entry generation, which retires any waiter
+ * records left on other atoms by the previous one */
+static stk_pending_t *stk_pending = NULL;
+static size_t stk_pending_slots = 0;
+static size_t stk_pending_capacity = 0;
 static size_t stk_pending_count = 0;
+static size_t *stk_pending_free_list = NULL;
+static size_t stk_pending_free_count = 0;
+static size_t *stk_ready = NULL;
+static size_t stk_ready_count = 0;
+static size_t stk_ready_capacity = 0;
 
 void stk_pending_free(void)
 {
-	if (stk_pending) {
-		free(stk_pending);
-		stk_pending = NULL;
+	free(stk_pending);
+	stk_pending = NULL;
+	free(stk_pending_free_list);
+	stk_pending_free_list = NULL;
+	free(stk_ready);
+	stk_ready = NULL;
+
+	stk_pending_slots = stk_pending_capacity = stk_pending_count = 0;
+	stk_pending_free_count = 0;
+	stk_ready_count = stk_ready_capacity = 0;
+}
+
+static size_t stk_slot_acquire(void);
+static void stk_slot_release(size_t index);
+static void stk_order_insert(size_t index);
+static void stk_order_remove(size_t index);
+static void stk_pending_wake(size_t atom);
+void stk_module_discard(size_t index);
+
+static size_t stk_meta_acquire(void)
+{
+	stk_mod_meta_t *new_meta;
+	size_t *new_free;
+	size_t new_capacity, i;
+
+	if (stk_meta_free_count > 0)
+		return stk_meta_free[--stk_meta_free_count];
+
+	new_capacity = stk_meta_capacity ? stk_meta_capacity * 2 : 16;
+	new_meta = malloc(new_capacity * sizeof(*new_meta));
+	new_free = malloc(new_capacity * sizeof(*new_free));
+	if (!new_meta || !new_free) {
+		free(new_meta);
+		free(new_free);
+		return STK_MOD_META_NONE;
 	}
 
-	stk_pending_count = 0;
+	if (stk_meta)
+		memcpy(new_meta, stk_meta, stk_meta_capacity * sizeof(*stk_meta));
+
+	free(stk_meta);
+	free(stk_meta_free);
+	stk_meta = new_meta;
+	stk_meta_free = new_free;
+
+	for (i = new_capacity; i > stk_meta_capacity + 1; --i)
+		stk_meta_free[stk_meta_free_count++] = i - 1;
+
+	i = stk_meta_capacity;
+	stk_meta_capacity = new_capacity;
+	return i;
 }
 
-static stk_version_t stk_parse_version(const char *str)
+static void stk_meta_release(size_t meta)
 {
-	stk_version_t v;
-	v.major = 0;
-	v.minor = 0;
-	v.patch = 0;
-	v.op = '>';
-
-	if (!str || !*str)
-		return v;
-
-	if (*str == '=' && *(str + 1) != '=') {
-		v.op = '=';
-		str++;
-	} else if (*str == '>' && *(str + 1) == '=') {
-		v.op = '>';
-		str += 2;
-	} else if (*str == '^') {
-		v.op = '^';
-		str++;
-	}
-
-	v.major = (unsigned char)strtol(str, (char **)&str, 10);
-	if (*str == '.')
-		str++;
-	v.minor = (unsigned char)strtol(str, (char **)&str, 10);
-	if (*str == '.')
-		str++;
-	v.patch = (unsigned char)strtol(str, NULL, 10);
+	if (meta == STK_MOD_META_NONE)
+		return;
 
-	return v;
+	stk_meta[meta].id[0] = '\0';
+	stk_meta_free[stk_meta_free_count++] = meta;
+}
+
+static void stk_meta_free_all(void)
+{
+	free(stk_meta);
+	free(stk_meta_free);
+	stk_meta = NULL;
+	stk_meta_free = NULL;
+	stk_meta_capacity = 0;
+	stk_meta_free_count = 0;
+}
+
+/* reads "major[.minor[.patch]]" and returns the first character after
+ * it, or NULL when str does not start with a number */
+static const char *stk_parse_version(const char *str, stk_version_t *out)
+{
+	char *end;
+
+	out->major = out->minor = out->patch = 0;
+
+	if (!str || *str < '0' || *str > '9')
+		return NULL;
+
+	out->major = strtoul(str, &end, 10);
+	if (*end == '.' && end[1] >= '0' && end[1] <= '9') {
+		out->minor = strtoul(end + 1, &end, 10);
+		if (*end == '.' && end[1] >= '0' && end[1] <= '9')
+			out->patch = strtoul(end + 1, &end, 10);
+	}
+
+	return end;
 }
 
 static int stk_compare_version(stk_version_t a, stk_version_t b)
 {
 	if (a.major != b.major)
-		return a.major - b.major;
+		return a.major < b.major ? -1 : 1;
 	if (a.minor != b.minor)
-		return a.minor - b.minor;
-	return a.patch - b.patch;
+		return a.minor < b.minor ? -1 : 1;
+	if (a.patch != b.patch)
+		return a.patch < b.patch ? -1 : 1;
+	return 0;
+}
+
+/* smallest version greater than v */
+static stk_version_t stk_version_next(stk_version_t v)
+{
+	if (++v.patch == 0 && ++v.minor == 0)
+		++v.major;
+	return v;
 }
 
-static int stk_validate_constraint(const char *constraint, const char *loaded)
+/* compiles a constraint such as ">=1.2 <2.0" into one interval. Clauses
+ * are separated by spaces or commas and intersected; a bare version means
+ * ">=". Returns 0 if any clause could not be parsed, in which case that
+ * clause is ignored */
+static unsigned char stk_compile_constraint(const char *str,
+					    stk_constraint_t *out)
 {
-	stk_version_t req = stk_parse_version(constraint);
-	stk_version_t have = stk_parse_version(loaded);
-	int cmp = stk_compare_version(have, req);
+	stk_version_t v, lo, hi;
+	const char *end;
+	char op;
+	unsigned char ok = 1;
+
+	out->min.major = out->min.minor = out->min.patch = 0;
+	out->max.major = out->max.minor = out->max.patch = STK_VERSION_PART_MAX;
+
+	while (str && *str) {
+		if (*str == ' ' || *str == ',') {
+			str++;
+			continue;
+		}
 
-	switch (req.op) {
-	case '=':
-		return cmp == 0;
-	case '^':
-		return have.major == req.major && cmp >= 0;
-	default:
-		return cmp >= 0;
+		op = 'g';
+		if (str[0] == '>' && str[1] == '=') {
+			str += 2;
+		} else if (str[0] == '<' && str[1] == '=') {
+			op = 'l';
+			str += 2;
+		} else if (str[0] == '=' && str[1] == '=') {
+			op = '=';
+			str += 2;
+		} else if (*str == '>' || *str == '<' || *str == '=' ||
+			   *str == '^') {
+			op = *str++;
+		}
+
+		end = stk_parse_version(str, &v);
+		if (!end || (*end && *end != ' ' && *end != ',')) {
+			ok = 0;
+			while (*str && *str != ' ' && *str != ',')
+				str++;
+			continue;
+		}
+		str = end;
+
+		lo = out->min;
+		hi = out->max;
+		switch (op) {
+		case '=':
+			lo = v;
+			hi = stk_version_next(v);
+			break;
+		case '^':
+			lo = v;
+			hi.major = v.major + 1;
+			hi.minor = hi.patch = 0;
+			break;
+		case '>':
+			lo = stk_version_next(v);
+			break;
+		case '<':
+			hi = v;
+			break;
+		case 'l':
+			hi = stk_version_next(v);
+			break;
+		default:
+			lo = v;
+			break;
+		}
+
+		if (stk_compare_version(lo, out->min) > 0)
+			out->min = lo;
+		if (stk_compare_version(hi, out->max) < 0)
+			out->max = hi;
 	}
+
+	return ok;
+}
+
+static int stk_constraint_allows(const stk_constraint_t *c,
+				 stk_version_t have)
+{
+	return stk_compare_version(have, c->min) >= 0 &&
+	       stk_compare_version(have, c->max) < 0;
 }
 
 size_t stk_module_count(void) { return module_count; }
@@ -152,52 +452,222 @@ unsigned char is_valid_module_file(const char *filename)
 	return strcmp(ext, STK_MODULE_EXT) == 0;
 }
 
+unsigned long stk_hash_id(const char *id)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (*id) {
+		hash ^= (unsigned char)*id++;
+		hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+	}
+
+	return hash;
+}
+
+static void stk_atom_put(size_t atom)
+{
+	size_t slot, mask = stk_atom_table_capacity - 1;
+
+	slot = stk_atoms[atom].hash & mask;
+	while (stk_atom_table[slot] != STK_ATOM_NONE)
+		slot = (slot + 1) & mask;
+
+	stk_atom_table[slot] = atom;
+}
+
+static unsigned char stk_atom_reserve(size_t count)
+{
+	size_t new_capacity, i;
+	size_t *new_table;
+	stk_atom_t *new_atoms;
+
+	if (count > stk_atom_capacity) {
+		new_capacity = stk_atom_capacity ? stk_atom_capacity : 16;
+		while (new_capacity < count)
+			new_capacity *= 2;
+
+		new_atoms = realloc(stk_atoms, new_capacity * sizeof(stk_atom_t));
+		if (!new_atoms)
+			return STK_MOD_REALLOC_FAILURE;
+		stk_atoms = new_atoms;
+		stk_atom_capacity = new_capacity;
+	}
+
+	if (count * 2 <= stk_atom_table_capacity)
+		return STK_MOD_INIT_SUCCESS;
+
+	new_capacity = stk_atom_table_capacity ? stk_atom_table_capacity : 32;
+	while (new_capacity < count * 2)
+		new_capacity *= 2;
+
+	new_table = malloc(new_capacity * sizeof(size_t));
+	if (!new_table)
+		return STK_MOD_REALLOC_FAILURE;
+
+	free(stk_atom_table);
+	stk_atom_table = new_table;
+	stk_atom_table_capacity = new_capacity;
+	for (i = 0; i < new_capacity; i++)
+		stk_atom_table[i] = STK_ATOM_NONE;
+	for (i = 0; i < stk_atom_count; i++)
+		stk_atom_put(i);
+
+	return STK_MOD_INIT_SUCCESS;
+}
+
+static size_t stk_atom_find(const char *id)
+{
+	size_t slot, mask, atom;
+	unsigned long hash;
+
+	if (!stk_atom_count)
+		return STK_ATOM_NONE;
+
+	hash = stk_hash_id(id);
+	mask = stk_atom_table_capacity - 1;
+	slot = hash & mask;
+
+	while ((atom = stk_atom_table[slot]) != STK_ATOM_NONE) {
+		if (stk_atoms[atom].hash == hash &&
+		    strncmp(stk_atoms[atom].id, id, STK_MOD_ID_BUFFER) == 0)
+			return atom;
+		slot = (slot + 1) & mask;
+	}
+
+	return STK_ATOM_NONE;
+}
+
+static size_t stk_atom_intern(const char *id)
+{
+	size_t atom;
+
+	atom = stk_atom_find(id);
+	if (atom != STK_ATOM_NONE)
+		return atom;
+
+	if (stk_atom_reserve(stk_atom_count + 1) != STK_MOD_INIT_SUCCESS)
+		return STK_ATOM_NONE;
+
+	atom = stk_atom_count++;
+	strncpy(stk_atoms[atom].id, id, STK_MOD_ID_BUFFER - 1);
+	stk_atoms[atom].id[STK_MOD_ID_BUFFER - 1] = '\0';
+	stk_atoms[atom].hash = stk_hash_id(stk_atoms[atom].id);
+	stk_atoms[atom].slot = -1;
+	stk_atoms[atom].pending = STK_MOD_SLOT_NONE;
+	stk_atoms[atom].users = NULL;
+	stk_atoms[atom].user_count = 0;
+	stk_atoms[atom].user_capacity = 0;
+	stk_atoms[atom].waiters = NULL;
+	stk_atoms[atom].waiter_count = 0;
+	stk_atoms[atom].waiter_capacity = 0;
+	stk_atom_put(atom);
+
+	return atom;
+}
+
 int is_mod_loaded(const char *module_name)
+{
+	size_t atom = stk_atom_find(module_name);
+	return atom == STK_ATOM_NONE ? -1 : stk_atoms[atom].slot;
+}
+
+static unsigned char stk_atom_add_user(size_t atom, size_t index)
+{
+	stk_atom_t *a = &stk_atoms[atom];
+	size_t *new_users, new_capacity;
+
+	if (a->user_count == a->user_capacity) {
+		new_capacity = a->user_capacity ? a->user_capacity * 2 : 4;
+		new_users = realloc(a->users, new_capacity * sizeof(size_t));
+		if (!new_users)
+			return STK_MOD_REALLOC_FAILURE;
+		a->users = new_users;
+		a->user_capacity = new_capacity;
+	}
+
+	a->users[a->user_count++] = index;
+	return STK_MOD_INIT_SUCCESS;
+}
+
+static void stk_atom_remove_user(size_t atom, size_t index)
+{
+	stk_atom_t *a = &stk_atoms[atom];
+	size_t u;
+
+	for (u = 0; u < a->user_count; u++) {
+		if (a->users[u] == index) {
+			a->users[u] = a->users[--a->user_count];
+			return;
+		}
+	}
+}
+
+static void stk_dirty_add(size_t atom)
+{
+	size_t *new_dirty, new_capacity;
+
+	if (!stk_atoms[atom].user_count || stk_dirty_overflow)
+		return;
+
+	if (stk_dirty_count == stk_dirty_capacity) {
+		new_capacity = stk_dirty_capacity ? stk_dirty_capacity * 2 : 16;
+		new_dirty = realloc(stk_dirty, new_capacity * sizeof(size_t));
+		if (!new_dirty) {
+			/* fall back to checking every module next time */
+			stk_dirty_overflow = 1;
+			return;
+		}
+		stk_dirty = new_dirty;
+		stk_dirty_capacity = new_capacity;
+	}
+
+	stk_dirty[stk_dirty_count++] = atom;
+}
+
+static unsigned long stk_next_mark(void)
 {
 	size_t i;
 
-	for (i = 0; i < module_count; i++)
-		if (strncmp(stk_modules[i].id, module_name,
-			    STK_MOD_ID_BUFFER) == 0)
-			return i;
+	if (++stk_mark == 0) {
+		for (i = 0; i < module_slots; i++)
+			stk_modules[i].mark = 0;
+		++stk_mark;
+	}
 
-	return -1;
+	return stk_mark;
 }
 
-unsigned char stk_validate_dependencies(size_t count)
+unsigned char stk_validate_dependencies(void)
 {
 	size_t i, d;
 	int found;
 	unsigned char result = STK_MOD_INIT_SUCCESS;
 
-	for (i = 0; i < count; i++) {
-		if (stk_modules[i].dep_count == 0)
+	for (i = 0; i < module_slots; i++) {
+		if (!stk_modules[i].handle || stk_modules[i].dep_count == 0)
 			continue;
 
 		for (d = 0; d < stk_modules[i].dep_count; d++) {
-			found = is_mod_loaded(stk_modules[i].deps[d].id);
+			found = STK_DEP_SLOT(i, d);
 			if (found < 0) {
 				stk_log(STK_LOG_ERROR,
 					"Module '%s' requires '%s'",
-					stk_modules[i].id,
-					stk_modules[i].deps[d].id);
+					STK_META(i).id,
+					STK_ATOM_ID(stk_modules[i].deps[d].atom));
 				result = STK_MOD_DEP_NOT_FOUND_ERROR;
 				continue;
 			}
 
-			if (!stk_modules[i].deps[d].version[0])
-				continue;
-
-			if (!stk_validate_constraint(
-				stk_modules[i].deps[d].version,
+			if (!stk_constraint_allows(
+				&stk_modules[i].deps[d].constraint,
 				stk_modules[found].version)) {
 				stk_log(
 				    STK_LOG_ERROR,
 				    "Module '%s' requires '%s' %s but has %s",
-				    stk_modules[i].id,
-				    stk_modules[i].deps[d].id,
+				    STK_META(i).id,
+				    STK_ATOM_ID(stk_modules[i].deps[d].atom),
 				    stk_modules[i].deps[d].version,
-				    stk_modules[found].version);
+				    STK_META(found).version);
 				result = STK_MOD_DEP_VERSION_MISMATCH_ERROR;
 			}
 		}
@@ -206,67 +676,155 @@ unsigned char stk_validate_dependencies(size_t count)
 	return result;
 }
 
-typedef int (*stk_dep_query_fn)(size_t i, size_t j, void *ctx);
+static void stk_graph_free(stk_graph_t *g)
+{
+	free(g->node);
+	free(g->dense);
+	free(g->dep_start);
+	free(g->deps);
+	free(g->user_start);
+	free(g->users);
+	g->node = g->dense = g->dep_start = g->deps = NULL;
+	g->user_start = g->users = NULL;
+	g->count = 0;
+}
+
+/* derive the reverse adjacency from the forward one with a counting
+ * pass, so each node lists its dependents without any searching */
+static unsigned char stk_graph_link(stk_graph_t *g)
+{
+	size_t i, e, edges = g->dep_start[g->count];
+	size_t *cursor;
+
+	g->user_start = malloc((g->count + 1) * sizeof(size_t));
+	g->users = malloc((edges ? edges : 1) * sizeof(size_t));
+	cursor = malloc((g->count + 1) * sizeof(size_t));
+	if (!g->user_start || !g->users || !cursor) {
+		free(cursor);
+		return STK_MOD_REALLOC_FAILURE;
+	}
+
+	for (i = 0; i <= g->count; i++)
+		g->user_start[i] = 0;
+	for (e = 0; e < edges; e++)
+		g->user_start[g->deps[e] + 1]++;
+	for (i = 0; i < g->count; i++)
+		g->user_start[i + 1] += g->user_start[i];
+
+	for (i = 0; i <= g->count; i++)
+		cursor[i] = g->user_start[i];
+	for (i = 0; i < g->count; i++)
+		for (e = g->dep_start[i]; e < g->dep_start[i + 1]; e++)
+			g->users[cursor[g->deps[e]]++] = i;
+
+	free(cursor);
+	return STK_MOD_INIT_SUCCESS;
+}
+
+/* build the graph of loaded modules. Edges to dependencies that are not
+ * loaded are left out, as are self references */
+static unsigned char stk_graph_build(stk_graph_t *g)
+{
+	size_t i, n, d, edges;
+	int target;
+
+	g->count = 0;
+	g->node = g->dense = g->dep_start = g->deps = NULL;
+	g->user_start = g->users = NULL;
+
+	if (module_count == 0)
+		return STK_MOD_INIT_SUCCESS;
+
+	g->node = malloc(module_count * sizeof(size_t));
+	g->dense = malloc(module_slots * sizeof(size_t));
+	g->dep_start = malloc((module_count + 1) * sizeof(size_t));
+	if (!g->node || !g->dense || !g->dep_start)
+		goto fail;
+
+	n = edges = 0;
+	for (i = 0; i < module_slots; i++) {
+		g->dense[i] = STK_MOD_SLOT_NONE;
+		if (!stk_modules[i].handle)
+			continue;
+		g->dense[i] = n;
+		g->node[n++] = i;
+		edges += stk_modules[i].dep_count;
+	}
+	g->count = n;
+
+	g->deps = malloc((edges ? edges : 1) * sizeof(size_t));
+	if (!g->deps)
+		goto fail;
+
+	edges = 0;
+	for (n = 0; n < g->count; n++) {
+		i = g->node[n];
+		g->dep_start[n] = edges;
+		for (d = 0; d < stk_modules[i].dep_count; d++) {
+			target = STK_DEP_SLOT(i, d);
+			if (target < 0 || (size_t)target == i)
+				continue;
+			g->deps[edges++] = g->dense[target];
+		}
+	}
+	g->dep_start[g->count] = edges;
+
+	if (stk_graph_link(g) != STK_MOD_INIT_SUCCESS)
+		goto fail;
+
+	return STK_MOD_INIT_SUCCESS;
+
+fail:
+	stk_graph_free(g);
+	return STK_MOD_REALLOC_FAILURE;
+}
 
-static unsigned char stk_kahn_sort(size_t count, size_t *order,
-				   stk_dep_query_fn has_dep, void *ctx,
-				   void (*on_cycle)(size_t i))
+/* Kahn's algorithm over the reverse adjacency: O(V + E). order receives
+ * node values, dependencies first. Nodes left on a cycle are appended so
+ * order is always a full permutation */
+static unsigned char stk_kahn_sort(const stk_graph_t *g, size_t *order,
+				   void (*on_cycle)(size_t node))
 {
 	size_t *in_degree = NULL;
 	size_t *queue = NULL;
-	size_t head, tail, sorted, i, j;
+	size_t head, tail, sorted, i, e;
 	unsigned char result = STK_MOD_INIT_SUCCESS;
 
-	if (count == 0)
+	if (g->count == 0)
 		goto done;
 
-	in_degree = malloc(count * sizeof(size_t));
-	queue = malloc(count * sizeof(size_t));
+	in_degree = malloc(g->count * sizeof(size_t));
+	queue = malloc(g->count * sizeof(size_t));
 
 	if (!in_degree || !queue) {
 		result = STK_MOD_REALLOC_FAILURE;
 		goto done;
 	}
 
-	for (i = 0; i < count; i++)
-		in_degree[i] = 0;
-
-	for (i = 0; i < count; i++)
-		for (j = 0; j < count; j++)
-			if (i != j && has_dep(i, j, ctx))
-				in_degree[i]++;
-
 	head = tail = sorted = 0;
 
-	for (i = 0; i < count; i++)
+	for (i = 0; i < g->count; i++) {
+		in_degree[i] = g->dep_start[i + 1] - g->dep_start[i];
 		if (in_degree[i] == 0)
 			queue[tail++] = i;
+	}
 
 	while (head < tail) {
 		size_t mod = queue[head++];
-		order[sorted++] = mod;
+		order[sorted++] = g->node[mod];
 
-		for (i = 0; i < count; i++) {
-			if (i == mod || !has_dep(i, mod, ctx))
-				continue;
-			if (--in_degree[i] == 0)
-				queue[tail++] = i;
-		}
+		for (e = g->user_start[mod]; e < g->user_start[mod + 1]; e++)
+			if (--in_degree[g->users[e]] == 0)
+				queue[tail++] = g->users[e];
 	}
 
-	if (sorted != count) {
-		size_t k;
-		int in_order;
-		for (i = 0; i < count; i++) {
-			in_order = 0;
-			for (k = 0; k < sorted; k++) {
-				if (order[k] == i) {
-					in_order = 1;
-					break;
-				}
-			}
-			if (!in_order && on_cycle)
-				on_cycle(i);
+	if (sorted != g->count) {
+		for (i = 0; i < g->count; i++) {
+			if (in_degree[i] == 0)
+				continue;
+			if (on_cycle)
+				on_cycle(g->node[i]);
+			order[sorted++] = g->node[i];
 		}
 		result = STK_MOD_DEP_CIRCULAR_ERROR;
 	}
@@ -277,199 +835,736 @@ done:
 	return result;
 }
 
-static int stk_loaded_has_dep(size_t i, size_t j, void *ctx)
-{
-	size_t d;
-	(void)ctx;
-	for (d = 0; d < stk_modules[i].dep_count; d++)
-		if (is_mod_loaded(stk_modules[i].deps[d].id) == (int)j)
-			return 1;
-	return 0;
-}
-
-static void stk_log_cycle(size_t i)
+static void stk_log_cycle(size_t index)
 {
 	stk_log(STK_LOG_ERROR, "Circular dependency detected with %s",
-		stk_modules[i].id);
+		STK_META(index).id);
 }
 
-unsigned char stk_topo_sort(size_t count, size_t *order)
+static unsigned char stk_order_reserve(size_t count)
 {
-	return stk_kahn_sort(count, order, stk_loaded_has_dep, NULL,
-			     stk_log_cycle);
+	size_t new_capacity;
+	size_t *new_order;
+
+	if (count <= stk_order_capacity)
+		return STK_MOD_INIT_SUCCESS;
+
+	new_capacity = stk_order_capacity ? stk_order_capacity
+					  : STK_MOD_MIN_CAPACITY;
+	while (new_capacity < count)
+		new_capacity *= 2;
+
+	new_order = realloc(stk_order, new_capacity * sizeof(size_t));
+	if (!new_order)
+		return STK_MOD_REALLOC_FAILURE;
+
+	stk_order = new_order;
+	stk_order_capacity = new_capacity;
+	return STK_MOD_INIT_SUCCESS;
 }
 
-unsigned char stk_module_preload(const char *path, int index)
+static unsigned char stk_order_rebuild(void)
 {
-	void *handle;
-	char module_id[STK_MOD_ID_BUFFER];
-	size_t len;
-	union {
-		void *obj;
-		stk_init_mod_func init_func;
-		stk_shutdown_mod_func shutdown_func;
-		const char *(*meta_func)(void);
-	} u;
-	const char *meta_str;
-	const stk_dep_t *deps;
-	size_t dep_count;
-	stk_dep_t *dep_arr;
+	stk_graph_t g;
+	size_t i;
+	unsigned char result;
 
-	handle = platform_load_library(path);
-	if (!handle)
-		return STK_MOD_LIBRARY_LOAD_ERROR;
+	stk_order_valid = 0;
+	for (i = 0; i < module_slots; i++)
+		stk_modules[i].order_pos = STK_MOD_SLOT_NONE;
 
-	u.obj = platform_get_symbol(handle, stk_mod_init_name);
-	if (!u.obj) {
-		platform_unload_library(handle);
-		return STK_MOD_SYMBOL_NOT_FOUND_ERROR;
+	if (stk_graph_build(&g) != STK_MOD_INIT_SUCCESS ||
+	    stk_order_reserve(g.count) != STK_MOD_INIT_SUCCESS) {
+		stk_graph_free(&g);
+		return STK_MOD_REALLOC_FAILURE;
 	}
-	stk_modules[index].init = u.init_func;
 
-	u.obj = platform_get_symbol(handle, stk_mod_shutdown_name);
-	if (!u.obj) {
-		platform_unload_library(handle);
-		return STK_MOD_SYMBOL_NOT_FOUND_ERROR;
+	result = stk_kahn_sort(&g, stk_order, stk_log_cycle);
+	if (result != STK_MOD_REALLOC_FAILURE) {
+		stk_order_len = stk_order_live = g.count;
+		for (i = 0; i < g.count; i++)
+			stk_modules[stk_order[i]].order_pos = i;
+		stk_order_valid = 1;
 	}
-	stk_modules[index].shutdown = u.shutdown_func;
-
-	extract_module_id(path, module_id);
-
-	stk_modules[index].handle = handle;
 
-	len = strlen(module_id);
-	if (len >= STK_MOD_ID_BUFFER)
-		len = STK_MOD_ID_BUFFER - 1;
-	memcpy(stk_modules[index].id, module_id, len);
-	stk_modules[index].id[len] = '\0';
+	stk_stats.reordered += g.count;
+	stk_graph_free(&g);
+	return result;
+}
 
-	stk_modules[index].name[0] = '\0';
-	u.obj = platform_get_symbol(handle, stk_mod_name_fn);
-	if (u.obj) {
-		meta_str = u.meta_func();
-		if (meta_str) {
-			strncpy(stk_modules[index].name, meta_str,
-				STK_MOD_NAME_BUFFER - 1);
-			stk_modules[index].name[STK_MOD_NAME_BUFFER - 1] = '\0';
-		}
-	}
+static void stk_order_compact(void)
+{
+	size_t i, write = 0;
 
-	stk_modules[index].version[0] = '\0';
-	u.obj = platform_get_symbol(handle, stk_mod_version_fn);
-	if (u.obj) {
-		meta_str = u.meta_func();
-		if (meta_str) {
-			stk_version_t v = stk_parse_version(meta_str);
-			if (v.major == 0 && v.minor == 0 && v.patch == 0 &&
-			    meta_str[0] != '0') {
-				strncpy(stk_modules[index].version, "0.0.0",
-					STK_MOD_VERSION_BUFFER - 1);
-			} else {
-				strncpy(stk_modules[index].version, meta_str,
-					STK_MOD_VERSION_BUFFER - 1);
-			}
-			stk_modules[index].version[STK_MOD_VERSION_BUFFER - 1] =
-			    '\0';
-		}
-	}
-	if (!stk_modules[index].version[0])
-		strncpy(stk_modules[index].version, "0.0.0",
-			STK_MOD_VERSION_BUFFER - 1);
-
-	stk_modules[index].desc[0] = '\0';
-	u.obj = platform_get_symbol(handle, stk_mod_description_fn);
-	if (u.obj) {
-		meta_str = u.meta_func();
-		if (meta_str) {
-			strncpy(stk_modules[index].desc, meta_str,
-				STK_MOD_DESC_BUFFER - 1);
-			stk_modules[index].desc[STK_MOD_DESC_BUFFER - 1] = '\0';
-		}
+	for (i = 0; i < stk_order_len; i++) {
+		if (stk_order[i] == STK_MOD_SLOT_NONE)
+			continue;
+		stk_order[write] = stk_order[i];
+		stk_modules[stk_order[write]].order_pos = write;
+		write++;
 	}
 
-	stk_modules[index].deps = NULL;
-	stk_modules[index].dep_count = 0;
-	u.obj = platform_get_symbol(handle, stk_mod_deps_sym);
-	if (!u.obj)
-		goto skip_deps;
+	stk_order_len = write;
+}
 
-	deps = (const stk_dep_t *)u.obj;
+static void stk_order_push(size_t index)
+{
+	if (stk_order_reserve(stk_order_len + 1) != STK_MOD_INIT_SUCCESS) {
+		stk_order_valid = 0;
+		return;
+	}
 
-	dep_count = 0;
-	while (deps[dep_count].id[0] != '\0')
-		dep_count++;
+	stk_order[stk_order_len] = index;
+	stk_modules[index].order_pos = stk_order_len++;
+	stk_order_live++;
+}
 
-	if (dep_count == 0)
-		goto skip_deps;
+static void stk_order_remove(size_t index)
+{
+	size_t pos = stk_modules[index].order_pos;
 
-	dep_arr = malloc(dep_count * sizeof(stk_dep_t));
-	if (!dep_arr)
-		goto skip_deps;
+	if (pos == STK_MOD_SLOT_NONE)
+		return;
 
-	{
-		size_t d;
-		for (d = 0; d < dep_count; d++) {
-			strncpy(dep_arr[d].id, deps[d].id,
-				STK_MOD_ID_BUFFER - 1);
-			dep_arr[d].id[STK_MOD_ID_BUFFER - 1] = '\0';
-			strncpy(dep_arr[d].version, deps[d].version,
-				STK_MOD_VERSION_BUFFER - 1);
-			dep_arr[d].version[STK_MOD_VERSION_BUFFER - 1] = '\0';
-		}
-	}
+	stk_modules[index].order_pos = STK_MOD_SLOT_NONE;
+	if (!stk_order_valid)
+		return;
 
-	stk_modules[index].deps = dep_arr;
-	stk_modules[index].dep_count = dep_count;
+	stk_order[pos] = STK_MOD_SLOT_NONE;
+	stk_order_live--;
 
-skip_deps:
-	return STK_MOD_INIT_SUCCESS;
+	if (stk_order_len > STK_MOD_MIN_CAPACITY &&
+	    stk_order_len > stk_order_live * 2)
+		stk_order_compact();
 }
 
-void stk_module_discard(size_t index)
+static int stk_order_compare(const void *a, const void *b)
 {
-	platform_unload_library(stk_modules[index].handle);
-	stk_modules[index].handle = NULL;
-	stk_modules[index].init = NULL;
-	stk_modules[index].shutdown = NULL;
-	stk_modules[index].id[0] = '\0';
-	stk_modules[index].name[0] = '\0';
-	stk_modules[index].version[0] = '\0';
-	stk_modules[index].desc[0] = '\0';
-	if (stk_modules[index].deps) {
-		free(stk_modules[index].deps);
-		stk_modules[index].deps = NULL;
-	}
-	stk_modules[index].dep_count = 0;
-}
+	size_t pa = stk_modules[*(const size_t *)a].order_pos;
+	size_t pb = stk_modules[*(const size_t *)b].order_pos;
 
-unsigned char stk_module_activate(size_t index)
-{
-	if (stk_modules[index].init() != STK_MOD_INIT_SUCCESS) {
-		stk_module_discard(index);
-		return STK_MOD_INIT_FAILURE;
-	}
-	return STK_MOD_INIT_SUCCESS;
+	return pa < pb ? -1 : pa > pb;
 }
 
-unsigned char stk_validate_dependencies_single(size_t index)
+/* a module activated after its dependencies can simply go last, unless
+ * loaded modules already depend on it (a reload). Those dependents are
+ * lifted out and re-appended behind it in their existing relative order,
+ * so the work is bounded by the size of that subgraph */
+static void stk_order_insert(size_t index)
 {
-	size_t d;
-	int found;
+	size_t *moved = NULL;
+	size_t count = 0, head, u, d, user;
+	unsigned long mark;
+	int target;
 
-	if (stk_modules[index].dep_count == 0)
-		return STK_MOD_INIT_SUCCESS;
+	if (!stk_order_valid || stk_modules[index].order_pos != STK_MOD_SLOT_NONE)
+		return;
 
-	for (d = 0; d < stk_modules[index].dep_count; d++) {
-		found = is_mod_loaded(stk_modules[index].deps[d].id);
-		if (found < 0)
-			return STK_MOD_DEP_NOT_FOUND_ERROR;
-		if (stk_modules[index].deps[d].version[0] &&
-		    !stk_validate_constraint(stk_modules[index].deps[d].version,
-					     stk_modules[found].version))
-			return STK_MOD_DEP_VERSION_MISMATCH_ERROR;
+	if (!stk_atoms[stk_modules[index].atom].user_count) {
+		stk_order_push(index);
+		stk_stats.reordered++;
+		return;
 	}
 
-	return STK_MOD_INIT_SUCCESS;
+	moved = malloc(module_count * sizeof(size_t));
+	if (!moved) {
+		stk_order_valid = 0;
+		return;
+	}
+
+	mark = stk_next_mark();
+	stk_modules[index].mark = mark;
+
+	for (head = 0, user = index;; user = moved[head++]) {
+		stk_atom_t *a = &stk_atoms[stk_modules[user].atom];
+		for (u = 0; u < a->user_count; u++) {
+			size_t next = a->users[u];
+			if (stk_modules[next].mark == mark ||
+			    stk_modules[next].order_pos == STK_MOD_SLOT_NONE)
+				continue;
+			stk_modules[next].mark = mark;
+			moved[count++] = next;
+		}
+		if (head == count)
+			break;
+	}
+
+	for (d = 0; d < stk_modules[index].dep_count; d++) {
+		target = STK_DEP_SLOT(index, d);
+		if (target >= 0 && (size_t)target != index &&
+		    stk_modules[target].mark == mark) {
+			stk_log_cycle(index);
+			break;
+		}
+	}
+
+	qsort(moved, count, sizeof(size_t), stk_order_compare);
+	for (u = 0; u < count; u++) {
+		stk_order[stk_modules[moved[u]].order_pos] = STK_MOD_SLOT_NONE;
+		stk_modules[moved[u]].order_pos = STK_MOD_SLOT_NONE;
+		stk_order_live--;
+	}
+
+	stk_order_push(index);
+	for (u = 0; u < count && stk_order_valid; u++)
+		stk_order_push(moved[u]);
+
+	stk_stats.reordered += count + 1;
+	free(moved);
+
+	if (stk_order_valid && stk_order_len > stk_order_live * 2)
+		stk_order_compact();
+}
+
+unsigned char stk_topo_sort(size_t *order, size_t *count)
+{
+	size_t i;
+	unsigned char result;
+
+	*count = 0;
+	result = stk_order_rebuild();
+	if (!stk_order_valid)
+		return result;
+
+	for (i = 0; i < stk_order_len; i++)
+		order[(*count)++] = stk_order[i];
+
+	return result;
+}
+
+/* what stk_module_open() reads out of a module. Nothing in it refers to
+ * the registry, so modules can be opened on any thread and registered
+ * later on the one that owns the registry */
+typedef struct {
+	void *handle;
+	stk_init_mod_func init;
+	stk_shutdown_mod_func shutdown;
+	stk_mod_meta_t meta;
+	const stk_dep_t *deps;
+	size_t dep_count;
+	unsigned char threadsafe;
+} stk_mod_opened_t;
+
+static void stk_meta_set(char *dst, size_t size, const char *str)
+{
+	dst[0] = '\0';
+	if (str) {
+		strncpy(dst, str, size - 1);
+		dst[size - 1] = '\0';
+	}
+}
+
+static void stk_meta_copy(char *dst, size_t size, void *sym)
+{
+	union {
+		void *obj;
+		const char *(*meta_func)(void);
+	} u;
+
+	dst[0] = '\0';
+	if (!sym)
+		return;
+
+	u.obj = sym;
+	stk_meta_set(dst, size, u.meta_func());
+}
+
+/* the module's stk_mod_descriptor_sym, if it exports one in a layout this
+ * build understands. what names the module in the warning otherwise */
+static const stk_mod_descriptor_t *stk_descriptor_find(void *handle,
+							const char *what)
+{
+	const stk_mod_descriptor_t *d;
+
+	d = (const stk_mod_descriptor_t *)platform_get_symbol(
+	    handle, stk_mod_descriptor_sym);
+	if (!d)
+		return NULL;
+
+	if (d->abi < 1 || d->size < sizeof(*d)) {
+		stk_log(STK_LOG_WARN,
+			"Module '%s': ignoring descriptor of version %lu, "
+			"size %lu",
+			what, d->abi, (unsigned long)d->size);
+		return NULL;
+	}
+	return d;
+}
+
+/* the dependency table of a descriptor, normally the one it points at.
+ * Where the loader does not bind a module to itself first, a pointer to
+ * an exported table can be bound to another module's table of the same
+ * name; the module's own stk_mod_deps_sym is read instead, up to its own
+ * end: its symbol size where the loader reports one, otherwise its
+ * terminating entry, never beyond dep_count. A terminating entry is not a
+ * dep. Returns 0 if the module has no table of its own to fall back on */
+static unsigned char stk_descriptor_deps(void *handle,
+					 const stk_mod_descriptor_t *d,
+					 const stk_dep_t **out_deps,
+					 size_t *out_count)
+{
+	const stk_dep_t *deps = d->deps;
+	size_t count = deps ? d->dep_count : 0, size;
+
+	if (count > 0 && !platform_same_library(deps, d)) {
+		deps = (const stk_dep_t *)platform_get_symbol(handle,
+							      stk_mod_deps_sym);
+		if (!deps || !platform_same_library(deps, d))
+			return 0;
+
+		size = platform_symbol_size(deps);
+		if (size > 0) {
+			count = size / sizeof(stk_dep_t);
+		} else {
+			size = count;
+			count = 0;
+			while (count < size && deps[count].id[0] != '\0')
+				count++;
+		}
+	}
+
+	while (count > 0 && deps[count - 1].id[0] == '\0')
+		count--;
+	*out_deps = deps;
+	*out_count = count;
+	return 1;
+}
+
+/* an entry point of the module that exports descriptor d: the one the
+ * descriptor names, or the module's own export of name where the loader
+ * bound the descriptor's pointer into another module. NULL if neither
+ * lies in the module */
+static void *stk_descriptor_entry(void *handle,
+				  const stk_mod_descriptor_t *d,
+				  const char *name, void *entry)
+{
+	void *own;
+
+	if (entry && platform_same_library(entry, d))
+		return entry;
+
+	own = platform_get_symbol(handle, name);
+	if (own && platform_same_library(own, d))
+		return own;
+	return NULL;
+}
+
+/* one symbol lookup for everything: the descriptor holds the entry
+ * points, the metadata strings and a counted dependency table */
+static unsigned char stk_module_describe(stk_mod_opened_t *m,
+					 const stk_mod_descriptor_t *d)
+{
+	union {
+		void *obj;
+		stk_init_mod_func init_func;
+		stk_shutdown_mod_func shutdown_func;
+	} u;
+
+	if (!d->init || !d->shutdown)
+		return 0;
+
+	u.init_func = d->init;
+	u.obj = stk_descriptor_entry(m->handle, d, stk_mod_init_name, u.obj);
+	if (!u.obj)
+		goto foreign;
+	m->init = u.init_func;
+
+	u.shutdown_func = d->shutdown;
+	u.obj = stk_descriptor_entry(m->handle, d, stk_mod_shutdown_name,
+				     u.obj);
+	if (!u.obj)
+		goto foreign;
+	m->shutdown = u.shutdown_func;
+
+	stk_meta_set(m->meta.name, STK_MOD_NAME_BUFFER, d->name);
+	stk_meta_set(m->meta.version, STK_MOD_VERSION_BUFFER, d->version);
+	stk_meta_set(m->meta.desc, STK_MOD_DESC_BUFFER, d->description);
+	if (!stk_descriptor_deps(m->handle, d, &m->deps, &m->dep_count))
+		goto foreign;
+	m->threadsafe = d->threadsafe != 0;
+	return 1;
+
+foreign:
+	stk_log(STK_LOG_ERROR,
+		"Module '%s': descriptor points into another module",
+		m->meta.id);
+	return 0;
+}
+
+/* a module without a descriptor: every entry point and metadata
+ * function is its own symbol, and the dependency table ends at a
+ * sentinel entry */
+static unsigned char stk_module_lookup(stk_mod_opened_t *m)
+{
+	union {
+		void *obj;
+		stk_init_mod_func init_func;
+		stk_shutdown_mod_func shutdown_func;
+	} u;
+
+	u.obj = platform_get_symbol(m->handle, stk_mod_init_name);
+	if (!u.obj)
+		return 0;
+	m->init = u.init_func;
+
+	u.obj = platform_get_symbol(m->handle, stk_mod_shutdown_name);
+	if (!u.obj)
+		return 0;
+	m->shutdown = u.shutdown_func;
+
+	stk_meta_copy(m->meta.name, STK_MOD_NAME_BUFFER,
+		      platform_get_symbol(m->handle, stk_mod_name_fn));
+	stk_meta_copy(m->meta.version, STK_MOD_VERSION_BUFFER,
+		      platform_get_symbol(m->handle, stk_mod_version_fn));
+	stk_meta_copy(m->meta.desc, STK_MOD_DESC_BUFFER,
+		      platform_get_symbol(m->handle, stk_mod_description_fn));
+
+	m->deps = (const stk_dep_t *)platform_get_symbol(m->handle,
+							 stk_mod_deps_sym);
+	m->dep_count = 0;
+	while (m->deps && m->deps[m->dep_count].id[0] != '\0')
+		m->dep_count++;
+
+	m->threadsafe =
+	    platform_get_symbol(m->handle, stk_mod_threadsafe_sym) != NULL;
+	return 1;
+}
+
+/* loads the library at path and reads its entry points, metadata and
+ * dependency table. Safe to call from any thread; the result is handed
+ * to stk_module_register() or stk_module_close() */
+void *stk_module_open(const char *path, unsigned char *out_result)
+{
+	stk_mod_opened_t *m;
+	const stk_mod_descriptor_t *d;
+	stk_version_t v;
+
+	m = malloc(sizeof(*m));
+	if (!m) {
+		*out_result = STK_MOD_REALLOC_FAILURE;
+		return NULL;
+	}
+
+	m->handle = platform_load_library(path);
+	if (!m->handle) {
+		free(m);
+		*out_result = STK_MOD_LIBRARY_LOAD_ERROR;
+		return NULL;
+	}
+
+	extract_module_id(path, m->meta.id);
+
+	d = stk_descriptor_find(m->handle, m->meta.id);
+	if (d ? !stk_module_describe(m, d) : !stk_module_lookup(m))
+		goto missing;
+
+	if (m->meta.version[0] && !stk_parse_version(m->meta.version, &v))
+		m->meta.version[0] = '\0';
+	if (!m->meta.version[0])
+		strcpy(m->meta.version, "0.0.0");
+
+	*out_result = STK_MOD_INIT_SUCCESS;
+	return m;
+
+missing:
+	platform_unload_library(m->handle);
+	free(m);
+	*out_result = STK_MOD_SYMBOL_NOT_FOUND_ERROR;
+	return NULL;
+}
+
+/* unloads a module opened by stk_module_open() that is not going to be
+ * registered */
+void stk_module_close(void *opened)
+{
+	stk_mod_opened_t *m = (stk_mod_opened_t *)opened;
+
+	if (!m)
+		return;
+	platform_unload_library(m->handle);
+	free(m);
+}
+
+/* adds a module opened by stk_module_open() to the registry, unloaded
+ * and not yet initialized. opened is consumed either way */
+unsigned char stk_module_register(void *opened, size_t *out_index)
+{
+	stk_mod_opened_t *m = (stk_mod_opened_t *)opened;
+	size_t index;
+	stk_mod_dep_t *dep_arr = NULL;
+	stk_mod_meta_t *meta;
+	size_t meta_index;
+	size_t atom, d;
+
+	atom = stk_atom_intern(m->meta.id);
+	if (atom == STK_ATOM_NONE)
+		goto fail;
+
+	/* a module whose deps cannot be recorded is not registered at all,
+	 * since it would otherwise be activated unchecked */
+	if (m->dep_count > 0) {
+		dep_arr = malloc(m->dep_count * sizeof(stk_mod_dep_t));
+		if (!dep_arr)
+			goto fail;
+
+		for (d = 0; d < m->dep_count; d++) {
+			dep_arr[d].atom = stk_atom_intern(m->deps[d].id);
+			if (dep_arr[d].atom == STK_ATOM_NONE)
+				goto fail;
+			memcpy(dep_arr[d].version, m->deps[d].version,
+			       STK_MOD_VERSION_BUFFER);
+			dep_arr[d].version[STK_MOD_VERSION_BUFFER - 1] = '\0';
+			if (!stk_compile_constraint(dep_arr[d].version,
+						    &dep_arr[d].constraint))
+				stk_log(STK_LOG_WARN,
+					"Module '%s': ignoring malformed part "
+					"of constraint '%s' on '%s'",
+					m->meta.id, dep_arr[d].version,
+					m->deps[d].id);
+		}
+	}
+
+	index = stk_slot_acquire();
+	if (index == STK_MOD_SLOT_NONE)
+		goto fail;
+
+	meta_index = stk_meta_acquire();
+	if (meta_index == STK_MOD_META_NONE) {
+		stk_slot_release(index);
+		goto fail;
+	}
+	stk_modules[index].init = m->init;
+	stk_modules[index].shutdown = m->shutdown;
+	stk_modules[index].meta = meta_index;
+	meta = &stk_meta[meta_index];
+	memcpy(meta, &m->meta, sizeof(*meta));
+
+	stk_modules[index].handle = m->handle;
+	stk_modules[index].atom = atom;
+	stk_modules[index].threadsafe = m->threadsafe;
+	stk_modules[index].syms = NULL;
+	stk_modules[index].sym_count = 0;
+	stk_parse_version(meta->version, &stk_modules[index].version);
+
+	stk_modules[index].deps = dep_arr;
+	stk_modules[index].dep_count = dep_arr ? m->dep_count : 0;
+
+	free(m);
+	stk_atoms[atom].slot = (int)index;
+	stk_modules[index].order_pos = STK_MOD_SLOT_NONE;
+	stk_modules[index].mark = 0;
+
+	for (d = 0; d < stk_modules[index].dep_count; d++) {
+		if (stk_atom_add_user(stk_modules[index].deps[d].atom, index) !=
+		    STK_MOD_INIT_SUCCESS) {
+			stk_module_discard(index);
+			return STK_MOD_REALLOC_FAILURE;
+		}
+	}
+
+	*out_index = index;
+	return STK_MOD_INIT_SUCCESS;
+
+fail:
+	free(dep_arr);
+	stk_module_close(m);
+	return STK_MOD_REALLOC_FAILURE;
+}
+
+unsigned char stk_module_preload(const char *path, size_t *out_index)
+{
+	unsigned char result;
+	void *opened = stk_module_open(path, &result);
+
+	if (!opened)
+		return result;
+	return stk_module_register(opened, out_index);
+}
+
+static void stk_module_clear(size_t index)
+{
+	size_t d;
+
+	for (d = 0; d < stk_modules[index].dep_count; d++)
+		stk_atom_remove_user(stk_modules[index].deps[d].atom, index);
+	stk_order_remove(index);
+	stk_dirty_add(stk_modules[index].atom);
+
+	free(stk_modules[index].syms);
+	stk_modules[index].syms = NULL;
+	stk_modules[index].sym_count = 0;
+	stk_meta_release(stk_modules[index].meta);
+	stk_modules[index].meta = STK_MOD_META_NONE;
+	stk_modules[index].handle = NULL;
+	stk_modules[index].init = NULL;
+	stk_modules[index].shutdown = NULL;
+	stk_modules[index].atom = STK_ATOM_NONE;
+	if (stk_modules[index].deps) {
+		free(stk_modules[index].deps);
+		stk_modules[index].deps = NULL;
+	}
+	stk_modules[index].dep_count = 0;
+	stk_slot_release(index);
+}
+
+void stk_module_discard(size_t index)
+{
+	if (!stk_modules[index].handle)
+		return;
+
+	stk_atoms[stk_modules[index].atom].slot = -1;
+	platform_unload_library(stk_modules[index].handle);
+	stk_module_clear(index);
+}
+
+/* finishes activating index once its init has returned rc: a failed
+ * module is discarded, a working one joins the load order and wakes what
+ * was deferred on it */
+unsigned char stk_module_commit(size_t index, int rc)
+{
+	if (rc != STK_MOD_INIT_SUCCESS) {
+		stk_module_discard(index);
+		return STK_MOD_INIT_FAILURE;
+	}
+
+	stk_stats.loaded++;
+	stk_order_insert(index);
+	stk_pending_wake(stk_modules[index].atom);
+	return STK_MOD_INIT_SUCCESS;
+}
+
+unsigned char stk_module_activate(size_t index)
+{
+	return stk_module_commit(index, stk_modules[index].init());
+}
+
+typedef struct {
+	const size_t *indices;
+	int *rc;
+} stk_init_batch_t;
+
+static void stk_init_worker(void *arg, size_t i)
+{
+	stk_init_batch_t *b = (stk_init_batch_t *)arg;
+
+	b->rc[i] = stk_modules[b->indices[i]].init();
+}
+
+/* runs the inits of count preloaded modules, none of which depends on
+ * another, into out_rc for stk_module_commit(). Thread-safe ones run
+ * together on the init threads; the rest follow one at a time on the
+ * calling thread. Nothing in the registry changes here */
+void stk_module_run_inits(const size_t *indices, size_t count, int *out_rc)
+{
+	stk_init_batch_t b;
+	size_t *safe = NULL;
+	int *safe_rc = NULL;
+	size_t i, k, safe_count = 0;
+
+	if (stk_init_threads > 1 && count > 1) {
+		safe = malloc(count * sizeof(size_t));
+		safe_rc = malloc(count * sizeof(int));
+	}
+	if (safe && safe_rc)
+		for (i = 0; i < count; i++)
+			if (stk_modules[indices[i]].threadsafe)
+				safe[safe_count++] = indices[i];
+
+	/* a lone thread-safe module gains nothing from the pool */
+	if (safe_count < 2)
+		safe_count = 0;
+
+	if (safe_count > 0) {
+		b.indices = safe;
+		b.rc = safe_rc;
+		stk_parallel_run(safe_count, stk_init_threads, stk_init_worker,
+				 &b);
+	}
+
+	for (i = 0, k = 0; i < count; i++) {
+		if (safe_count > 0 && stk_modules[indices[i]].threadsafe)
+			out_rc[i] = safe_rc[k++];
+		else
+			out_rc[i] = stk_modules[indices[i]].init();
+	}
+
+	free(safe);
+	free(safe_rc);
+}
+
+/* groups order, a topological order of preloaded modules, into levels:
+ * level 0 holds the modules with no preloaded dependency and every other
+ * module sits one level above its deepest dependency, so the modules of
+ * a level can initialize together. Reorders order by level, keeping the
+ * order within each, and writes each entry's level to out_level. Returns
+ * 0, leaving order alone, when inits run one at a time anyway */
+unsigned char stk_module_levels(size_t *order, size_t count,
+				size_t *out_level)
+{
+	size_t *depth, *start, *sorted;
+	size_t j, d, level, max = 0;
+	int found;
+
+	if (stk_init_threads < 2 || count < 2)
+		return 0;
+
+	/* depth[slot] is the level of the module in slot plus one */
+	depth = calloc(module_slots, sizeof(size_t));
+	start = calloc(count + 1, sizeof(size_t));
+	sorted = malloc(count * sizeof(size_t));
+	if (!depth || !start || !sorted) {
+		free(depth);
+		free(start);
+		free(sorted);
+		return 0;
+	}
+
+	for (j = 0; j < count; j++) {
+		level = 0;
+		for (d = 0; d < stk_modules[order[j]].dep_count; d++) {
+			found = STK_DEP_SLOT(order[j], d);
+			if (found >= 0 && depth[found] > level)
+				level = depth[found];
+		}
+		depth[order[j]] = level + 1;
+		if (level > max)
+			max = level;
+		start[level + 1]++;
+	}
+
+	for (level = 0; level < max; level++)
+		start[level + 1] += start[level];
+	for (j = 0; j < count; j++) {
+		level = depth[order[j]] - 1;
+		out_level[start[level]] = level;
+		sorted[start[level]++] = order[j];
+	}
+	memcpy(order, sorted, count * sizeof(size_t));
+
+	free(depth);
+	free(start);
+	free(sorted);
+	return 1;
+}
+
+unsigned char stk_validate_dependencies_single(size_t index)
+{
+	size_t d;
+	int found;
+
+	if (stk_modules[index].dep_count == 0)
+		return STK_MOD_INIT_SUCCESS;
+
+	for (d = 0; d < stk_modules[index].dep_count; d++) {
+		found = STK_DEP_SLOT(index, d);
+		if (found < 0)
+			return STK_MOD_DEP_NOT_FOUND_ERROR;
+		if (!stk_constraint_allows(&stk_modules[index].deps[d].constraint,
+					   stk_modules[found].version))
+			return STK_MOD_DEP_VERSION_MISMATCH_ERROR;
+	}
+
+	return STK_MOD_INIT_SUCCESS;
 }
 
 void stk_log_dependency_failures(size_t index, const char *action)
@@ -484,12 +1579,11 @@ void stk_log_dependency_failures(size_t index, const char *action)
 
 	pos = 0;
 	for (d = 0; d < stk_modules[index].dep_count; d++) {
-		found = is_mod_loaded(stk_modules[index].deps[d].id);
+		found = STK_DEP_SLOT(index, d);
 
 		if (found >= 0 &&
-		    (!stk_modules[index].deps[d].version[0] ||
-		     stk_validate_constraint(stk_modules[index].deps[d].version,
-					     stk_modules[found].version)))
+		    stk_constraint_allows(&stk_modules[index].deps[d].constraint,
+					  stk_modules[found].version))
 			continue;
 
 		if (!first && pos < sizeof(buf) - 2) {
@@ -499,18 +1593,22 @@ void stk_log_dependency_failures(size_t index, const char *action)
 		first = 0;
 
 		if (found < 0) {
-			len = strlen(stk_modules[index].deps[d].id);
+			len = strlen(
+			    STK_ATOM_ID(stk_modules[index].deps[d].atom));
 			if (pos + len + 12 < sizeof(buf)) {
-				memcpy(buf + pos, stk_modules[index].deps[d].id,
+				memcpy(buf + pos,
+				       STK_ATOM_ID(stk_modules[index].deps[d].atom),
 				       len);
 				pos += len;
 				memcpy(buf + pos, " (not found)", 12);
 				pos += 12;
 			}
 		} else {
-			len = strlen(stk_modules[index].deps[d].id);
+			len = strlen(
+			    STK_ATOM_ID(stk_modules[index].deps[d].atom));
 			if (pos + len < sizeof(buf)) {
-				memcpy(buf + pos, stk_modules[index].deps[d].id,
+				memcpy(buf + pos,
+				       STK_ATOM_ID(stk_modules[index].deps[d].atom),
 				       len);
 				pos += len;
 			}
@@ -534,9 +1632,9 @@ void stk_log_dependency_failures(size_t index, const char *action)
 				memcpy(buf + pos, ", have ", len);
 				pos += len;
 			}
-			len = strlen(stk_modules[found].version);
+			len = strlen(STK_META(found).version);
 			if (pos + len < sizeof(buf)) {
-				memcpy(buf + pos, stk_modules[found].version,
+				memcpy(buf + pos, STK_META(found).version,
 				       len);
 				pos += len;
 			}
@@ -550,14 +1648,15 @@ void stk_log_dependency_failures(size_t index, const char *action)
 
 	buf[pos] = '\0';
 	stk_log(STK_LOG_WARN, "%s '%s': unmet deps: %s", action,
-		stk_modules[index].id, buf);
+		STK_META(index).id, buf);
 }
 
-unsigned char stk_module_load(const char *path, int index)
+unsigned char stk_module_load(const char *path, size_t *out_index)
 {
 	unsigned char result;
+	size_t index;
 
-	result = stk_module_preload(path, index);
+	result = stk_module_preload(path, &index);
 	if (result != STK_MOD_INIT_SUCCESS)
 		return result;
 
@@ -568,173 +1667,649 @@ unsigned char stk_module_load(const char *path, int index)
 		return result;
 	}
 
-	return stk_module_activate(index);
+	result = stk_module_activate(index);
+	if (result == STK_MOD_INIT_SUCCESS && out_index)
+		*out_index = index;
+
+	return result;
+}
+
+void stk_module_unload(size_t index)
+{
+	stk_stats.unloaded++;
+	stk_modules[index].shutdown();
+	stk_atoms[stk_modules[index].atom].slot = -1;
+	platform_unload_library(stk_modules[index].handle);
+	stk_module_clear(index);
+}
+
+/* replaces the loaded module in index with the library at path. The new
+ * version is opened under a staged name and its dependencies checked
+ * while the old one keeps running, so the old shutdown and the new init
+ * run back to back. If the new version cannot be opened or registered,
+ * or its dependencies are not met, the old one stays loaded. Where the
+ * platform cannot stage a library, the old version is unloaded first.
+ * index must be a loaded module */
+unsigned char stk_module_replace(size_t index, const char *path,
+				 size_t *out_index)
+{
+	char staged[STK_PATH_MAX_OS];
+	size_t atom;
+	size_t fresh;
+	unsigned char result;
+	void *opened;
+
+	if (index >= module_slots || !stk_modules[index].handle)
+		return STK_MOD_INIT_FAILURE;
+	atom = stk_modules[index].atom;
+
+	if (!platform_shadow_stage(path, staged, sizeof(staged)))
+		goto in_place;
+
+	opened = stk_module_open(staged, &result);
+	if (!opened) {
+		platform_shadow_unstage(path, staged, 0);
+		return result;
+	}
+
+	/* the loader handed back the running image rather than a new one */
+	if (((stk_mod_opened_t *)opened)->handle == stk_modules[index].handle) {
+		stk_module_close(opened);
+		platform_shadow_unstage(path, staged, 0);
+		goto in_place;
+	}
+	extract_module_id(path, ((stk_mod_opened_t *)opened)->meta.id);
+
+	/* registering points the atom at the new slot; it goes back to the
+	 * old one until the swap */
+	result = stk_module_register(opened, &fresh);
+	if (result != STK_MOD_INIT_SUCCESS) {
+		stk_atoms[atom].slot = (int)index;
+		platform_shadow_unstage(path, staged, 0);
+		return result;
+	}
+
+	result = stk_validate_dependencies_single(fresh);
+	if (result != STK_MOD_INIT_SUCCESS) {
+		stk_log_dependency_failures(fresh, "Not reloading");
+		stk_module_discard(fresh);
+		stk_atoms[atom].slot = (int)index;
+		platform_shadow_unstage(path, staged, 0);
+		return result;
+	}
+
+	stk_module_unload(index);
+	stk_atoms[atom].slot = (int)fresh;
+	result = stk_module_activate(fresh);
+	platform_shadow_unstage(path, staged, result == STK_MOD_INIT_SUCCESS);
+	if (result == STK_MOD_INIT_SUCCESS)
+		*out_index = fresh;
+	return result;
+
+in_place:
+	stk_module_unload(index);
+	return stk_module_load(path, out_index);
+}
+
+size_t stk_module_slot_count(void) { return module_slots; }
+
+unsigned char stk_module_is_loaded(size_t index)
+{
+	return stk_modules[index].handle != NULL;
+}
+
+unsigned char stk_module_deps_missing(size_t index)
+{
+	size_t d;
+
+	for (d = 0; d < stk_modules[index].dep_count; d++)
+		if (STK_DEP_SLOT(index, d) < 0)
+			return 1;
+
+	return 0;
+}
+
+static const stk_mod_meta_t *stk_module_meta(size_t index)
+{
+	static const stk_mod_meta_t empty = {"", "", "", ""};
+
+	if (stk_modules[index].meta == STK_MOD_META_NONE)
+		return &empty;
+
+	return &STK_META(index);
+}
+
+const char *stk_module_id(size_t index) { return stk_module_meta(index)->id; }
+
+const char *stk_module_name(size_t index)
+{
+	return stk_module_meta(index)->name;
+}
+
+const char *stk_module_version(size_t index)
+{
+	return stk_module_meta(index)->version;
+}
+
+const char *stk_module_desc(size_t index)
+{
+	return stk_module_meta(index)->desc;
+}
+
+static stk_module_handle_t stk_make_handle(size_t index)
+{
+	stk_module_handle_t handle;
+
+	handle.slot = index;
+	handle.generation = stk_modules[index].generation;
+	return handle;
+}
+
+static int stk_handle_slot(stk_module_handle_t handle)
+{
+	if (!handle.generation || handle.slot >= module_slots ||
+	    stk_modules[handle.slot].generation != handle.generation)
+		return -1;
+
+	return (int)handle.slot;
+}
+
+stk_module_handle_t stk_module_find(const char *id)
+{
+	stk_module_handle_t none = {0, 0};
+	int index;
+
+	if (!id)
+		return none;
+
+	index = is_mod_loaded(id);
+	if (index < 0)
+		return none;
+
+	return stk_make_handle((size_t)index);
+}
+
+unsigned char stk_module_valid(stk_module_handle_t handle)
+{
+	return stk_handle_slot(handle) >= 0;
+}
+
+size_t stk_module_list(stk_module_handle_t *out, size_t max)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < module_slots && n < max; i++)
+		if (stk_modules[i].handle)
+			out[n++] = stk_make_handle(i);
+
+	return n;
+}
+
+const char *stk_module_get_id(stk_module_handle_t handle)
+{
+	int index = stk_handle_slot(handle);
+	return index < 0 ? NULL : STK_META(index).id;
+}
+
+const char *stk_module_get_name(stk_module_handle_t handle)
+{
+	int index = stk_handle_slot(handle);
+	return index < 0 ? NULL : STK_META(index).name;
+}
+
+const char *stk_module_get_version(stk_module_handle_t handle)
+{
+	int index = stk_handle_slot(handle);
+	return index < 0 ? NULL : STK_META(index).version;
+}
+
+const char *stk_module_get_description(stk_module_handle_t handle)
+{
+	int index = stk_handle_slot(handle);
+	return index < 0 ? NULL : STK_META(index).desc;
+}
+
+static size_t stk_symbol_slot(const char *name, unsigned long hash)
+{
+	size_t mask = stk_symbol_table_capacity - 1;
+	size_t slot = hash & mask;
+
+	while (stk_symbol_table[slot] &&
+	       (stk_symbols[stk_symbol_table[slot] - 1].hash != hash ||
+		strcmp(stk_symbols[stk_symbol_table[slot] - 1].name, name) !=
+		    0))
+		slot = (slot + 1) & mask;
+
+	return slot;
+}
+
+static unsigned char stk_symbol_reserve(size_t count)
+{
+	size_t new_capacity, i, slot, mask;
+	stk_symbol_t *grown;
+	size_t *new_table;
+
+	if (count > stk_symbol_capacity) {
+		new_capacity = stk_symbol_capacity ? stk_symbol_capacity * 2 : 16;
+		grown = realloc(stk_symbols, new_capacity * sizeof(*grown));
+		if (!grown)
+			return 0;
+		stk_symbols = grown;
+		stk_symbol_capacity = new_capacity;
+	}
+
+	if (count * 2 <= stk_symbol_table_capacity)
+		return 1;
+
+	new_capacity =
+	    stk_symbol_table_capacity ? stk_symbol_table_capacity * 2 : 32;
+	new_table = calloc(new_capacity, sizeof(size_t));
+	if (!new_table)
+		return 0;
+
+	free(stk_symbol_table);
+	stk_symbol_table = new_table;
+	stk_symbol_table_capacity = new_capacity;
+	mask = new_capacity - 1;
+	for (i = 0; i < stk_symbol_count; i++) {
+		slot = stk_symbols[i].hash & mask;
+		while (stk_symbol_table[slot])
+			slot = (slot + 1) & mask;
+		stk_symbol_table[slot] = i + 1;
+	}
+
+	return 1;
+}
+
+stk_symbol_id_t stk_symbol_register(const char *name)
+{
+	unsigned long hash;
+	size_t slot, len;
+	char *copy;
+
+	if (!name)
+		return STK_SYMBOL_NONE;
+
+	hash = stk_hash_id(name);
+	if (stk_symbol_table) {
+		slot = stk_symbol_slot(name, hash);
+		if (stk_symbol_table[slot])
+			return stk_symbol_table[slot] - 1;
+	}
+
+	if (!stk_symbol_reserve(stk_symbol_count + 1))
+		return STK_SYMBOL_NONE;
+
+	len = strlen(name);
+	copy = malloc(len + 1);
+	if (!copy)
+		return STK_SYMBOL_NONE;
+	memcpy(copy, name, len + 1);
+
+	slot = stk_symbol_slot(name, hash);
+	stk_symbols[stk_symbol_count].hash = hash;
+	stk_symbols[stk_symbol_count].name = copy;
+	stk_symbol_table[slot] = ++stk_symbol_count;
+	return stk_symbol_count - 1;
+}
+
+/* widens the cache of index to cover every registered symbol */
+static unsigned char stk_symbol_cache_grow(size_t index)
+{
+	stk_mod_t *m = &stk_modules[index];
+	void **grown;
+	size_t i;
+
+	grown = realloc(m->syms, stk_symbol_count * sizeof(void *));
+	if (!grown)
+		return 0;
+
+	for (i = m->sym_count; i < stk_symbol_count; i++)
+		grown[i] = &stk_symbol_unresolved;
+	m->syms = grown;
+	m->sym_count = stk_symbol_count;
+	return 1;
 }
 
-unsigned char stk_module_load_init(const char *path, int index)
+void *stk_module_symbol_id(stk_module_handle_t handle, stk_symbol_id_t id)
 {
-	int result;
-	result = stk_module_load(path, index);
+	int index = stk_handle_slot(handle);
+	stk_mod_t *m;
 
-	if (result == STK_MOD_INIT_SUCCESS)
-		++module_count;
+	if (index < 0 || id >= stk_symbol_count)
+		return NULL;
 
-	return result;
+	m = &stk_modules[index];
+	if (id >= m->sym_count && !stk_symbol_cache_grow((size_t)index))
+		return platform_get_symbol(m->handle, stk_symbols[id].name);
+
+	if (m->syms[id] == &stk_symbol_unresolved)
+		m->syms[id] =
+		    platform_get_symbol(m->handle, stk_symbols[id].name);
+	return m->syms[id];
 }
 
-void stk_module_unload(size_t index)
+/* the name is only registered once the handle is known to be live, so
+ * stale handles do not grow the registry */
+void *stk_module_symbol(stk_module_handle_t handle, const char *name)
 {
-	stk_modules[index].shutdown();
-	platform_unload_library(stk_modules[index].handle);
+	int index = stk_handle_slot(handle);
+	stk_symbol_id_t id;
 
-	stk_modules[index].handle = NULL;
-	stk_modules[index].init = NULL;
-	stk_modules[index].shutdown = NULL;
-	stk_modules[index].id[0] = '\0';
-	stk_modules[index].name[0] = '\0';
-	stk_modules[index].version[0] = '\0';
-	stk_modules[index].desc[0] = '\0';
+	if (index < 0 || !name)
+		return NULL;
 
-	if (stk_modules[index].deps) {
-		free(stk_modules[index].deps);
-		stk_modules[index].deps = NULL;
-	}
-	stk_modules[index].dep_count = 0;
+	id = stk_symbol_register(name);
+	if (id != STK_SYMBOL_NONE)
+		return stk_module_symbol_id(handle, id);
+	return platform_get_symbol(stk_modules[index].handle, name);
 }
 
 void stk_module_free_memory(void)
 {
 	if (stk_modules) {
 		size_t i;
-		for (i = 0; i < module_count; i++) {
+		for (i = 0; i < module_slots; i++) {
 			if (stk_modules[i].deps)
 				free(stk_modules[i].deps);
+			free(stk_modules[i].syms);
 		}
 		free(stk_modules);
 		stk_modules = NULL;
 	}
+	free(stk_slot_free);
+	stk_slot_free = NULL;
+	stk_slot_free_count = 0;
 	module_count = 0;
-	stk_pending_free();
-}
-
-unsigned char stk_module_init_memory(size_t capacity)
-{
-	stk_modules = malloc(capacity * sizeof(stk_mod_t));
-	if (!stk_modules)
-		return STK_INIT_MEMORY_ERROR;
+	module_slots = 0;
+	module_capacity = 0;
+	stk_slots_dirty = 0;
+	stk_meta_free_all();
+
+	while (stk_atom_count > 0) {
+		stk_atom_count--;
+		free(stk_atoms[stk_atom_count].users);
+		free(stk_atoms[stk_atom_count].waiters);
+	}
+	free(stk_atoms);
+	stk_atoms = NULL;
+	stk_atom_count = 0;
+	stk_atom_capacity = 0;
+	free(stk_atom_table);
+	stk_atom_table = NULL;
+	stk_atom_table_capacity = 0;
+
+	while (stk_symbol_count > 0)
+		free(stk_symbols[--stk_symbol_count].name);
+	free(stk_symbols);
+	stk_symbols = NULL;
+	stk_symbol_capacity = 0;
+	free(stk_symbol_table);
+	stk_symbol_table = NULL;
+	stk_symbol_table_capacity = 0;
+
+	free(stk_order);
+	stk_order = NULL;
+	stk_order_len = stk_order_live = stk_order_capacity = 0;
+	stk_order_valid = 0;
+	free(stk_dirty);
+	stk_dirty = NULL;
+	stk_dirty_count = stk_dirty_capacity = 0;
+	stk_dirty_overflow = 0;
 
-	return STK_INIT_SUCCESS;
+	stk_pending_free();
 }
 
-unsigned char stk_module_realloc_memory(size_t new_capacity)
+static unsigned char stk_module_resize(size_t new_capacity)
 {
 	stk_mod_t *new_modules;
-	size_t i, copy_count;
+	size_t *new_free;
+	size_t i;
 
-	if (new_capacity == 0) {
-		stk_module_free_memory();
-		return 0;
-	}
+	new_free = realloc(stk_slot_free, new_capacity * sizeof(size_t));
+	if (!new_free)
+		return STK_MOD_REALLOC_FAILURE;
+	stk_slot_free = new_free;
 
-	new_modules = malloc(new_capacity * sizeof(stk_mod_t));
+	new_modules = realloc(stk_modules, new_capacity * sizeof(stk_mod_t));
 	if (!new_modules)
 		return STK_MOD_REALLOC_FAILURE;
 
-	copy_count =
-	    (module_count < new_capacity) ? module_count : new_capacity;
-
-	for (i = 0; i < copy_count; i++)
-		new_modules[i] = stk_modules[i];
-
-	for (i = copy_count; i < new_capacity; i++) {
+	for (i = module_capacity; i < new_capacity; i++) {
 		new_modules[i].handle = NULL;
 		new_modules[i].init = NULL;
 		new_modules[i].shutdown = NULL;
-		new_modules[i].id[0] = '\0';
-		new_modules[i].name[0] = '\0';
-		new_modules[i].version[0] = '\0';
-		new_modules[i].desc[0] = '\0';
 		new_modules[i].deps = NULL;
 		new_modules[i].dep_count = 0;
+		new_modules[i].meta = STK_MOD_META_NONE;
+		new_modules[i].atom = STK_ATOM_NONE;
+		new_modules[i].order_pos = STK_MOD_SLOT_NONE;
+		new_modules[i].mark = 0;
+		new_modules[i].generation = 0;
+		new_modules[i].syms = NULL;
+		new_modules[i].sym_count = 0;
 	}
 
-	free(stk_modules);
 	stk_modules = new_modules;
+	module_capacity = new_capacity;
 
-	return 0;
+	return STK_MOD_INIT_SUCCESS;
 }
 
-typedef struct {
-	int *file_indices;
-	char (*file_names)[STK_PATH_MAX];
-	const char *tmp_dir;
-} stk_batch_dep_ctx_t;
+unsigned char stk_module_reserve(size_t count)
+{
+	size_t new_capacity;
 
-static int stk_batch_has_dep(size_t i, size_t j, void *ctx)
+	if (count <= module_capacity)
+		return STK_MOD_INIT_SUCCESS;
+
+	new_capacity = module_capacity ? module_capacity : STK_MOD_MIN_CAPACITY;
+	while (new_capacity < count)
+		new_capacity *= 2;
+
+	return stk_module_resize(new_capacity);
+}
+
+static size_t stk_slot_acquire(void)
+{
+	size_t index;
+
+	if (stk_slot_free_count > 0) {
+		index = stk_slot_free[--stk_slot_free_count];
+	} else {
+		if (stk_module_reserve(module_slots + 1) !=
+		    STK_MOD_INIT_SUCCESS)
+			return STK_MOD_SLOT_NONE;
+		index = module_slots++;
+	}
+
+	if (++stk_generation == 0)
+		++stk_generation;
+
+	stk_modules[index].generation = stk_generation;
+	module_count++;
+	return index;
+}
+
+static void stk_slot_release(size_t index)
+{
+	stk_modules[index].generation = 0;
+	stk_slot_free[stk_slot_free_count++] = index;
+	module_count--;
+	stk_slots_dirty = 1;
+}
+
+void stk_module_trim(void)
+{
+	size_t i, write;
+
+	if (!stk_slots_dirty)
+		return;
+	stk_slots_dirty = 0;
+
+	if (module_slots > 0 && !stk_modules[module_slots - 1].handle) {
+		while (module_slots > 0 && !stk_modules[module_slots - 1].handle)
+			module_slots--;
+
+		write = 0;
+		for (i = 0; i < stk_slot_free_count; i++)
+			if (stk_slot_free[i] < module_slots)
+				stk_slot_free[write++] = stk_slot_free[i];
+		stk_slot_free_count = write;
+	}
+
+	/* shrink by half only once the array is three quarters empty, so a
+	 * module flapping in and out never reallocates on every poll */
+	if (module_capacity <= STK_MOD_MIN_CAPACITY ||
+	    module_slots > module_capacity / 4)
+		return;
+
+	stk_module_resize(module_capacity / 2);
+}
+
+/* dependency table of a module file that is not loaded. Read from the
+ * file itself where the platform allows, otherwise by briefly loading
+ * the library. Caller frees *out_deps */
+static unsigned char stk_read_deps(const char *path, stk_dep_t **out_deps,
+				   size_t *out_count)
 {
-	stk_batch_dep_ctx_t *c = (stk_batch_dep_ctx_t *)ctx;
-	char id_j[STK_MOD_ID_BUFFER];
-	char tmp_i[STK_PATH_MAX_OS];
 	void *h;
+	const stk_mod_descriptor_t *d;
 	const stk_dep_t *deps;
-	size_t d, dep_count;
-	union {
-		void *obj;
-	} u;
-	int result = 0;
+	size_t count = 0;
 
-	extract_module_id(c->file_names[c->file_indices[j]], id_j);
+	if (platform_read_module_deps(path, stk_mod_deps_sym,
+				      stk_mod_descriptor_sym, out_deps,
+				      out_count) ==
+	    STK_PLATFORM_OPERATION_SUCCESS)
+		return STK_MOD_INIT_SUCCESS;
 
-	tmp_i[0] = '\0';
-	strncat(tmp_i, c->tmp_dir, STK_PATH_MAX_OS - 1);
-	strncat(tmp_i, STK_PATH_SEP_STR, STK_PATH_MAX_OS - strlen(tmp_i) - 1);
-	strncat(tmp_i, c->file_names[c->file_indices[i]],
-		STK_PATH_MAX_OS - strlen(tmp_i) - 1);
+	*out_deps = NULL;
+	*out_count = 0;
 
-	h = platform_load_library(tmp_i);
+	h = platform_load_library(path);
 	if (!h)
-		return 0;
+		return STK_MOD_LIBRARY_LOAD_ERROR;
 
-	u.obj = platform_get_symbol(h, stk_mod_deps_sym);
-	if (u.obj) {
-		deps = (const stk_dep_t *)u.obj;
-		dep_count = 0;
-		while (deps[dep_count].id[0] != '\0')
-			dep_count++;
-		for (d = 0; d < dep_count; d++) {
-			if (strncmp(deps[d].id, id_j, STK_MOD_ID_BUFFER) == 0) {
-				result = 1;
-				break;
-			}
+	d = stk_descriptor_find(h, path);
+	if (d) {
+		if (!stk_descriptor_deps(h, d, &deps, &count)) {
+			platform_unload_library(h);
+			return STK_MOD_SYMBOL_NOT_FOUND_ERROR;
+		}
+	} else {
+		deps = (const stk_dep_t *)platform_get_symbol(
+		    h, stk_mod_deps_sym);
+		while (deps && deps[count].id[0] != '\0')
+			count++;
+	}
+
+	if (count > 0) {
+		*out_deps = malloc(count * sizeof(stk_dep_t));
+		if (!*out_deps) {
+			platform_unload_library(h);
+			return STK_MOD_REALLOC_FAILURE;
 		}
+		memcpy(*out_deps, deps, count * sizeof(stk_dep_t));
+		*out_count = count;
 	}
 
 	platform_unload_library(h);
-	return result;
+	return STK_MOD_INIT_SUCCESS;
 }
 
+/* each batch file's dependency list is read once; edges are resolved
+ * against the batch through the atoms of the batch ids */
 void stk_sort_load_order(int *file_indices, size_t n,
 			 char (*file_names)[STK_PATH_MAX], const char *tmp_dir)
 {
+	stk_graph_t g;
 	size_t *order = NULL;
+	size_t *batch_of = NULL;
+	size_t *file_atom = NULL;
 	int *result = NULL;
-	stk_batch_dep_ctx_t ctx;
-	size_t i;
+	char id[STK_MOD_ID_BUFFER];
+	char tmp_path[STK_PATH_MAX_OS];
+	stk_dep_t *deps;
+	size_t i, d, dep_count, atom, edges, edge_capacity;
 
 	if (n <= 1)
 		return;
 
+	g.count = n;
+	g.node = g.dense = g.deps = g.user_start = g.users = NULL;
+	g.dep_start = NULL;
+
 	order = malloc(n * sizeof(size_t));
 	result = malloc(n * sizeof(int));
-	if (!order || !result)
+	file_atom = malloc(n * sizeof(size_t));
+	g.node = malloc(n * sizeof(size_t));
+	g.dep_start = malloc((n + 1) * sizeof(size_t));
+	edge_capacity = n;
+	g.deps = malloc(edge_capacity * sizeof(size_t));
+	if (!order || !result || !file_atom || !g.node || !g.dep_start ||
+	    !g.deps)
+		goto cleanup;
+
+	for (i = 0; i < n; i++) {
+		extract_module_id(file_names[file_indices[i]], id);
+		file_atom[i] = stk_atom_intern(id);
+		if (file_atom[i] == STK_ATOM_NONE)
+			goto cleanup;
+		g.node[i] = i;
+	}
+
+	batch_of = malloc(stk_atom_count * sizeof(size_t));
+	if (!batch_of)
 		goto cleanup;
+	for (atom = 0; atom < stk_atom_count; atom++)
+		batch_of[atom] = STK_MOD_SLOT_NONE;
+	for (i = 0; i < n; i++)
+		batch_of[file_atom[i]] = i;
+
+	edges = 0;
+	for (i = 0; i < n; i++) {
+		g.dep_start[i] = edges;
+
+		tmp_path[0] = '\0';
+		strncat(tmp_path, tmp_dir, STK_PATH_MAX_OS - 1);
+		strncat(tmp_path, STK_PATH_SEP_STR,
+			STK_PATH_MAX_OS - strlen(tmp_path) - 1);
+		strncat(tmp_path, file_names[file_indices[i]],
+			STK_PATH_MAX_OS - strlen(tmp_path) - 1);
+
+		if (stk_read_deps(tmp_path, &deps, &dep_count) !=
+		    STK_MOD_INIT_SUCCESS)
+			continue;
+
+		for (d = 0; d < dep_count; d++) {
+			atom = stk_atom_find(deps[d].id);
+			if (atom == STK_ATOM_NONE ||
+			    batch_of[atom] == STK_MOD_SLOT_NONE ||
+			    batch_of[atom] == i)
+				continue;
+
+			if (edges == edge_capacity) {
+				size_t *grown = realloc(
+				    g.deps, edge_capacity * 2 * sizeof(size_t));
+				if (!grown) {
+					free(deps);
+					goto cleanup;
+				}
+				g.deps = grown;
+				edge_capacity *= 2;
+			}
+			g.deps[edges++] = batch_of[atom];
+		}
+
+		free(deps);
+	}
+	g.dep_start[n] = edges;
 
-	ctx.file_indices = file_indices;
-	ctx.file_names = file_names;
-	ctx.tmp_dir = tmp_dir;
+	if (stk_graph_link(&g) != STK_MOD_INIT_SUCCESS)
+		goto cleanup;
 
-	if (stk_kahn_sort(n, order, stk_batch_has_dep, &ctx, NULL) !=
-	    STK_MOD_INIT_SUCCESS)
+	if (stk_kahn_sort(&g, order, NULL) != STK_MOD_INIT_SUCCESS)
 		goto cleanup;
 
 	for (i = 0; i < n; i++)
@@ -743,100 +2318,61 @@ void stk_sort_load_order(int *file_indices, size_t n,
 		file_indices[i] = result[i];
 
 cleanup:
+	stk_graph_free(&g);
+	free(batch_of);
+	free(file_atom);
 	free(order);
 	free(result);
 }
 
+/* breadth-first walk over each module's users, using indices itself as
+ * the queue */
 void stk_collect_dependents(size_t *indices, size_t *count, size_t capacity)
 {
-	size_t i, d;
-	int in_set, changed;
-
-	do {
-		changed = 0;
-		for (i = 0; i < module_count; i++) {
-			in_set = 0;
-			{
-				size_t k;
-				for (k = 0; k < *count; k++) {
-					if (indices[k] == i) {
-						in_set = 1;
-						break;
-					}
-				}
-			}
-			if (in_set)
-				continue;
+	unsigned long mark;
+	size_t k, u, user;
+	stk_atom_t *a;
 
-			for (d = 0; d < stk_modules[i].dep_count; d++) {
-				int dep_index =
-				    is_mod_loaded(stk_modules[i].deps[d].id);
-				if (dep_index < 0)
-					continue;
-				{
-					size_t k;
-					for (k = 0; k < *count; k++) {
-						if (indices[k] ==
-						    (size_t)dep_index) {
-							if (*count >= capacity)
-								goto next_module;
-							indices[(*count)++] = i;
-							changed = 1;
-							goto next_module;
-						}
-					}
-				}
-			}
-		next_module:;
+	if (*count == 0)
+		return;
+
+	mark = stk_next_mark();
+	for (k = 0; k < *count; k++)
+		stk_modules[indices[k]].mark = mark;
+
+	for (k = 0; k < *count; k++) {
+		a = &stk_atoms[stk_modules[indices[k]].atom];
+		for (u = 0; u < a->user_count; u++) {
+			user = a->users[u];
+			if (stk_modules[user].mark == mark || *count >= capacity)
+				continue;
+			stk_modules[user].mark = mark;
+			indices[(*count)++] = user;
 		}
-	} while (changed);
+	}
+}
+
+/* dependents first: later in the cached load order unloads earlier */
+static int stk_unload_compare(const void *a, const void *b)
+{
+	return stk_order_compare(b, a);
 }
 
 void stk_sort_unload_order(size_t *indices, size_t n)
 {
-	size_t *topo = NULL;
-	size_t *result = NULL;
-	size_t i, j, k;
-	int in_set;
+	size_t i;
 
 	if (n <= 1)
 		return;
 
-	topo = malloc(module_count * sizeof(size_t));
-	result = malloc(n * sizeof(size_t));
-
-	if (!topo || !result)
-		goto fallback;
-
-	if (stk_topo_sort(module_count, topo) != STK_MOD_INIT_SUCCESS)
-		goto fallback;
-
-	k = 0;
-	for (i = module_count; i > 0; --i) {
-		size_t mod = topo[i - 1];
-		in_set = 0;
-		for (j = 0; j < n; j++) {
-			if (indices[j] == mod) {
-				in_set = 1;
-				break;
-			}
-		}
-		if (in_set)
-			result[k++] = mod;
-	}
+	if (!stk_order_valid)
+		stk_order_rebuild();
 
-	if (k == n) {
-		for (i = 0; i < n; i++)
-			indices[i] = result[i];
+	if (stk_order_valid) {
+		qsort(indices, n, sizeof(size_t), stk_unload_compare);
+		return;
 	}
 
-	free(topo);
-	free(result);
-	return;
-
-fallback:
-	free(topo);
-	free(result);
 	for (i = 0; i < n / 2; i++) {
 		size_t tmp = indices[i];
 		indices[i] = indices[n - 1 - i];
@@ -844,9 +2380,50 @@ fallback:
 	}
 }
 
+/* recheck only the users of modules that went away since the last call
+ * and report those now missing a dependency */
+size_t stk_collect_broken(size_t *out, size_t capacity)
+{
+	unsigned long mark;
+	size_t i, u, user, count = 0;
+	stk_atom_t *a;
+
+	if (stk_dirty_overflow) {
+		stk_dirty_overflow = 0;
+		stk_dirty_count = 0;
+		for (i = 0; i < module_slots && count < capacity; i++) {
+			if (!stk_modules[i].handle)
+				continue;
+			stk_stats.revalidated++;
+			if (stk_module_deps_missing(i))
+				out[count++] = i;
+		}
+		return count;
+	}
+
+	mark = stk_next_mark();
+	for (i = 0; i < stk_dirty_count; i++) {
+		a = &stk_atoms[stk_dirty[i]];
+		if (a->slot >= 0)
+			continue;
+		for (u = 0; u < a->user_count && count < capacity; u++) {
+			user = a->users[u];
+			if (stk_modules[user].mark == mark)
+				continue;
+			stk_modules[user].mark = mark;
+			stk_stats.revalidated++;
+			if (stk_module_deps_missing(user))
+				out[count++] = user;
+		}
+	}
+
+	stk_dirty_count = 0;
+	return count;
+}
+
 void stk_module_unload_all(void)
 {
-	size_t i;
+	size_t i, n = 0;
 	size_t *order = NULL;
 
 	if (module_count == 0)
@@ -854,250 +2431,350 @@ void stk_module_unload_all(void)
 
 	order = malloc(module_count * sizeof(size_t));
 	if (order) {
-		for (i = 0; i < module_count; i++)
-			order[i] = i;
-		stk_sort_unload_order(order, module_count);
-		for (i = 0; i < module_count; i++)
+		for (i = 0; i < module_slots; i++)
+			if (stk_modules[i].handle)
+				order[n++] = i;
+		stk_sort_unload_order(order, n);
+		for (i = 0; i < n; i++)
 			stk_module_unload(order[i]);
 		free(order);
 	} else {
-		for (i = module_count; i > 0; --i)
-			stk_module_unload(i - 1);
+		for (i = module_slots; i > 0; --i)
+			if (stk_modules[i - 1].handle)
+				stk_module_unload(i - 1);
 	}
 
 free_mem:
 	stk_module_free_memory();
 }
 
-void stk_pending_add(const char *path)
+static void stk_pending_ready(size_t entry)
 {
-	char (*new_pending)[STK_PATH_MAX_OS];
-	char incoming_id[STK_MOD_ID_BUFFER];
-	char existing_id[STK_MOD_ID_BUFFER];
-	size_t i;
+	size_t *new_ready, new_capacity;
 
-	extract_module_id(path, incoming_id);
+	if (stk_pending[entry].ready)
+		return;
 
-	for (i = 0; i < stk_pending_count; i++) {
-		extract_module_id(stk_pending[i], existing_id);
-		if (strncmp(existing_id, incoming_id, STK_MOD_ID_BUFFER) == 0) {
-			strncpy(stk_pending[i], path, STK_PATH_MAX_OS - 1);
-			stk_pending[i][STK_PATH_MAX_OS - 1] = '\0';
+	if (stk_ready_count == stk_ready_capacity) {
+		new_capacity = stk_ready_capacity ? stk_ready_capacity * 2 : 16;
+		new_ready = realloc(stk_ready, new_capacity * sizeof(size_t));
+		if (!new_ready)
 			return;
-		}
+		stk_ready = new_ready;
+		stk_ready_capacity = new_capacity;
 	}
 
-	new_pending = malloc((stk_pending_count + 1) * sizeof(*stk_pending));
-	if (!new_pending)
-		return;
-
-	for (i = 0; i < stk_pending_count; i++)
-		memcpy(new_pending[i], stk_pending[i], STK_PATH_MAX_OS);
-
-	free(stk_pending);
-	stk_pending = new_pending;
+	stk_pending[entry].ready = 1;
+	stk_ready[stk_ready_count++] = entry;
+}
 
-	strncpy(stk_pending[stk_pending_count], path, STK_PATH_MAX_OS - 1);
-	stk_pending[stk_pending_count][STK_PATH_MAX_OS - 1] = '\0';
-	stk_pending_count++;
+static void stk_pending_release(size_t entry)
+{
+	stk_atoms[stk_pending[entry].atom].pending = STK_MOD_SLOT_NONE;
+	stk_pending[entry].atom = STK_ATOM_NONE;
+	stk_pending[entry].path[0] = '\0';
+	stk_pending[entry].generation++;
+	stk_pending[entry].ready = 0;
+	stk_pending_free_list[stk_pending_free_count++] = entry;
+	stk_pending_count--;
 }
 
-void stk_pending_add_batch(const char (*paths)[STK_PATH_MAX_OS], size_t count)
+static unsigned char stk_pending_live(const stk_waiter_t *w)
 {
-	char (*new_pending)[STK_PATH_MAX_OS];
-	char incoming_id[STK_MOD_ID_BUFFER];
-	char existing_id[STK_MOD_ID_BUFFER];
-	size_t i, j, new_count;
+	return stk_pending[w->entry].atom != STK_ATOM_NONE &&
+	       stk_pending[w->entry].generation == w->generation;
+}
 
-	if (!paths || count == 0)
-		return;
+static void stk_pending_wait(size_t entry, size_t atom)
+{
+	stk_atom_t *a = &stk_atoms[atom];
+	stk_waiter_t *new_waiters;
+	size_t i, write, new_capacity;
+
+	if (a->waiter_count == a->waiter_capacity) {
+		/* drop records retired by later examinations before growing */
+		write = 0;
+		for (i = 0; i < a->waiter_count; i++)
+			if (stk_pending_live(&a->waiters[i]))
+				a->waiters[write++] = a->waiters[i];
+		a->waiter_count = write;
+	}
 
-	new_count = 0;
-	for (i = 0; i < count; i++) {
-		int found = 0;
-		extract_module_id(paths[i], incoming_id);
-
-		for (j = 0; j < stk_pending_count; j++) {
-			extract_module_id(stk_pending[j], existing_id);
-			if (strncmp(existing_id, incoming_id,
-				    STK_MOD_ID_BUFFER) == 0) {
-				strncpy(stk_pending[j], paths[i],
-					STK_PATH_MAX_OS - 1);
-				stk_pending[j][STK_PATH_MAX_OS - 1] = '\0';
-				found = 1;
-				break;
-			}
+	if (a->waiter_count == a->waiter_capacity) {
+		new_capacity = a->waiter_capacity ? a->waiter_capacity * 2 : 4;
+		new_waiters =
+		    realloc(a->waiters, new_capacity * sizeof(stk_waiter_t));
+		if (!new_waiters) {
+			/* cannot park it, so keep it in the retry queue */
+			stk_pending_ready(entry);
+			return;
 		}
-
-		if (!found)
-			new_count++;
+		a->waiters = new_waiters;
+		a->waiter_capacity = new_capacity;
 	}
 
-	if (new_count == 0)
-		return;
+	a->waiters[a->waiter_count].entry = entry;
+	a->waiters[a->waiter_count].generation = stk_pending[entry].generation;
+	a->waiter_count++;
+}
 
-	new_pending =
-	    malloc((stk_pending_count + new_count) * sizeof(*stk_pending));
-	if (!new_pending)
-		return;
+/* atom just activated: its own pending entry is satisfied and everything
+ * parked on it gets another look */
+static void stk_pending_wake(size_t atom)
+{
+	size_t i;
 
-	for (i = 0; i < stk_pending_count; i++)
-		memcpy(new_pending[i], stk_pending[i], STK_PATH_MAX_OS);
+	if (stk_atoms[atom].pending != STK_MOD_SLOT_NONE)
+		stk_pending_release(stk_atoms[atom].pending);
 
-	free(stk_pending);
-	stk_pending = new_pending;
-
-	for (i = 0; i < count; i++) {
-		int found = 0;
-		extract_module_id(paths[i], incoming_id);
-
-		for (j = 0; j < stk_pending_count; j++) {
-			extract_module_id(stk_pending[j], existing_id);
-			if (strncmp(existing_id, incoming_id,
-				    STK_MOD_ID_BUFFER) == 0) {
-				found = 1;
-				break;
-			}
-		}
+	for (i = 0; i < stk_atoms[atom].waiter_count; i++)
+		if (stk_pending_live(&stk_atoms[atom].waiters[i]))
+			stk_pending_ready(stk_atoms[atom].waiters[i].entry);
 
-		if (!found) {
-			strncpy(stk_pending[stk_pending_count], paths[i],
-				STK_PATH_MAX_OS - 1);
-			stk_pending[stk_pending_count][STK_PATH_MAX_OS - 1] =
-			    '\0';
-			stk_pending_count++;
-		}
+	stk_atoms[atom].waiter_count = 0;
+}
+
+static size_t stk_pending_acquire(void)
+{
+	size_t new_capacity, *new_free;
+	stk_pending_t *new_pending;
+
+	if (stk_pending_free_count > 0)
+		return stk_pending_free_list[--stk_pending_free_count];
+
+	if (stk_pending_slots == stk_pending_capacity) {
+		new_capacity =
+		    stk_pending_capacity ? stk_pending_capacity * 2 : 16;
+		new_free = realloc(stk_pending_free_list,
+				   new_capacity * sizeof(size_t));
+		if (!new_free)
+			return STK_MOD_SLOT_NONE;
+		stk_pending_free_list = new_free;
+
+		new_pending =
+		    realloc(stk_pending, new_capacity * sizeof(stk_pending_t));
+		if (!new_pending)
+			return STK_MOD_SLOT_NONE;
+		stk_pending = new_pending;
+		stk_pending_capacity = new_capacity;
 	}
+
+	stk_pending[stk_pending_slots].generation = 0;
+	return stk_pending_slots++;
 }
 
-void stk_pending_remove(const char *id)
+void stk_pending_add(const char *path)
 {
-	size_t i, write;
-	char pending_id[STK_MOD_ID_BUFFER];
+	char incoming_id[STK_MOD_ID_BUFFER];
+	size_t atom, entry;
 
-	if (!stk_pending_count)
+	extract_module_id(path, incoming_id);
+	atom = stk_atom_intern(incoming_id);
+	if (atom == STK_ATOM_NONE)
 		return;
 
-	write = 0;
-	for (i = 0; i < stk_pending_count; i++) {
-		extract_module_id(stk_pending[i], pending_id);
-		if (strncmp(pending_id, id, STK_MOD_ID_BUFFER) == 0)
-			continue;
-		if (write != i)
-			memcpy(stk_pending[write], stk_pending[i],
-			       STK_PATH_MAX_OS);
-		write++;
+	entry = stk_atoms[atom].pending;
+	if (entry == STK_MOD_SLOT_NONE) {
+		entry = stk_pending_acquire();
+		if (entry == STK_MOD_SLOT_NONE)
+			return;
+		stk_pending[entry].atom = atom;
+		stk_pending[entry].ready = 0;
+		stk_atoms[atom].pending = entry;
+		stk_pending_count++;
 	}
-	stk_pending_count = write;
+
+	strncpy(stk_pending[entry].path, path, STK_PATH_MAX_OS - 1);
+	stk_pending[entry].path[STK_PATH_MAX_OS - 1] = '\0';
+	stk_pending_ready(entry);
 }
 
-size_t stk_pending_retry(void)
+void stk_pending_add_batch(const char (*paths)[STK_PATH_MAX_OS], size_t count)
 {
-	size_t i, d, loaded = 0;
-	unsigned char deps_satisfied;
-	unsigned char result;
-	void *handle;
-	void *test;
-	union {
-		void *obj;
-		const char *(*meta_func)(void);
-	} u;
-	const stk_dep_t *deps;
-	size_t dep_count;
-	int found;
-	size_t write;
-	char pending_id[STK_MOD_ID_BUFFER];
+	size_t i;
 
-	if (!stk_pending_count)
-		return 0;
+	if (!paths)
+		return;
 
-	write = 0;
-	for (i = 0; i < stk_pending_count; i++) {
-		test = platform_load_library(stk_pending[i]);
-		if (test) {
-			platform_unload_library(test);
-			if (write != i)
-				memcpy(stk_pending[write], stk_pending[i],
-				       STK_PATH_MAX_OS);
-			write++;
-		}
-	}
-	stk_pending_count = write;
+	for (i = 0; i < count; i++)
+		stk_pending_add(paths[i]);
+}
 
-	if (!stk_pending_count) {
-		stk_pending_free();
-		return 0;
-	}
+void stk_pending_remove(const char *id)
+{
+	size_t atom = stk_atom_find(id);
 
-	if (stk_module_realloc_memory(module_count + stk_pending_count) != 0)
-		return 0;
+	if (atom != STK_ATOM_NONE && stk_atoms[atom].pending != STK_MOD_SLOT_NONE)
+		stk_pending_release(stk_atoms[atom].pending);
+}
 
-	for (i = 0; i < stk_pending_count; i++) {
-		extract_module_id(stk_pending[i], pending_id);
-		if (is_mod_loaded(pending_id) >= 0) {
-			memcpy(stk_pending[i],
-			       stk_pending[stk_pending_count - 1],
-			       STK_PATH_MAX_OS);
-			stk_pending_count--;
-			i--;
-			continue;
+/* index has a dependency in wave[0 .. count), preloaded alongside it but
+ * not yet initialized: parks entry on it instead */
+static unsigned char stk_pending_in_wave(size_t entry, size_t index,
+					 const size_t *wave, size_t count)
+{
+	size_t d, w;
+	int found;
+
+	for (d = 0; d < stk_modules[index].dep_count; d++) {
+		found = STK_DEP_SLOT(index, d);
+		for (w = 0; found >= 0 && w < count; w++) {
+			if (wave[w] != (size_t)found)
+				continue;
+			stk_pending_wait(entry, stk_modules[index].deps[d].atom);
+			return 1;
 		}
+	}
 
-		handle = platform_load_library(stk_pending[i]);
-		if (!handle)
-			continue;
+	return 0;
+}
 
-		u.obj = platform_get_symbol(handle, stk_mod_deps_sym);
-		if (!u.obj) {
-			platform_unload_library(handle);
-			goto attempt_load;
+/* examine only the entries on the ready queue; with nothing new loaded
+ * since the last poll it is empty and no library is opened. With init
+ * threads, everything ready at once is preloaded as a wave and the inits
+ * of the wave run together; a module whose dependency is in the same
+ * wave waits for the next one */
+size_t stk_pending_retry(void)
+{
+	size_t entry, index, d, atom, dep_count, loaded = 0;
+	size_t one_index, one_entry, w, wave_count, wave_max = 1;
+	size_t *wave = &one_index, *wave_entry = &one_entry;
+	int one_rc, *wave_rc = &one_rc;
+	int found;
+	unsigned char waiting;
+	char path[STK_PATH_MAX_OS];
+	stk_dep_t *deps;
+	stk_constraint_t constraint;
+
+	/* an entry joins a wave at most once, so no wave outgrows the
+	 * pending table; without the memory, waves hold one entry */
+	if (stk_init_threads > 1 && stk_ready_count > 1) {
+		wave = malloc(stk_pending_slots * sizeof(size_t));
+		wave_entry = malloc(stk_pending_slots * sizeof(size_t));
+		wave_rc = malloc(stk_pending_slots * sizeof(int));
+		wave_max = stk_pending_slots;
+		if (!wave || !wave_entry || !wave_rc) {
+			free(wave);
+			free(wave_entry);
+			free(wave_rc);
+			wave = &one_index;
+			wave_entry = &one_entry;
+			wave_rc = &one_rc;
+			wave_max = 1;
 		}
+	}
 
-		deps = (const stk_dep_t *)u.obj;
-		dep_count = 0;
-		while (deps[dep_count].id[0] != '\0')
-			dep_count++;
+	while (stk_ready_count > 0) {
+		wave_count = 0;
 
-		deps_satisfied = 1;
-		for (d = 0; d < dep_count; d++) {
-			found = is_mod_loaded(deps[d].id);
-			if (found < 0) {
-				deps_satisfied = 0;
-				break;
+		while (stk_ready_count > 0 && wave_count < wave_max) {
+			entry = stk_ready[--stk_ready_count];
+			if (stk_pending[entry].atom == STK_ATOM_NONE ||
+			    !stk_pending[entry].ready)
+				continue;
+
+			stk_pending[entry].ready = 0;
+			stk_pending[entry].generation++;
+			stk_stats.pending_checked++;
+			memcpy(path, stk_pending[entry].path, STK_PATH_MAX_OS);
+
+			/* park on whatever is still missing without loading
+			 * the library; it is only opened once everything is
+			 * in place */
+			if (stk_read_deps(path, &deps, &dep_count) ==
+			    STK_MOD_INIT_SUCCESS) {
+				waiting = 0;
+				for (d = 0; d < dep_count; d++) {
+					stk_compile_constraint(deps[d].version,
+							       &constraint);
+					atom = stk_atom_intern(deps[d].id);
+					if (atom == STK_ATOM_NONE)
+						continue;
+					found = stk_atoms[atom].slot;
+					if (found >= 0 &&
+					    stk_constraint_allows(
+						&constraint,
+						stk_modules[found].version))
+						continue;
+					stk_pending_wait(entry, atom);
+					waiting = 1;
+				}
+				free(deps);
+				if (waiting)
+					continue;
 			}
-			if (deps[d].version[0] &&
-			    !stk_validate_constraint(
-				deps[d].version, stk_modules[found].version)) {
-				deps_satisfied = 0;
-				break;
+
+			if (stk_module_preload(path, &index) !=
+			    STK_MOD_INIT_SUCCESS) {
+				stk_pending_release(entry);
+				continue;
+			}
+
+			if (stk_pending_in_wave(entry, index, wave,
+						wave_count)) {
+				stk_module_discard(index);
+				continue;
 			}
-		}
 
-		platform_unload_library(handle);
+			if (stk_validate_dependencies_single(index) !=
+			    STK_MOD_INIT_SUCCESS) {
+				for (d = 0; d < stk_modules[index].dep_count;
+				     d++) {
+					found = STK_DEP_SLOT(index, d);
+					if (found >= 0 &&
+					    stk_constraint_allows(
+						&stk_modules[index]
+						     .deps[d]
+						     .constraint,
+						stk_modules[found].version))
+						continue;
+					stk_pending_wait(
+					    entry,
+					    stk_modules[index].deps[d].atom);
+				}
+				stk_module_discard(index);
+				continue;
+			}
 
-		if (!deps_satisfied)
-			continue;
+			wave[wave_count] = index;
+			wave_entry[wave_count] = entry;
+			wave_count++;
+		}
 
-	attempt_load:
-		result = stk_module_load(stk_pending[i], module_count);
-		if (result != STK_MOD_INIT_SUCCESS)
+		if (wave_count == 0)
 			continue;
 
-		module_count++;
-		loaded++;
+		stk_module_run_inits(wave, wave_count, wave_rc);
 
-		memcpy(stk_pending[i], stk_pending[stk_pending_count - 1],
-		       STK_PATH_MAX_OS);
-		stk_pending_count--;
-		i--;
-	}
+		for (w = 0; w < wave_count; w++) {
+			index = wave[w];
+			entry = wave_entry[w];
 
-	if (stk_pending_count == 0)
-		stk_pending_free();
+			/* a successful activation releases the entry through
+			 * stk_pending_wake() and queues whatever was waiting
+			 * on it */
+			if (stk_module_commit(index, wave_rc[w]) !=
+			    STK_MOD_INIT_SUCCESS) {
+				stk_log(STK_LOG_ERROR,
+					"Failed to init deferred module %s",
+					stk_pending[entry].path);
+				if (stk_pending[entry].atom != STK_ATOM_NONE)
+					stk_pending_release(entry);
+				continue;
+			}
 
-	if (loaded > 0)
-		stk_module_realloc_memory(module_count);
+			stk_log(STK_LOG_INFO,
+				"Loaded deferred module: %s v%s",
+				STK_META(index).id, STK_META(index).version);
+			loaded++;
+		}
+	}
 
+	if (wave != &one_index) {
+		free(wave);
+		free(wave_entry);
+		free(wave_rc);
+	}
 	return loaded;
 }
 
@@ -1139,3 +2816,21 @@ void stk_set_module_deps_sym(const char *name)
 {
 	stk_set_fn_name(stk_mod_deps_sym, name);
 }
+
+void stk_set_module_threadsafe_sym(const char *name)
+{
+	stk_set_fn_name(stk_mod_threadsafe_sym, name);
+}
+
+void stk_set_module_descriptor_sym(const char *name)
+{
+	stk_set_fn_name(stk_mod_descriptor_sym, name);
+}
+
+void stk_set_init_threads(size_t count)
+{
+	if (stk_flags & STK_FLAG_INITIALIZED)
+		return;
+
+	stk_init_threads = count;
+}
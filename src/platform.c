@@ -1,4 +1,10 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "platform.h"
 #include "stk.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,15 +12,32 @@
 #ifndef _WIN32
 #include <dirent.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#include <utime.h>
+#endif
+
+#if defined(__ELF__) && !defined(_WIN32)
+#include <elf.h>
+#endif
+
+#ifdef __GLIBC__
+#include <link.h>
 #endif
 
+
 #if defined(__linux__)
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #elif defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -24,10 +47,204 @@
 #include <sys/types.h>
 #endif
 
-int is_mod_loaded(const char *module_name);
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#ifdef __linux__
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef MFD_EXEC
+#define MFD_EXEC 0x0010U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+#define STK_SHADOW_SEALS                                                       \
+	(F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#endif
+
+#ifndef _WIN32
+/* Modules are loaded into the global scope so they can use each other's
+ * exports. Where the loader allows it they still bind their own exported
+ * names to themselves first, so neither a module of another name nor the
+ * previous version of the same module, still loaded while a reload
+ * prepares, can take over a module's own functions and globals. Mach-O's
+ * two-level namespace does this on its own. Sanitizer runtimes refuse
+ * RTLD_DEEPBIND, so it is left out whenever one is in the process, which
+ * the host can be without stk being built with it */
+static int dlopen_flags = RTLD_NOW | RTLD_GLOBAL;
+static pthread_once_t dlopen_once = PTHREAD_ONCE_INIT;
+
+static void dlopen_flags_init(void)
+{
+#ifdef RTLD_DEEPBIND
+	if (!dlsym(RTLD_DEFAULT, "__sanitizer_print_stack_trace"))
+		dlopen_flags |= RTLD_DEEPBIND;
+#endif
+}
+
+/* nonzero if a module opened now binds its exported names to itself */
+static unsigned char dlopen_own_binding(void)
+{
+#if defined(__APPLE__)
+	return 1;
+#elif defined(RTLD_DEEPBIND)
+	pthread_once(&dlopen_once, dlopen_flags_init);
+	return (dlopen_flags & RTLD_DEEPBIND) != 0;
+#else
+	return 0;
+#endif
+}
+#endif
+
+#define STK_COPY_CHUNK 0x40000000L
+#define STK_COPY_BUFFER_SIZE (1 << 20)
+#define STK_DIGEST_BLOCK (STK_DIGEST_LANES * 4)
+
 unsigned char is_valid_module_file(const char *filename);
-void extract_module_id(const char *path, char *out_id);
+unsigned long stk_hash_id(const char *id);
+const char *stk_get_tmp_dir(void);
+size_t platform_atomic_add(volatile size_t *p, size_t value);
+
+/* bumped atomically, since stk_init() may run platform_copy_file() on
+ * several preload threads at once */
+extern stk_stats_t *stk_watch_stats;
+
+/* Four independent 32-bit lanes fed one word each per 16-byte block, so
+ * the inner loop has no cross-lane dependency and vectorizes. */
+typedef struct {
+	unsigned long lane[STK_DIGEST_LANES];
+	unsigned char tail[STK_DIGEST_BLOCK];
+	size_t tail_len;
+	unsigned long total;
+} digest_state_t;
+
+#if defined(__ELF__) && !defined(_WIN32)
+static unsigned char elf_image_digest(const unsigned char *img, size_t size,
+				      unsigned long *out);
+#endif
+
+static unsigned long digest_rotl(unsigned long x, int r)
+{
+	return ((x << r) | (x >> (32 - r))) & 0xffffffffUL;
+}
+
+static unsigned long digest_fmix(unsigned long h)
+{
+	h ^= h >> 16;
+	h = (h * 0x85ebca6bUL) & 0xffffffffUL;
+	h ^= h >> 13;
+	h = (h * 0xc2b2ae35UL) & 0xffffffffUL;
+	h ^= h >> 16;
+	return h;
+}
+
+static void digest_init(digest_state_t *s)
+{
+	size_t i;
+
+	for (i = 0; i < STK_DIGEST_LANES; i++)
+		s->lane[i] = (0x9e3779b9UL * (i + 1)) & 0xffffffffUL;
+	s->tail_len = 0;
+	s->total = 0;
+}
+
+static void digest_block(unsigned long *lane, const unsigned char *p)
+{
+	unsigned long k;
+	size_t i;
+
+	for (i = 0; i < STK_DIGEST_LANES; i++, p += 4) {
+		k = (unsigned long)p[0] | (unsigned long)p[1] << 8 |
+		    (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+		k = digest_rotl((k * 0xcc9e2d51UL) & 0xffffffffUL, 15);
+		k = (k * 0x1b873593UL) & 0xffffffffUL;
+		lane[i] = digest_rotl(lane[i] ^ k, 13);
+		lane[i] = (lane[i] * 5 + 0xe6546b64UL) & 0xffffffffUL;
+	}
+}
+
+static void digest_update(digest_state_t *s, const unsigned char *p,
+			  size_t len)
+{
+	size_t take;
+
+	s->total = (s->total + (unsigned long)len) & 0xffffffffUL;
+
+	if (s->tail_len) {
+		take = STK_DIGEST_BLOCK - s->tail_len;
+		if (take > len)
+			take = len;
+		memcpy(s->tail + s->tail_len, p, take);
+		s->tail_len += take;
+		p += take;
+		len -= take;
+		if (s->tail_len < STK_DIGEST_BLOCK)
+			return;
+		digest_block(s->lane, s->tail);
+		s->tail_len = 0;
+	}
+
+	for (; len >= STK_DIGEST_BLOCK; p += STK_DIGEST_BLOCK,
+					len -= STK_DIGEST_BLOCK)
+		digest_block(s->lane, p);
+
+	memcpy(s->tail, p, len);
+	s->tail_len = len;
+}
+
+static void digest_final(digest_state_t *s, unsigned long *out)
+{
+	size_t i;
+
+	if (s->tail_len) {
+		memset(s->tail + s->tail_len, 0,
+		       STK_DIGEST_BLOCK - s->tail_len);
+		digest_block(s->lane, s->tail);
+	}
+
+	for (i = 0; i < STK_DIGEST_LANES; i++)
+		s->lane[i] ^= s->total;
+	for (i = 1; i < STK_DIGEST_LANES; i++)
+		s->lane[0] = (s->lane[0] + s->lane[i]) & 0xffffffffUL;
+	for (i = 1; i < STK_DIGEST_LANES; i++)
+		s->lane[i] = (s->lane[i] + s->lane[0]) & 0xffffffffUL;
 
+	for (i = 0; i < STK_DIGEST_LANES; i++)
+		out[i] = digest_fmix(s->lane[i]);
+}
+
+static unsigned char digest_equal(const unsigned long *a,
+				  const unsigned long *b)
+{
+	size_t i;
+
+	for (i = 0; i < STK_DIGEST_LANES; i++)
+		if (a[i] != b[i])
+			return 0;
+	return 1;
+}
+
+#ifndef _WIN32
+/* A writer that still holds its lock is not done. The probe lock stays
+ * held until fd is closed so the writer cannot start over mid-copy.
+ * Writers that do not lock are caught by the settle window instead */
+static unsigned char is_fd_ready(int fd)
+{
+	return flock(fd, LOCK_EX | LOCK_NB) == 0;
+}
+#endif
+
+#ifndef __linux__
 static unsigned char is_file_ready(const char *dir_path, const char *filename)
 {
 	char full_path[STK_PATH_MAX_OS];
@@ -44,36 +261,23 @@ static unsigned char is_file_ready(const char *dir_path, const char *filename)
 	size = GetFileSize(h, NULL);
 	CloseHandle(h);
 
-	if (size == INVALID_FILE_SIZE || size < 1024)
-		return 0;
-
-	return 1;
+	return size != INVALID_FILE_SIZE;
 #else
 	int fd;
-	struct stat st;
+	unsigned char ready;
 
 	sprintf(full_path, "%s/%s", dir_path, filename);
 
-	if (stat(full_path, &st) != 0)
-		return 0;
-
-	if (st.st_size < 1024)
-		return 0;
-
 	fd = open(full_path, O_RDONLY);
 	if (fd < 0)
 		return 0;
 
-	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
-		close(fd);
-		return 0;
-	}
-
-	flock(fd, LOCK_UN);
+	ready = is_fd_ready(fd);
 	close(fd);
-	return 1;
+	return ready;
 #endif
 }
+#endif
 
 #ifndef __linux__
 typedef struct {
@@ -85,10 +289,14 @@ typedef struct {
 #endif
 } platform_snapshot_t;
 
+/* one module root, watched flat by diffing directory snapshots */
 typedef struct {
 	char path[STK_PATH_MAX];
 	platform_snapshot_t *snaps;
 	size_t count;
+#ifdef _WIN32
+	HANDLE notify_handle;
+#endif
 	union {
 #ifdef _WIN32
 		HANDLE change_handle;
@@ -101,9 +309,70 @@ typedef struct {
 		} k;
 #endif
 	} watch;
+} platform_watch_root_t;
+
+typedef struct {
+	platform_watch_root_t **roots;
+	size_t root_count;
+#ifndef _WIN32
+	/* shared by every root so that one descriptor covers them all */
+	int kq;
+#endif
+} platform_watch_context_t;
+#else
+typedef struct {
+	int wd;
+	size_t root;
+	char rel[STK_PATH_MAX];
+} platform_watch_dir_t;
+
+typedef struct {
+	int fd;
+	char (*roots)[STK_PATH_MAX_OS];
+	size_t root_count;
+	/* every watched directory under the roots; by_wd maps a watch
+	 * descriptor to its index + 1 and freed entries have wd -1 */
+	platform_watch_dir_t *dirs;
+	size_t dir_count;
+	size_t dir_capacity;
+	size_t *by_wd;
+	size_t by_wd_capacity;
+	char *buf;
+	size_t buf_capacity;
+	/* events gathered by one check, deduplicated by root and path
+	 * through set, which holds event index + 1 (0 for an empty slot) */
+	stk_module_event_t *evs;
+	char (*files)[STK_PATH_MAX];
+	size_t *file_roots;
+	size_t count;
+	size_t capacity;
+	size_t *set;
+	size_t set_capacity;
+	unsigned char rescan;
 } platform_watch_context_t;
 #endif
 
+/* a level-triggered wakeup another thread can wait on: a non-blocking
+ * pipe on POSIX so that it has a pollable descriptor, an event on
+ * Windows */
+typedef struct {
+#ifdef _WIN32
+	HANDLE event;
+#else
+	int fds[2];
+#endif
+} platform_notify_t;
+
+typedef struct {
+	void (*fn)(void *);
+	void *arg;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+} platform_thread_t;
+
 unsigned char platform_mkdir(const char *path)
 {
 #ifdef _WIN32
@@ -146,284 +415,1331 @@ int platform_remove_file(const char *path)
 #endif
 }
 
-unsigned char platform_copy_file(const char *from, const char *to)
+#ifndef _WIN32
+static unsigned char copy_rewind(int src, int dst)
 {
-	char buf[STK_PATH_MAX_OS];
-	int ret = STK_PLATFORM_FILE_COPY_ERROR;
-#ifdef _WIN32
-	sprintf(buf, "%s.tmp", to);
-	if (CopyFileA(from, buf, FALSE)) {
-		if (MoveFileExA(buf, to, MOVEFILE_REPLACE_EXISTING))
-			ret = 0;
-		else
-			DeleteFileA(buf);
-	}
-#else
-	FILE *src = NULL, *dst = NULL;
-	char tmp_path[STK_PATH_MAX_OS];
-	size_t n;
-	char dir_path[STK_PATH_MAX_OS];
-	const char *filename;
-
-	filename = strrchr(from, '/');
-	if (filename) {
-		size_t dir_len = filename - from;
-		strncpy(dir_path, from, dir_len);
-		dir_path[dir_len] = '\0';
-		filename++;
-	} else {
-		strcpy(dir_path, ".");
-		filename = from;
-	}
+	return lseek(src, 0, SEEK_SET) == 0 && lseek(dst, 0, SEEK_SET) == 0 &&
+	       ftruncate(dst, 0) == 0;
+}
 
-	if (!is_file_ready(dir_path, filename))
-		goto done;
+static unsigned char copy_fd_buffer(int src, int dst)
+{
+	char *buf;
+	ssize_t n, w, off;
+	unsigned char ok = 0;
 
-	sprintf(tmp_path, "%s.tmp", to);
+	buf = malloc(STK_COPY_BUFFER_SIZE);
+	if (!buf)
+		return 0;
 
-	src = fopen(from, "rb");
-	if (!src)
-		goto cleanup;
+	for (;;) {
+		n = read(src, buf, STK_COPY_BUFFER_SIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			goto done;
+		if (n == 0)
+			break;
 
-	dst = fopen(tmp_path, "wb");
-	if (!dst)
-		goto cleanup;
+		for (off = 0; off < n; off += w) {
+			w = write(dst, buf + off, n - off);
+			if (w < 0 && errno == EINTR)
+				w = 0;
+			else if (w <= 0)
+				goto done;
+		}
+	}
+	ok = 1;
 
-	while ((n = fread(buf, 1, sizeof(buf), src)) > 0)
-		fwrite(buf, 1, n, dst);
+done:
+	free(buf);
+	return ok;
+}
 
-	if (src)
-		fclose(src);
-	if (dst)
-		fclose(dst);
-	src = NULL;
-	dst = NULL;
+#ifdef __linux__
+/* copy_file_range and sendfile move data inside the kernel; either may
+ * refuse a given pair of filesystems, in which case the caller rewinds
+ * and falls through to the next strategy. */
+static unsigned char copy_fd_kernel(int src, int dst, off_t size,
+				    unsigned char use_range)
+{
+	off_t total = 0;
+	long n;
+
+	for (;;) {
+#ifdef SYS_copy_file_range
+		if (use_range)
+			n = syscall(SYS_copy_file_range, src, NULL, dst, NULL,
+				    (size_t)STK_COPY_CHUNK, 0);
+		else
+#endif
+			n = (long)sendfile(dst, src, NULL,
+					   (size_t)STK_COPY_CHUNK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return 0;
+		if (n == 0)
+			break;
+		total += n;
+	}
 
-	if (rename(tmp_path, to) == 0)
-		ret = STK_PLATFORM_OPERATION_SUCCESS;
-	else
-		unlink(tmp_path);
+	return total >= size;
+}
+#endif
 
-	goto done;
+/* ELF modules are fingerprinted by their loadable image, anything else
+ * by its bytes. *unchanged gets the code to report if the digest matches */
+static unsigned char digest_fd(int fd, const struct stat *st,
+			       unsigned long *out, unsigned char *unchanged)
+{
+	digest_state_t s;
+	void *map;
 
-cleanup:
-	if (src)
-		fclose(src);
-	if (dst)
-		fclose(dst);
-	unlink(tmp_path);
+	map = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 0;
 
-done:
+#if defined(__ELF__)
+	if (elf_image_digest(map, (size_t)st->st_size, out)) {
+		munmap(map, (size_t)st->st_size);
+		*unchanged = STK_PLATFORM_IMAGE_UNCHANGED;
+		return 1;
+	}
 #endif
 
-	return ret;
+	digest_init(&s);
+	digest_update(&s, map, (size_t)st->st_size);
+	munmap(map, (size_t)st->st_size);
+	digest_final(&s, out);
+	*unchanged = STK_PLATFORM_FILE_UNCHANGED;
+	return 1;
 }
 
-unsigned char platform_remove_dir(const char *path)
+static int copy_fd(int src, int dst, const struct stat *st)
 {
-#ifdef _WIN32
-	WIN32_FIND_DATAA fd;
-	HANDLE h;
-	char s[STK_PATH_MAX_OS], f[STK_PATH_MAX_OS];
-	sprintf(s, "%s\\*", path);
+#ifdef __linux__
+	if (ioctl(dst, FICLONE, src) == 0)
+		return STK_COPY_CLONE;
+
+#ifdef SYS_copy_file_range
+	if (copy_fd_kernel(src, dst, st->st_size, 1))
+		return STK_COPY_RANGE;
+	if (!copy_rewind(src, dst))
+		return -1;
+#endif
 
-	h = FindFirstFileA(s, &fd);
-	if (h == INVALID_HANDLE_VALUE)
-		goto remove_dir;
+	if (copy_fd_kernel(src, dst, st->st_size, 0))
+		return STK_COPY_SENDFILE;
+	if (!copy_rewind(src, dst))
+		return -1;
+#else
+	(void)st;
+#endif
 
-	do {
-		if (strcmp(fd.cFileName, ".") == 0 ||
-		    strcmp(fd.cFileName, "..") == 0)
-			continue;
+	return copy_fd_buffer(src, dst) ? STK_COPY_BUFFER : -1;
+}
+#endif
 
-		sprintf(f, "%s\\%s", path, fd.cFileName);
-		DeleteFileA(f);
-	} while (FindNextFileA(h, &fd));
+#ifndef _WIN32
+#define STK_SHADOW_FILES 0
+#define STK_SHADOW_MEMFD 1
+#define STK_SHADOW_STORE 2
+/* what store_copy() returns when the store already held the file */
+#define STK_SHADOW_REUSED STK_COPY_STRATEGY_COUNT
+#define STK_SHADOW_KEY (STK_DIGEST_LANES * 8 + 1)
+#define STK_STORE_ATTEMPTS 3
+
+/* Shadows outside the temp directory: the temp directory path only names
+ * a shadow copy, and is resolved here to whatever holds it.
+ *
+ * memfd (Linux): a sealed memory file. A name keeps its descriptor number
+ * for as long as stk runs and fresh copies are dup'd over it, because the
+ * loader matches already loaded objects by path and /proc/self/fd/N must
+ * never name another module.
+ *
+ * store: a file named after the module and its content digest in a
+ * directory shared by every process and every run, so identical modules
+ * are one inode and one set of cached pages, and a module the store
+ * already holds is not copied at all. Each process keeps a shared flock
+ * on the files it uses; whoever lets go of one and can then lock it
+ * exclusively without waiting was its last user, and deletes it.
+ *
+ * The watcher thread installs shadows while stk_poll() resolves them, so
+ * the table is locked. */
+typedef struct {
+	unsigned long hash;
+	int fd;
+	/* memfd: a dup of fd that a reload loaded the module through, held
+	 * open so its number cannot name another module while it is mapped */
+	int stage_fd;
+	char name[STK_PATH_MAX];
+	char key[STK_SHADOW_KEY];
+} shadow_fd_t;
+
+static pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+static int shadow_mode = STK_SHADOW_FILES;
+static char shadow_store[STK_PATH_MAX_OS];
+#ifdef __linux__
+static unsigned int shadow_flags = 0;
+#endif
+static shadow_fd_t *shadow_fds = NULL;
+static size_t shadow_count = 0;
+static size_t shadow_capacity = 0;
+/* shadow_fds index + 1 per slot, 0 for an empty one */
+static size_t *shadow_set = NULL;
+static size_t shadow_set_capacity = 0;
+
+/* the file name of a path inside the temp directory, NULL for any other
+ * path or when shadows are ordinary files */
+static const char *shadow_name(const char *path)
+{
+	const char *tmp = stk_get_tmp_dir();
+	size_t len = strlen(tmp);
 
-	FindClose(h);
+	if (shadow_mode == STK_SHADOW_FILES || strncmp(path, tmp, len) != 0 ||
+	    path[len] != STK_PATH_SEP)
+		return NULL;
+	return path + len + 1;
+}
 
-remove_dir:
-	return RemoveDirectoryA(path) ? STK_PLATFORM_OPERATION_SUCCESS
-				      : STK_PLATFORM_REMOVE_DIR_ERROR;
-#else
-	DIR *dir;
-	struct dirent *entry;
-	char filepath[STK_PATH_MAX_OS];
+static size_t shadow_slot(const char *name, unsigned long hash)
+{
+	size_t mask = shadow_set_capacity - 1;
+	size_t slot = hash & mask;
 
-	dir = opendir(path);
-	if (!dir)
-		return STK_PLATFORM_REMOVE_DIR_ERROR;
+	while (shadow_set[slot] &&
+	       (shadow_fds[shadow_set[slot] - 1].hash != hash ||
+		strcmp(shadow_fds[shadow_set[slot] - 1].name, name) != 0))
+		slot = (slot + 1) & mask;
 
-loop:
-	entry = readdir(dir);
-	if (!entry)
-		goto loop_end;
+	return slot;
+}
 
-	if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-		goto loop;
+/* the shadow of name, NULL if it has none. Called with shadow_lock held */
+static shadow_fd_t *shadow_find(const char *name)
+{
+	size_t slot;
 
-	sprintf(filepath, "%s/%s", path, entry->d_name);
-	unlink(filepath);
-	goto loop;
+	if (!shadow_set)
+		return NULL;
 
-loop_end:
-	closedir(dir);
-	return rmdir(path) == 0 ? STK_PLATFORM_OPERATION_SUCCESS
-				: STK_PLATFORM_REMOVE_DIR_ERROR;
-#endif
+	slot = shadow_slot(name, stk_hash_id(name));
+	return shadow_set[slot] ? &shadow_fds[shadow_set[slot] - 1] : NULL;
 }
 
-void *platform_load_library(const char *path)
+static unsigned char shadow_reserve(size_t count)
 {
-#ifdef _WIN32
-	return (void *)LoadLibraryA(path);
-#else
-	return dlopen(path, RTLD_NOW | RTLD_GLOBAL);
-#endif
+	size_t new_capacity, i, slot, mask;
+	shadow_fd_t *grown;
+	size_t *new_set;
+
+	if (count > shadow_capacity) {
+		new_capacity = shadow_capacity ? shadow_capacity * 2 : 16;
+		while (new_capacity < count)
+			new_capacity *= 2;
+		grown = realloc(shadow_fds, new_capacity * sizeof(*grown));
+		if (!grown)
+			return 0;
+		shadow_fds = grown;
+		shadow_capacity = new_capacity;
+	}
+
+	if (count * 2 <= shadow_set_capacity)
+		return 1;
+
+	new_capacity = shadow_set_capacity ? shadow_set_capacity * 2 : 32;
+	while (new_capacity < count * 2)
+		new_capacity *= 2;
+	new_set = calloc(new_capacity, sizeof(size_t));
+	if (!new_set)
+		return 0;
+
+	free(shadow_set);
+	shadow_set = new_set;
+	shadow_set_capacity = new_capacity;
+	mask = new_capacity - 1;
+	for (i = 0; i < shadow_count; i++) {
+		slot = shadow_fds[i].hash & mask;
+		while (shadow_set[slot])
+			slot = (slot + 1) & mask;
+		shadow_set[slot] = i + 1;
+	}
+
+	return 1;
 }
 
-void platform_unload_library(void *h)
+/* <store>/<module stem>.<key><ext>; the module name is part of it so that
+ * two modules with the same bytes still load as two objects */
+static unsigned char store_path(char *out, size_t size, const char *name,
+				const char *key)
 {
-#ifdef _WIN32
-	FreeLibrary((HMODULE)h);
-#else
-	dlclose(h);
-#endif
+	size_t len = strlen(name), ext = strlen(STK_MODULE_EXT);
+
+	if (len > ext && strcmp(name + len - ext, STK_MODULE_EXT) == 0)
+		len -= ext;
+	if (strlen(shadow_store) + len + strlen(key) + ext + 3 > size)
+		return 0;
+
+	sprintf(out, "%s%s%.*s.%s%s", shadow_store, STK_PATH_SEP_STR, (int)len,
+		name, key, STK_MODULE_EXT);
+	return 1;
 }
 
-void *platform_get_symbol(void *h, const char *s)
+/* deletes the store files nobody has used for more than max_age seconds
+ * and nobody holds, along with copies abandoned halfway. Files in use keep
+ * a fresh mtime, so identical builds still find their copies after a
+ * restart */
+static void store_prune(unsigned long max_age)
 {
-#ifdef _WIN32
-	return (void *)(intptr_t)GetProcAddress((HMODULE)h, s);
-#else
-	return dlsym(h, s);
-#endif
-}
+	struct dirent *entry;
+	struct stat st;
+	time_t now = time(NULL);
+	DIR *dir;
+	int fd;
 
-char (*platform_directory_init_scan(const char *dir_path, size_t *out_count))
-    [STK_PATH_MAX] {
-	    size_t count = 0, i = 0, name_len;
-	    char (*list)[STK_PATH_MAX] = NULL;
+	dir = opendir(shadow_store);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 ||
+		    !S_ISREG(st.st_mode) || now < st.st_mtime ||
+		    (unsigned long)(now - st.st_mtime) <= max_age)
+			continue;
+
+		fd = openat(dirfd(dir), entry->d_name, O_RDONLY);
+		if (fd < 0)
+			continue;
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+			unlinkat(dirfd(dir), entry->d_name, 0);
+		close(fd);
+	}
+
+	closedir(dir);
+}
+
+/* makes fd the shadow of name: a sealed memory file, or a locked store
+ * file whose digest is key. fd is consumed either way */
+static unsigned char shadow_install(const char *name, int fd, const char *key)
+{
+	unsigned long hash = stk_hash_id(name);
+	unsigned char ok = 0;
+	int old_fd = -1;
+	size_t slot, index;
+	shadow_fd_t *e;
+
+	pthread_mutex_lock(&shadow_lock);
+
+	if (!shadow_reserve(shadow_count + 1))
+		goto done;
+
+	slot = shadow_slot(name, hash);
+	if (shadow_set[slot]) {
+		e = &shadow_fds[shadow_set[slot] - 1];
+		if (shadow_mode == STK_SHADOW_MEMFD) {
+			ok = dup2(fd, e->fd) >= 0;
+			goto done;
+		}
+		/* store files are named by content, so a new version is a
+		 * new file and the entry simply moves to it */
+		old_fd = e->fd;
+		e->fd = fd;
+		strcpy(e->key, key);
+		fd = -1;
+		ok = 1;
+		goto done;
+	}
+
+	index = shadow_count++;
+	shadow_fds[index].hash = hash;
+	shadow_fds[index].fd = fd;
+	shadow_fds[index].stage_fd = -1;
+	strncpy(shadow_fds[index].name, name, STK_PATH_MAX - 1);
+	shadow_fds[index].name[STK_PATH_MAX - 1] = '\0';
+	strcpy(shadow_fds[index].key, key);
+	shadow_set[slot] = index + 1;
+	fd = -1;
+	ok = 1;
+
+done:
+	pthread_mutex_unlock(&shadow_lock);
+	if (fd >= 0)
+		close(fd);
+	if (old_fd >= 0)
+		close(old_fd);
+	return ok;
+}
+
+/* the path to open for path: /proc/self/fd/N for a memfd shadow, the
+ * store file for a stored one, path itself for anything else */
+static const char *shadow_resolve(const char *path, char *buf, size_t size)
+{
+	const char *name = shadow_name(path);
+	unsigned char found = 0;
+	shadow_fd_t *e;
+
+	if (!name)
+		return path;
+
+	pthread_mutex_lock(&shadow_lock);
+	e = shadow_find(name);
+	if (e && shadow_mode == STK_SHADOW_MEMFD) {
+		sprintf(buf, "/proc/self/fd/%d", e->fd);
+		found = 1;
+	} else if (e) {
+		found = store_path(buf, size, name, e->key);
+	}
+	pthread_mutex_unlock(&shadow_lock);
+
+	return found ? buf : path;
+}
+
+static unsigned char shadow_exists(const char *path)
+{
+	const char *name = shadow_name(path);
+	unsigned char found;
+
+	if (!name)
+		return access(path, F_OK) == 0;
+
+	pthread_mutex_lock(&shadow_lock);
+	found = shadow_find(name) != NULL;
+	pthread_mutex_unlock(&shadow_lock);
+	return found;
+}
+
+#ifdef __linux__
+static int shadow_create(const char *name)
+{
+	return (int)syscall(SYS_memfd_create, name, shadow_flags);
+}
+
+/* copies src into a fresh memory file, seals it and installs it as the
+ * shadow of name. Returns the copy strategy, -1 on failure */
+static int memfd_copy(int src, const struct stat *st, const char *name)
+{
+	int dst, strategy;
+
+	dst = shadow_create(name);
+	if (dst < 0)
+		return -1;
+
+	strategy = copy_fd(src, dst, st);
+	if (strategy < 0 || fcntl(dst, F_ADD_SEALS, STK_SHADOW_SEALS) != 0) {
+		close(dst);
+		return -1;
+	}
+
+	return shadow_install(name, dst, "") ? strategy : -1;
+}
+#endif
+
+/* installs the store file for src, whose digest is digest, as the shadow
+ * of name, copying src into the store only if the file is not there yet.
+ * Returns the copy strategy, STK_SHADOW_REUSED if nothing was copied, -1
+ * on failure */
+static int store_copy(int src, const struct stat *st, const char *name,
+		      const unsigned long *digest)
+{
+	char key[STK_SHADOW_KEY];
+	char path[STK_PATH_MAX_OS];
+	char tmp_path[STK_PATH_MAX_OS + 32];
+	struct stat held;
+	int fd, dst, attempt, strategy = STK_SHADOW_REUSED;
+	size_t i;
+
+	for (i = 0; i < STK_DIGEST_LANES; i++)
+		sprintf(key + i * 8, "%08lx", digest[i] & 0xffffffffUL);
+	if (!store_path(path, sizeof(path), name, key))
+		return -1;
+	sprintf(tmp_path, "%s.%ld.tmp", path, (long)getpid());
+
+	for (attempt = 0; attempt < STK_STORE_ATTEMPTS; attempt++) {
+		fd = open(path, O_RDONLY);
+		if (fd >= 0) {
+			/* a file store_prune() was deleting has lost
+			 * its name by the time the lock is granted */
+			if (flock(fd, LOCK_SH) == 0 && fstat(fd, &held) == 0 &&
+			    held.st_nlink > 0) {
+				/* the mtime records the last use, which
+				 * store_prune() goes by */
+				utime(path, NULL);
+				return shadow_install(name, fd, key) ? strategy
+								     : -1;
+			}
+			close(fd);
+		} else if (errno != ENOENT) {
+			return -1;
+		}
+
+		dst = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC,
+			   st->st_mode & 0777);
+		if (dst < 0)
+			return -1;
+
+		if (lseek(src, 0, SEEK_SET) != 0)
+			strategy = -1;
+		else
+			strategy = copy_fd(src, dst, st);
+		if (close(dst) != 0)
+			strategy = -1;
+		if (strategy < 0 || rename(tmp_path, path) != 0) {
+			unlink(tmp_path);
+			return -1;
+		}
+	}
+
+	return -1;
+}
+#endif
+
+/* Keeps shadow copies in sealed memory files instead of the temp
+ * directory. Returns 0 where that is unavailable */
+unsigned char platform_shadow_memfd_start(void)
+{
+#ifdef __linux__
+	int fd;
+
+	/* kernels that can refuse executable memory files want MFD_EXEC
+	 * spelled out; older ones reject the flag */
+	shadow_flags = MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_EXEC;
+	fd = shadow_create("stk");
+	if (fd < 0 && errno == EINVAL) {
+		shadow_flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+		fd = shadow_create("stk");
+	}
+	if (fd < 0)
+		return 0;
+
+	close(fd);
+	shadow_mode = STK_SHADOW_MEMFD;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Keeps shadow copies in the shared store directory path instead of the
+ * temp directory, first deleting the files left unused for more than
+ * max_age seconds, none if max_age is 0. Returns 0 where that is
+ * unavailable */
+unsigned char platform_shadow_store_start(const char *path,
+					  unsigned long max_age)
+{
+#ifndef _WIN32
+	if (strlen(path) >= sizeof(shadow_store))
+		return 0;
+
+	platform_mkdir(path);
+	if (access(path, R_OK | W_OK | X_OK) != 0)
+		return 0;
+
+	strcpy(shadow_store, path);
+	shadow_mode = STK_SHADOW_STORE;
+	if (max_age > 0)
+		store_prune(max_age);
+	return 1;
+#else
+	(void)path;
+	(void)max_age;
+	return 0;
+#endif
+}
+
+/* lets go of every shadow. Store files stay for later runs */
+void platform_shadow_stop(void)
+{
+#ifndef _WIN32
+	size_t i;
+
+	pthread_mutex_lock(&shadow_lock);
+	for (i = 0; i < shadow_count; i++) {
+		close(shadow_fds[i].fd);
+		if (shadow_fds[i].stage_fd >= 0)
+			close(shadow_fds[i].stage_fd);
+	}
+	free(shadow_fds);
+	free(shadow_set);
+	shadow_fds = NULL;
+	shadow_set = NULL;
+	shadow_count = 0;
+	shadow_capacity = 0;
+	shadow_set_capacity = 0;
+	shadow_mode = STK_SHADOW_FILES;
+	pthread_mutex_unlock(&shadow_lock);
+#endif
+}
+
+/* a second path to the shadow copy at path, under which the loader maps
+ * a new object even while a module loaded from path is still mapped, so a
+ * reload can open the new version before it lets go of the old one.
+ * Returns 0 where that is not possible. Ended by platform_shadow_unstage()
+ * once the library loaded from out is either kept or unloaded */
+unsigned char platform_shadow_stage(const char *path, char *out, size_t size)
+{
 #ifdef _WIN32
-	    WIN32_FIND_DATAA fd;
-	    HANDLE h;
-	    char s[STK_PATH_MAX_OS];
+	/* LoadLibrary hands back any loaded module with the same file name,
+	 * whatever directory it was loaded from */
+	(void)path;
+	(void)out;
+	(void)size;
+	return 0;
+#else
+	static unsigned long serial = 0;
+	const char *name = shadow_name(path);
+	unsigned char ok = 0;
+	shadow_fd_t *e;
+	int fd;
 
-	    sprintf(s, "%s\\*", dir_path);
-	    h = FindFirstFileA(s, &fd);
-	    if (h == INVALID_HANDLE_VALUE)
-		    goto create_and_exit;
+	/* the new version would bind its own exported names to the old one,
+	 * which then could not be unloaded either */
+	if (!dlopen_own_binding())
+		return 0;
 
-	    do {
-		    if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-			    continue;
-		    if (is_valid_module_file(fd.cFileName))
-			    count++;
-	    } while (FindNextFileA(h, &fd));
+	/* a hard link under a name never used before: the loader matches
+	 * loaded objects by path, then by inode, and the copy is a new one */
+	if (!name) {
+		if (strlen(path) + 32 > size)
+			return 0;
+		sprintf(out, "%s.%ld.%lu", path, (long)getpid(), ++serial);
+		return link(path, out) == 0;
+	}
 
-	    FindClose(h);
+	pthread_mutex_lock(&shadow_lock);
+	e = shadow_find(name);
+	if (e && shadow_mode == STK_SHADOW_STORE) {
+		/* named by content, so a new version has a path of its own */
+		ok = store_path(out, size, name, e->key);
+	} else if (e) {
+		fd = dup(e->fd);
+		if (fd >= 0) {
+			sprintf(out, "/proc/self/fd/%d", fd);
+			ok = 1;
+		}
+	}
+	pthread_mutex_unlock(&shadow_lock);
+	return ok;
+#endif
+}
+
+/* loaded says whether the library opened from staged stays loaded. If it
+ * does, it replaced whatever an earlier staging of path had loaded */
+void platform_shadow_unstage(const char *path, const char *staged,
+			     unsigned char loaded)
+{
+#ifdef _WIN32
+	(void)path;
+	(void)staged;
+	(void)loaded;
+#else
+	const char *name = shadow_name(path);
+	shadow_fd_t *e;
+	int fd, old_fd = -1;
+
+	/* the loader keeps its mapping of an unlinked file */
+	if (!name) {
+		unlink(staged);
+		return;
+	}
+	if (shadow_mode != STK_SHADOW_MEMFD)
+		return;
+
+	fd = atoi(staged + strlen("/proc/self/fd/"));
+	pthread_mutex_lock(&shadow_lock);
+	e = shadow_find(name);
+	if (e && loaded) {
+		old_fd = e->stage_fd;
+		e->stage_fd = fd;
+	} else {
+		old_fd = fd;
+	}
+	pthread_mutex_unlock(&shadow_lock);
+
+	if (old_fd >= 0)
+		close(old_fd);
+#endif
+}
+
+/* digest, when given, holds the digest of the current shadow copy at to.
+ * If the source still hashes to it and the shadow exists, nothing is
+ * copied and STK_PLATFORM_FILE_UNCHANGED, or STK_PLATFORM_IMAGE_UNCHANGED
+ * for an ELF fingerprint, is returned; otherwise it is updated once the
+ * copy is in place. */
+unsigned char platform_copy_file(const char *from, const char *to,
+				 unsigned long *digest)
+{
+	int ret = STK_PLATFORM_FILE_COPY_ERROR;
+	unsigned long fresh[STK_DIGEST_LANES];
+#ifdef _WIN32
+	char buf[STK_PATH_MAX_OS];
+	unsigned char chunk[65536];
+	digest_state_t s;
+	size_t n;
+	FILE *fp;
+
+	if (digest) {
+		fp = fopen(from, "rb");
+		if (!fp)
+			return ret;
+		digest_init(&s);
+		while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+			digest_update(&s, chunk, n);
+		fclose(fp);
+		digest_final(&s, fresh);
+
+		if (digest_equal(fresh, digest) &&
+		    GetFileAttributesA(to) != INVALID_FILE_ATTRIBUTES)
+			return STK_PLATFORM_FILE_UNCHANGED;
+	}
+
+	sprintf(buf, "%s.tmp", to);
+	if (CopyFileA(from, buf, FALSE)) {
+		if (MoveFileExA(buf, to, MOVEFILE_REPLACE_EXISTING)) {
+			platform_atomic_add(
+			    &stk_watch_stats->copies[STK_COPY_BUFFER], 1);
+			if (digest)
+				memcpy(digest, fresh, sizeof(fresh));
+			ret = 0;
+		} else {
+			DeleteFileA(buf);
+		}
+	}
+#else
+	char tmp_path[STK_PATH_MAX_OS];
+	struct stat st;
+	int src, dst = -1, strategy;
+	unsigned char unchanged;
+	const char *name = shadow_name(to);
+
+	src = open(from, O_RDONLY);
+	if (src < 0)
+		return ret;
+
+	if (fstat(src, &st) != 0 || st.st_size == 0 || !is_fd_ready(src))
+		goto done;
+
+	/* the store is keyed by digest, so it needs one even when the
+	 * caller keeps none */
+	if (digest || shadow_mode == STK_SHADOW_STORE) {
+		if (!digest_fd(src, &st, fresh, &unchanged))
+			goto done;
+		if (digest && digest_equal(fresh, digest) && shadow_exists(to)) {
+			ret = unchanged;
+			goto done;
+		}
+	}
+
+	if (name) {
+#ifdef __linux__
+		if (shadow_mode == STK_SHADOW_MEMFD)
+			strategy = memfd_copy(src, &st, name);
+		else
+#endif
+			strategy = store_copy(src, &st, name, fresh);
+		if (strategy < 0)
+			goto done;
+		goto copied;
+	}
+
+	sprintf(tmp_path, "%s.tmp", to);
+
+	dst = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+	if (dst < 0)
+		goto done;
+
+	strategy = copy_fd(src, dst, &st);
+	if (close(dst) != 0)
+		strategy = -1;
+	dst = -1;
+
+	if (strategy < 0 || rename(tmp_path, to) != 0) {
+		unlink(tmp_path);
+		goto done;
+	}
+
+copied:
+	if (strategy == STK_SHADOW_REUSED)
+		platform_atomic_add(&stk_watch_stats->reused, 1);
+	else
+		platform_atomic_add(&stk_watch_stats->copies[strategy], 1);
+	if (digest)
+		memcpy(digest, fresh, sizeof(fresh));
+	ret = STK_PLATFORM_OPERATION_SUCCESS;
+
+done:
+	if (dst >= 0) {
+		close(dst);
+		unlink(tmp_path);
+	}
+	close(src);
+#endif
+
+	return ret;
+}
+
+unsigned char platform_remove_dir(const char *path)
+{
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE h;
+	char s[STK_PATH_MAX_OS], f[STK_PATH_MAX_OS];
+	sprintf(s, "%s\\*", path);
+
+	h = FindFirstFileA(s, &fd);
+	if (h == INVALID_HANDLE_VALUE)
+		goto remove_dir;
+
+	do {
+		if (strcmp(fd.cFileName, ".") == 0 ||
+		    strcmp(fd.cFileName, "..") == 0)
+			continue;
+
+		sprintf(f, "%s\\%s", path, fd.cFileName);
+		DeleteFileA(f);
+	} while (FindNextFileA(h, &fd));
+
+	FindClose(h);
+
+remove_dir:
+	return RemoveDirectoryA(path) ? STK_PLATFORM_OPERATION_SUCCESS
+				      : STK_PLATFORM_REMOVE_DIR_ERROR;
+#else
+	DIR *dir;
+	struct dirent *entry;
+	char filepath[STK_PATH_MAX_OS];
+
+	dir = opendir(path);
+	if (!dir)
+		return STK_PLATFORM_REMOVE_DIR_ERROR;
+
+loop:
+	entry = readdir(dir);
+	if (!entry)
+		goto loop_end;
+
+	if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+		goto loop;
+
+	sprintf(filepath, "%s/%s", path, entry->d_name);
+	unlink(filepath);
+	goto loop;
+
+loop_end:
+	closedir(dir);
+	return rmdir(path) == 0 ? STK_PLATFORM_OPERATION_SUCCESS
+				: STK_PLATFORM_REMOVE_DIR_ERROR;
+#endif
+}
+
+void *platform_load_library(const char *path)
+{
+#ifdef _WIN32
+	return (void *)LoadLibraryA(path);
+#else
+	char buf[STK_PATH_MAX_OS];
+
+	pthread_once(&dlopen_once, dlopen_flags_init);
+	return dlopen(shadow_resolve(path, buf, sizeof(buf)), dlopen_flags);
+#endif
+}
+
+void platform_unload_library(void *h)
+{
+#ifdef _WIN32
+	FreeLibrary((HMODULE)h);
+#else
+	dlclose(h);
+#endif
+}
+
+void *platform_get_symbol(void *h, const char *s)
+{
+#ifdef _WIN32
+	return (void *)(intptr_t)GetProcAddress((HMODULE)h, s);
+#else
+	return dlsym(h, s);
+#endif
+}
+
+/* nonzero if the code or data at a and b belong to the same loaded
+ * object. Windows binds every import to a named DLL, so nothing there
+ * resolves into another module by accident */
+unsigned char platform_same_library(const void *a, const void *b)
+{
+#ifdef _WIN32
+	(void)a;
+	(void)b;
+	return 1;
+#else
+	Dl_info ia, ib;
+
+	if (!dladdr(a, &ia) || !dladdr(b, &ib))
+		return 0;
+	return ia.dli_fbase == ib.dli_fbase;
+#endif
+}
+
+/* the size of the object that starts at addr, 0 if the loader cannot say */
+size_t platform_symbol_size(const void *addr)
+{
+#if defined(__GLIBC__) && defined(__ELF__)
+	Dl_info info;
+	const ElfW(Sym) *sym = NULL;
+
+	if (!dladdr1(addr, &info, (void **)&sym, RTLD_DL_SYMENT) || !sym ||
+	    info.dli_saddr != addr)
+		return 0;
+	return (size_t)sym->st_size;
+#else
+	(void)addr;
+	return 0;
+#endif
+}
+
+#if defined(__ELF__) && !defined(_WIN32)
+#if defined(__LP64__) || defined(_LP64)
+#define STK_ELF_CLASS ELFCLASS64
+typedef Elf64_Ehdr stk_elf_ehdr_t;
+typedef Elf64_Phdr stk_elf_phdr_t;
+typedef Elf64_Shdr stk_elf_shdr_t;
+typedef Elf64_Sym stk_elf_sym_t;
+#else
+#define STK_ELF_CLASS ELFCLASS32
+typedef Elf32_Ehdr stk_elf_ehdr_t;
+typedef Elf32_Phdr stk_elf_phdr_t;
+typedef Elf32_Shdr stk_elf_shdr_t;
+typedef Elf32_Sym stk_elf_sym_t;
+#endif
+
+/* finds symbol in .dynsym and returns the file range holding its data,
+ * st_size bytes or up to the end of its section if it has no size.
+ * Only objects of the host's own class are accepted, which is all
+ * dlopen would take anyway */
+static const unsigned char *elf_find_symbol(const unsigned char *img,
+					    size_t size, const char *symbol,
+					    size_t *out_len)
+{
+	const stk_elf_ehdr_t *eh = (const stk_elf_ehdr_t *)img;
+	const stk_elf_shdr_t *sh, *symtab = NULL, *strtab, *sec;
+	const stk_elf_sym_t *sym;
+	const char *names;
+	size_t i, nsyms, offset;
+
+	if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    eh->e_ident[EI_CLASS] != STK_ELF_CLASS ||
+	    eh->e_shentsize != sizeof(stk_elf_shdr_t) || eh->e_shoff == 0 ||
+	    eh->e_shoff > size ||
+	    eh->e_shnum > (size - eh->e_shoff) / sizeof(stk_elf_shdr_t))
+		return NULL;
+
+	sh = (const stk_elf_shdr_t *)(img + eh->e_shoff);
+	for (i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type == SHT_DYNSYM) {
+			symtab = &sh[i];
+			break;
+		}
+	}
+
+	if (!symtab || symtab->sh_link >= eh->e_shnum ||
+	    symtab->sh_offset > size ||
+	    symtab->sh_size > size - symtab->sh_offset)
+		return NULL;
+
+	strtab = &sh[symtab->sh_link];
+	if (strtab->sh_offset > size || strtab->sh_size > size - strtab->sh_offset)
+		return NULL;
+
+	sym = (const stk_elf_sym_t *)(img + symtab->sh_offset);
+	names = (const char *)(img + strtab->sh_offset);
+	nsyms = symtab->sh_size / sizeof(stk_elf_sym_t);
+
+	for (i = 0; i < nsyms; i++) {
+		if (sym[i].st_shndx == SHN_UNDEF ||
+		    sym[i].st_shndx >= eh->e_shnum ||
+		    sym[i].st_name >= strtab->sh_size ||
+		    strncmp(names + sym[i].st_name, symbol,
+			    strtab->sh_size - sym[i].st_name) != 0)
+			continue;
+
+		sec = &sh[sym[i].st_shndx];
+		if (sec->sh_type == SHT_NOBITS) {
+			/* zero-filled at load time: an empty table */
+			*out_len = 0;
+			return img;
+		}
+
+		if (sym[i].st_value < sec->sh_addr ||
+		    sym[i].st_value - sec->sh_addr >= sec->sh_size)
+			return NULL;
+
+		offset = sec->sh_offset + (sym[i].st_value - sec->sh_addr);
+		if (offset >= size)
+			return NULL;
+
+		/* the symbol's own size when it has one: whatever follows
+		 * it in the section is another object */
+		*out_len = sec->sh_offset + sec->sh_size - offset;
+		if (sym[i].st_size != 0 && sym[i].st_size < *out_len)
+			*out_len = sym[i].st_size;
+		if (*out_len > size - offset)
+			*out_len = size - offset;
+		return img + offset;
+	}
+
+	return NULL;
+}
+
+/* hashes what the loader maps: the layout and file bytes of every PT_LOAD
+ * segment, which include .dynsym, .dynstr and the code, minus the ELF
+ * header (its section header fields move with debug info) and any PT_NOTE
+ * ranges. Debug sections, .comment and the symbol table are never loaded
+ * and build-id notes are skipped, so rebuilds that only change those hash
+ * the same */
+static unsigned char elf_image_digest(const unsigned char *img, size_t size,
+				      unsigned long *out)
+{
+	const stk_elf_ehdr_t *eh = (const stk_elf_ehdr_t *)img;
+	const stk_elf_phdr_t *ph;
+	digest_state_t s;
+	size_t i, n, pos, end, next, skip, loads = 0;
+
+	if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    eh->e_ident[EI_CLASS] != STK_ELF_CLASS ||
+	    eh->e_phentsize != sizeof(stk_elf_phdr_t) || eh->e_phoff == 0 ||
+	    eh->e_phoff > size ||
+	    eh->e_phnum > (size - eh->e_phoff) / sizeof(stk_elf_phdr_t))
+		return 0;
+
+	ph = (const stk_elf_phdr_t *)(img + eh->e_phoff);
+	digest_init(&s);
+	digest_update(&s, (const unsigned char *)&eh->e_machine,
+		      sizeof(eh->e_machine));
+	digest_update(&s, (const unsigned char *)&eh->e_entry,
+		      sizeof(eh->e_entry));
+
+	for (i = 0; i < eh->e_phnum; i++) {
+		if (ph[i].p_type != PT_LOAD)
+			continue;
+		if (ph[i].p_offset > size ||
+		    ph[i].p_filesz > size - ph[i].p_offset)
+			return 0;
+
+		digest_update(&s, (const unsigned char *)&ph[i].p_vaddr,
+			      sizeof(ph[i].p_vaddr));
+		digest_update(&s, (const unsigned char *)&ph[i].p_memsz,
+			      sizeof(ph[i].p_memsz));
+		digest_update(&s, (const unsigned char *)&ph[i].p_flags,
+			      sizeof(ph[i].p_flags));
+
+		pos = ph[i].p_offset;
+		end = pos + ph[i].p_filesz;
+		while (pos < end) {
+			next = end;
+			skip = pos < sizeof(*eh) ? sizeof(*eh) : pos;
+			for (n = 0; n < eh->e_phnum; n++) {
+				if (ph[n].p_type != PT_NOTE)
+					continue;
+				if (ph[n].p_offset <= pos &&
+				    pos < ph[n].p_offset + ph[n].p_filesz)
+					skip = ph[n].p_offset + ph[n].p_filesz;
+				else if (ph[n].p_offset > pos &&
+					 ph[n].p_offset < next)
+					next = ph[n].p_offset;
+			}
+
+			if (skip > pos) {
+				pos = skip < end ? skip : end;
+				continue;
+			}
+
+			digest_update(&s, img + pos, next - pos);
+			pos = next;
+		}
+		loads++;
+	}
+
+	if (!loads)
+		return 0;
+
+	digest_final(&s, out);
+	return 1;
+}
+#endif
+
+/* reads a module's dependency table straight from the file, without
+ * loading it. Fails on anything it cannot parse so the caller can fall
+ * back to loading the library */
+unsigned char platform_read_module_deps(const char *path, const char *symbol,
+					const char *descriptor,
+					stk_dep_t **out_deps, size_t *out_count)
+{
+#if defined(__ELF__) && !defined(_WIN32)
+	int fd;
+	struct stat st;
+	void *img;
+	const unsigned char *table;
+	size_t len = 0, count = 0, d;
+	unsigned char ret = STK_PLATFORM_FORMAT_ERROR;
+	char buf[STK_PATH_MAX_OS];
+
+	path = shadow_resolve(path, buf, sizeof(buf));
+
+	*out_deps = NULL;
+	*out_count = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return STK_PLATFORM_FORMAT_ERROR;
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return STK_PLATFORM_FORMAT_ERROR;
+	}
+
+	img = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (img == MAP_FAILED)
+		return STK_PLATFORM_FORMAT_ERROR;
+
+	table = elf_find_symbol((const unsigned char *)img, (size_t)st.st_size,
+				symbol, &len);
+	if (!table) {
+		/* no such symbol is a module without dependencies, unless
+		 * the file is not something we understand at all or its
+		 * descriptor points at a table under another name */
+		if (memcmp(img, ELFMAG, SELFMAG) == 0 &&
+		    (!descriptor ||
+		     !elf_find_symbol((const unsigned char *)img,
+				      (size_t)st.st_size, descriptor, &len)))
+			ret = STK_PLATFORM_OPERATION_SUCCESS;
+		goto done;
+	}
+
+	while ((count + 1) * sizeof(stk_dep_t) <= len &&
+	       ((const stk_dep_t *)table)[count].id[0] != '\0')
+		count++;
+
+	ret = STK_PLATFORM_OPERATION_SUCCESS;
+	if (count == 0)
+		goto done;
+
+	*out_deps = malloc(count * sizeof(stk_dep_t));
+	if (!*out_deps) {
+		ret = STK_PLATFORM_FORMAT_ERROR;
+		goto done;
+	}
+
+	memcpy(*out_deps, table, count * sizeof(stk_dep_t));
+	for (d = 0; d < count; d++) {
+		(*out_deps)[d].id[STK_MOD_ID_BUFFER - 1] = '\0';
+		(*out_deps)[d].version[STK_MOD_VERSION_BUFFER - 1] = '\0';
+	}
+	*out_count = count;
+
+done:
+	munmap(img, (size_t)st.st_size);
+	return ret;
+#else
+	(void)path;
+	(void)symbol;
+	(void)descriptor;
+	*out_deps = NULL;
+	*out_count = 0;
+	return STK_PLATFORM_FORMAT_ERROR;
+#endif
+}
+
+typedef struct {
+	char (*list)[STK_PATH_MAX];
+	size_t count;
+	size_t capacity;
+} scan_list_t;
+
+static void scan_add(scan_list_t *l, const char *rel)
+{
+	size_t new_capacity, len = strlen(rel);
+	char (*grown)[STK_PATH_MAX];
+
+	if (len >= STK_PATH_MAX)
+		len = STK_PATH_MAX - 1;
+
+	if (l->count == l->capacity) {
+		new_capacity = l->capacity ? l->capacity * 2 : 64;
+		grown = realloc(l->list, new_capacity * sizeof(*grown));
+		if (!grown)
+			return;
+		l->list = grown;
+		l->capacity = new_capacity;
+	}
 
-	    if (count == 0)
-		    goto exit;
+	memcpy(l->list[l->count], rel, len);
+	l->list[l->count++][len] = '\0';
+}
 
-	    list = malloc(count * sizeof(*list));
-	    if (!list)
-		    goto exit;
+#ifndef _WIN32
+#define SCAN_OTHER 0
+#define SCAN_FILE 1
+#define SCAN_DIR 2
+
+/* dir/name, or whichever of the two is not empty. Returns 0 if the
+ * result does not fit in size */
+static unsigned char scan_join(char *out, size_t size, const char *dir,
+			       const char *name)
+{
+	size_t dir_len = strlen(dir), name_len = strlen(name);
 
-	    h = FindFirstFileA(s, &fd);
-	    if (h == INVALID_HANDLE_VALUE)
-		    goto exit;
+	if (dir_len + name_len + 2 > size)
+		return 0;
 
-	    do {
-		    if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
-			    continue;
-		    if (is_valid_module_file(fd.cFileName) && i < count) {
-			    name_len = strlen(fd.cFileName);
-			    if (name_len >= STK_PATH_MAX)
-				    name_len = STK_PATH_MAX - 1;
-
-			    memcpy(list[i], fd.cFileName, name_len);
-			    list[i][name_len] = '\0';
-			    i++;
-		    }
-	    } while (FindNextFileA(h, &fd));
+	memcpy(out, dir, dir_len);
+	if (dir_len && name_len)
+		out[dir_len++] = STK_PATH_SEP;
+	memcpy(out + dir_len, name, name_len + 1);
+	return 1;
+}
 
-	    FindClose(h);
-	    goto exit;
+#ifdef __linux__
+/* the temp directory holds shadow copies, not modules */
+static unsigned char scan_skip_dir(const char *root, const char *rel)
+{
+	char path[STK_PATH_MAX_OS];
 
-    create_and_exit:
-	    platform_mkdir(dir_path);
-    exit:
-	    *out_count = i;
-	    return list;
-#else
-	    DIR *d;
-	    struct dirent *e;
-	    struct stat st;
-	    char f[STK_PATH_MAX_OS];
+	return scan_join(path, sizeof(path), root, rel) &&
+	       strcmp(path, stk_get_tmp_dir()) == 0;
+}
+#endif
 
-	    d = opendir(dir_path);
-	    if (!d)
-		    goto create_and_exit;
+/* what the entry e of the open directory d is, from d_type where the
+ * filesystem fills it in and fstatat() relative to the directory where
+ * it does not, or for symlinks, which count as what they point at */
+static int scan_kind(DIR *d, const struct dirent *e)
+{
+	struct stat st;
 
-    count_loop:
-	    e = readdir(d);
-	    if (!e)
-		    goto count_done;
+#ifdef DT_UNKNOWN
+	if (e->d_type == DT_REG)
+		return SCAN_FILE;
+	if (e->d_type == DT_DIR)
+		return SCAN_DIR;
+	if (e->d_type != DT_UNKNOWN && e->d_type != DT_LNK)
+		return SCAN_OTHER;
+#endif
 
-	    sprintf(f, "%s/%s", dir_path, e->d_name);
-	    if (!is_valid_module_file(e->d_name))
-		    goto count_loop;
+	if (fstatat(dirfd(d), e->d_name, &st, 0) != 0)
+		return SCAN_OTHER;
+	if (S_ISDIR(st.st_mode))
+		return SCAN_DIR;
+	return S_ISREG(st.st_mode) ? SCAN_FILE : SCAN_OTHER;
+}
 
-	    if (stat(f, &st) != 0 || !S_ISREG(st.st_mode))
-		    goto count_loop;
+/* collects the module files in the open directory d, which is rel under
+ * root, as paths relative to root. Subdirectories are opened relative to
+ * their parent and followed on Linux, where the watch follows them too;
+ * hidden ones and the temp directory are skipped */
+static void scan_tree(scan_list_t *l, const char *root, const char *rel,
+		      DIR *d)
+{
+	char child[STK_PATH_MAX];
+	struct dirent *e;
+	unsigned char is_module;
+	int kind;
+#ifdef __linux__
+	DIR *sub;
+	int fd;
+#endif
 
-	    count++;
-	    goto count_loop;
+	while ((e = readdir(d)) != NULL) {
+		is_module = is_valid_module_file(e->d_name);
+#ifndef __linux__
+		if (!is_module)
+			continue;
+#endif
+		if (e->d_name[0] == '.' && !is_module)
+			continue;
+		if (!scan_join(child, sizeof(child), rel, e->d_name))
+			continue;
 
-    count_done:
-	    if (count == 0)
-		    goto close_and_exit;
+		kind = scan_kind(d, e);
+		if (kind == SCAN_FILE && is_module)
+			scan_add(l, child);
 
-	    rewinddir(d);
-	    list = malloc(count * sizeof(*list));
-	    if (!list)
-		    goto close_and_exit;
+#ifdef __linux__
+		if (kind != SCAN_DIR || e->d_name[0] == '.' ||
+		    scan_skip_dir(root, child))
+			continue;
 
-    fill_loop:
-	    e = readdir(d);
-	    if (!e || i >= count)
-		    goto close_and_exit;
+		fd = openat(dirfd(d), e->d_name, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			continue;
+		sub = fdopendir(fd);
+		if (!sub) {
+			close(fd);
+			continue;
+		}
+		scan_tree(l, root, child, sub);
+		closedir(sub);
+#endif
+	}
+}
+#endif
 
-	    sprintf(f, "%s/%s", dir_path, e->d_name);
-	    if (!is_valid_module_file(e->d_name))
-		    goto fill_loop;
+/* Lists the module files under dir_path in one pass over each directory,
+ * creating dir_path if it does not exist */
+char (*platform_directory_init_scan(const char *dir_path, size_t *out_count))
+    [STK_PATH_MAX] {
+	    scan_list_t l;
+#ifdef _WIN32
+	    WIN32_FIND_DATAA fd;
+	    HANDLE h;
+	    char s[STK_PATH_MAX_OS];
+#else
+	    DIR *d;
+#endif
 
-	    if (stat(f, &st) != 0 || !S_ISREG(st.st_mode))
-		    goto fill_loop;
+	    l.list = NULL;
+	    l.count = 0;
+	    l.capacity = 0;
+	    *out_count = 0;
 
-	    name_len = strlen(e->d_name);
-	    if (name_len >= STK_PATH_MAX) {
-		    name_len = STK_PATH_MAX - 1;
+#ifdef _WIN32
+	    sprintf(s, "%s\\*", dir_path);
+	    h = FindFirstFileA(s, &fd);
+	    if (h == INVALID_HANDLE_VALUE) {
+		    platform_mkdir(dir_path);
+		    return NULL;
 	    }
-	    memcpy(list[i++], e->d_name, name_len);
-	    list[i - 1][name_len] = '\0';
-	    goto fill_loop;
 
-    create_and_exit:
-	    platform_mkdir(dir_path);
-	    *out_count = 0;
-	    return NULL;
+	    do {
+		    if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			is_valid_module_file(fd.cFileName))
+			    scan_add(&l, fd.cFileName);
+	    } while (FindNextFileA(h, &fd));
+
+	    FindClose(h);
+#else
+	    d = opendir(dir_path);
+	    if (!d) {
+		    platform_mkdir(dir_path);
+		    return NULL;
+	    }
 
-    close_and_exit:
+	    scan_tree(&l, dir_path, "", d);
 	    closedir(d);
-	    *out_count = i;
-	    return list;
 #endif
+
+	    if (l.count == 0) {
+		    free(l.list);
+		    return NULL;
+	    }
+	    *out_count = l.count;
+	    return l.list;
     }
 
 #if !defined(__linux__) && !defined(_WIN32)
-static void update_watches(platform_watch_context_t *ctx)
+static void update_watches(platform_watch_root_t *ctx)
 {
 	struct kevent ev;
 	DIR *d;
@@ -493,31 +1809,286 @@ cleanup:
 }
 #endif
 
-void *platform_directory_watch_start(const char *path)
-{
 #ifdef __linux__
-	int fd = inotify_init1(IN_NONBLOCK);
-	if (fd < 0)
+#define STK_WATCH_MASK                                                         \
+	(IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE)
+
+static unsigned long watch_hash(size_t root, const char *rel)
+{
+	return (stk_hash_id(rel) + (unsigned long)root) & 0xffffffffUL;
+}
+
+static unsigned char watch_reserve(platform_watch_context_t *ctx,
+				   size_t count)
+{
+	size_t new_capacity, i, slot, mask;
+	stk_module_event_t *new_evs;
+	char (*new_files)[STK_PATH_MAX];
+	size_t *new_set, *new_roots;
+
+	if (count > ctx->capacity) {
+		new_capacity = ctx->capacity ? ctx->capacity * 2 : 16;
+		while (new_capacity < count)
+			new_capacity *= 2;
+
+		new_evs = realloc(ctx->evs, new_capacity * sizeof(*new_evs));
+		if (!new_evs)
+			return 0;
+		ctx->evs = new_evs;
+
+		new_files =
+		    realloc(ctx->files, new_capacity * sizeof(*new_files));
+		if (!new_files)
+			return 0;
+		ctx->files = new_files;
+
+		new_roots = realloc(ctx->file_roots,
+				    new_capacity * sizeof(*new_roots));
+		if (!new_roots)
+			return 0;
+		ctx->file_roots = new_roots;
+		ctx->capacity = new_capacity;
+	}
+
+	if (count * 2 <= ctx->set_capacity)
+		return 1;
+
+	new_capacity = ctx->set_capacity ? ctx->set_capacity : 32;
+	while (new_capacity < count * 2)
+		new_capacity *= 2;
+
+	new_set = calloc(new_capacity, sizeof(size_t));
+	if (!new_set)
+		return 0;
+
+	free(ctx->set);
+	ctx->set = new_set;
+	ctx->set_capacity = new_capacity;
+	mask = new_capacity - 1;
+	for (i = 0; i < ctx->count; i++) {
+		slot = watch_hash(ctx->file_roots[i], ctx->files[i]) & mask;
+		while (ctx->set[slot])
+			slot = (slot + 1) & mask;
+		ctx->set[slot] = i + 1;
+	}
+
+	return 1;
+}
+
+/* the set slot holding root/rel, or the empty slot where it would go */
+static size_t watch_slot(const platform_watch_context_t *ctx, size_t root,
+			 const char *rel)
+{
+	size_t mask = ctx->set_capacity - 1;
+	size_t slot = watch_hash(root, rel) & mask;
+
+	while (ctx->set[slot] &&
+	       (ctx->file_roots[ctx->set[slot] - 1] != root ||
+		strcmp(ctx->files[ctx->set[slot] - 1], rel) != 0))
+		slot = (slot + 1) & mask;
+
+	return slot;
+}
+
+/* records an event for rel under root; a later event for the same file
+ * replaces the earlier one, so a delete followed by a rewrite becomes a
+ * load and a write followed by a delete becomes an unload */
+static void watch_push(platform_watch_context_t *ctx, size_t root,
+		       const char *rel, stk_module_event_t type)
+{
+	size_t slot, index;
+
+	if (!watch_reserve(ctx, ctx->count + 1))
+		return;
+
+	slot = watch_slot(ctx, root, rel);
+	if (ctx->set[slot]) {
+		ctx->evs[ctx->set[slot] - 1] = type;
+		return;
+	}
+
+	index = ctx->count++;
+	strncpy(ctx->files[index], rel, STK_PATH_MAX - 1);
+	ctx->files[index][STK_PATH_MAX - 1] = '\0';
+	ctx->file_roots[index] = root;
+	ctx->evs[index] = type;
+	ctx->set[slot] = index + 1;
+}
+
+static platform_watch_dir_t *watch_dir(platform_watch_context_t *ctx,
+				       int wd)
+{
+	if (wd < 0 || (size_t)wd >= ctx->by_wd_capacity || !ctx->by_wd[wd])
 		return NULL;
+	return &ctx->dirs[ctx->by_wd[wd] - 1];
+}
+
+static void watch_forget(platform_watch_context_t *ctx, int wd)
+{
+	platform_watch_dir_t *dir = watch_dir(ctx, wd);
+
+	if (!dir)
+		return;
+	dir->wd = -1;
+	ctx->by_wd[wd] = 0;
+}
+
+/* watches root/rel, or refreshes the entry if the kernel already had a
+ * watch on that directory. Returns 0 if it cannot be watched */
+static unsigned char watch_add_dir(platform_watch_context_t *ctx,
+				   size_t root, const char *rel,
+				   const char *path)
+{
+	platform_watch_dir_t *grown_dirs;
+	size_t *grown_wd, new_capacity, i;
+	int wd;
+
+	wd = inotify_add_watch(ctx->fd, path, STK_WATCH_MASK);
+	if (wd < 0)
+		return 0;
+
+	if ((size_t)wd >= ctx->by_wd_capacity) {
+		new_capacity = ctx->by_wd_capacity ? ctx->by_wd_capacity : 64;
+		while (new_capacity <= (size_t)wd)
+			new_capacity *= 2;
+		grown_wd = realloc(ctx->by_wd, new_capacity * sizeof(size_t));
+		if (!grown_wd)
+			return 0;
+		for (i = ctx->by_wd_capacity; i < new_capacity; i++)
+			grown_wd[i] = 0;
+		ctx->by_wd = grown_wd;
+		ctx->by_wd_capacity = new_capacity;
+	}
+
+	i = ctx->by_wd[wd];
+	if (i) {
+		i--;
+	} else {
+		for (i = 0; i < ctx->dir_count; i++)
+			if (ctx->dirs[i].wd < 0)
+				break;
+
+		if (i == ctx->dir_count) {
+			if (ctx->dir_count == ctx->dir_capacity) {
+				new_capacity = ctx->dir_capacity
+						   ? ctx->dir_capacity * 2
+						   : 16;
+				grown_dirs =
+				    realloc(ctx->dirs,
+					    new_capacity * sizeof(*grown_dirs));
+				if (!grown_dirs)
+					return 0;
+				ctx->dirs = grown_dirs;
+				ctx->dir_capacity = new_capacity;
+			}
+			ctx->dir_count++;
+		}
+		ctx->by_wd[wd] = i + 1;
+	}
+
+	ctx->dirs[i].wd = wd;
+	ctx->dirs[i].root = root;
+	strncpy(ctx->dirs[i].rel, rel, STK_PATH_MAX - 1);
+	ctx->dirs[i].rel[STK_PATH_MAX - 1] = '\0';
+	return 1;
+}
+
+/* watches a directory and everything below it. When the directory
+ * appeared while stk was watching, files may have landed in it before
+ * its watch existed, so those are reported as loads */
+static void watch_add_tree(platform_watch_context_t *ctx, size_t root,
+			   const char *rel, unsigned char report)
+{
+	char path[STK_PATH_MAX_OS], child[STK_PATH_MAX];
+	DIR *d;
+	struct dirent *e;
+	int kind;
+
+	if (!scan_join(path, sizeof(path), ctx->roots[root], rel) ||
+	    !watch_add_dir(ctx, root, rel, path))
+		return;
 
-	inotify_add_watch(
-	    fd, path, IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
-	return (void *)(long)fd;
+	d = opendir(path);
+	if (!d)
+		return;
+
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.' ||
+		    !scan_join(child, sizeof(child), rel, e->d_name))
+			continue;
+
+		kind = scan_kind(d, e);
+		if (kind == SCAN_DIR && !scan_skip_dir(ctx->roots[root], child))
+			watch_add_tree(ctx, root, child, report);
+		else if (kind == SCAN_FILE && report &&
+			 is_valid_module_file(e->d_name))
+			watch_push(ctx, root, child, STK_MOD_LOAD);
+	}
+
+	closedir(d);
+}
+
+/* a directory moved out of the tree takes its subdirectories' watches
+ * with it */
+static void watch_drop_tree(platform_watch_context_t *ctx, size_t root,
+			    const char *rel)
+{
+	size_t i, len = strlen(rel);
+
+	for (i = 0; i < ctx->dir_count; i++) {
+		if (ctx->dirs[i].wd < 0 || ctx->dirs[i].root != root ||
+		    strncmp(ctx->dirs[i].rel, rel, len) != 0 ||
+		    (ctx->dirs[i].rel[len] != '\0' &&
+		     ctx->dirs[i].rel[len] != STK_PATH_SEP))
+			continue;
+
+		inotify_rm_watch(ctx->fd, ctx->dirs[i].wd);
+		watch_forget(ctx, ctx->dirs[i].wd);
+	}
+}
+#endif
+
+#ifndef __linux__
+/* appends a snapshot entry, growing the array geometrically */
+static unsigned char watch_snap_add(platform_watch_root_t *ctx,
+				    size_t *capacity, const char *name)
+{
+	size_t new_capacity, len = strlen(name);
+	platform_snapshot_t *grown;
+
+	if (ctx->count == *capacity) {
+		new_capacity = *capacity ? *capacity * 2 : 16;
+		grown = realloc(ctx->snaps, new_capacity * sizeof(*grown));
+		if (!grown)
+			return 0;
+		ctx->snaps = grown;
+		*capacity = new_capacity;
+	}
+
+	if (len >= STK_PATH_MAX)
+		len = STK_PATH_MAX - 1;
+	memcpy(ctx->snaps[ctx->count].filename, name, len);
+	ctx->snaps[ctx->count].filename[len] = '\0';
+	return 1;
+}
+
+#ifdef _WIN32
+static platform_watch_root_t *watch_start_root(const char *path)
 #else
+static platform_watch_root_t *watch_start_root(const char *path, int kq)
+#endif
+{
 #ifdef _WIN32
 	WIN32_FIND_DATAA fd;
 	HANDLE h;
 	char s[STK_PATH_MAX_OS];
-	size_t count = 0, i = 0, name_len;
 #else
 	DIR *d;
 	struct dirent *e;
 	struct stat st;
-	char f[STK_PATH_MAX_OS];
-	size_t count = 0, i = 0;
 #endif
-	platform_watch_context_t *ctx =
-	    calloc(1, sizeof(platform_watch_context_t));
+	size_t capacity = 0;
+	platform_watch_root_t *ctx = calloc(1, sizeof(platform_watch_root_t));
 	if (!ctx)
 		return NULL;
 
@@ -532,268 +2103,334 @@ void *platform_directory_watch_start(const char *path)
 	if (ctx->watch.change_handle == INVALID_HANDLE_VALUE)
 		goto error_cleanup;
 
-	sprintf(s, "%s\\*", path);
-	h = FindFirstFileA(s, &fd);
-	if (h == INVALID_HANDLE_VALUE)
-		goto error_cleanup;
-
-	do {
-		if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
-		    is_valid_module_file(fd.cFileName))
-			count++;
-	} while (FindNextFileA(h, &fd));
-
-	FindClose(h);
-	if (count == 0)
-		goto done;
-
-	ctx->snaps = malloc(count * sizeof(platform_snapshot_t));
-	if (!ctx->snaps)
-		goto error_cleanup;
+	/* only used to sleep in platform_directory_watch_wait(); checks
+	 * still diff snapshots */
+	ctx->notify_handle = FindFirstChangeNotificationA(
+	    path, FALSE,
+	    FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
 
+	sprintf(s, "%s\\*", path);
 	h = FindFirstFileA(s, &fd);
 	if (h == INVALID_HANDLE_VALUE)
 		goto error_cleanup;
 
 	do {
-		if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
-		    is_valid_module_file(fd.cFileName) && i < count) {
-			name_len = strlen(fd.cFileName);
-			if (name_len >= STK_PATH_MAX)
-				name_len = STK_PATH_MAX - 1;
-			memcpy(ctx->snaps[i].filename, fd.cFileName, name_len);
-			ctx->snaps[i].filename[name_len] = '\0';
-			ctx->snaps[i].mtime = fd.ftLastWriteTime;
-			i++;
-		}
+		if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+		    !is_valid_module_file(fd.cFileName) ||
+		    !watch_snap_add(ctx, &capacity, fd.cFileName))
+			continue;
+		ctx->snaps[ctx->count++].mtime = fd.ftLastWriteTime;
 	} while (FindNextFileA(h, &fd));
 
 	FindClose(h);
-	ctx->count = i;
+	return ctx;
 
+error_cleanup:
+	if (ctx->watch.change_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(ctx->watch.change_handle);
+	if (ctx->notify_handle && ctx->notify_handle != INVALID_HANDLE_VALUE)
+		FindCloseChangeNotification(ctx->notify_handle);
+	free(ctx->snaps);
+	free(ctx);
+	return NULL;
 #else
-	ctx->watch.k.kq = kqueue();
+	ctx->watch.k.kq = kq;
 	ctx->watch.k.dir_fd = open(path, O_RDONLY);
 	d = opendir(path);
 	if (!d)
 		goto bsd_setup;
 
-bsd_count_loop:
-	e = readdir(d);
-	if (!e)
-		goto bsd_count_done;
-
-	sprintf(f, "%s/%s", path, e->d_name);
-	if (!is_valid_module_file(e->d_name))
-		goto bsd_count_loop;
-
-	if (stat(f, &st) != 0 || !S_ISREG(st.st_mode))
-		goto bsd_count_loop;
-
-	count++;
-	goto bsd_count_loop;
-
-bsd_count_done:
-	if (count == 0)
-		goto bsd_setup;
+	while ((e = readdir(d)) != NULL) {
+		if (!is_valid_module_file(e->d_name) ||
+		    fstatat(dirfd(d), e->d_name, &st, 0) != 0 ||
+		    !S_ISREG(st.st_mode) ||
+		    !watch_snap_add(ctx, &capacity, e->d_name))
+			continue;
+		ctx->snaps[ctx->count++].mtime = st.st_mtime;
+	}
 
-	ctx->snaps = malloc(count * sizeof(platform_snapshot_t));
-	if (!ctx->snaps)
-		goto bsd_setup;
+	closedir(d);
+bsd_setup:
+	update_watches(ctx);
+	return ctx;
+#endif
+}
 
-	rewinddir(d);
-bsd_scan_loop:
-	e = readdir(d);
-	if (!e || i >= count)
-		goto bsd_scan_done;
+static void watch_stop_root(platform_watch_root_t *ctx)
+{
+#ifndef _WIN32
+	size_t i;
+#endif
+	if (!ctx)
+		return;
+#ifdef _WIN32
+	CloseHandle(ctx->watch.change_handle);
+	if (ctx->notify_handle != INVALID_HANDLE_VALUE)
+		FindCloseChangeNotification(ctx->notify_handle);
+#else
+	for (i = 0; i < ctx->watch.k.file_fd_count; i++)
+		close(ctx->watch.k.file_fds[i]);
+	free(ctx->watch.k.file_fds);
+	close(ctx->watch.k.dir_fd);
+#endif
+	free(ctx->snaps);
+	free(ctx);
+}
+#endif
 
-	sprintf(f, "%s/%s", path, e->d_name);
-	if (!is_valid_module_file(e->d_name))
-		goto bsd_scan_loop;
+/* watches every root under one descriptor. Roots are numbered by their
+ * position, which is what platform_directory_watch_check() reports.
+ * Listing a root is part of watching it, so the module files found along
+ * the way are returned, relative to their root, as the startup scan; the
+ * watch already covers any change made after they were listed */
+void *platform_directory_watch_start(const char (*roots)[STK_PATH_MAX_OS],
+				     size_t root_count,
+				     char (**out_files)[STK_PATH_MAX],
+				     size_t **out_roots, size_t *out_count)
+{
+	size_t r;
+#ifndef __linux__
+	size_t i, total = 0;
+#endif
+	platform_watch_context_t *ctx =
+	    calloc(1, sizeof(platform_watch_context_t));
 
-	if (stat(f, &st) != 0 || !S_ISREG(st.st_mode))
-		goto bsd_scan_loop;
+	*out_files = NULL;
+	*out_roots = NULL;
+	*out_count = 0;
+	if (!ctx)
+		return NULL;
 
-	strncpy(ctx->snaps[i].filename, e->d_name, STK_PATH_MAX - 1);
-	ctx->snaps[i].mtime = st.st_mtime;
-	i++;
-	goto bsd_scan_loop;
+#ifdef __linux__
+	ctx->fd = inotify_init1(IN_NONBLOCK);
+	ctx->buf = malloc(STK_EVENT_BUFFER);
+	ctx->roots = malloc(root_count * sizeof(*ctx->roots));
+	if (ctx->fd < 0 || !ctx->buf || !ctx->roots) {
+		if (ctx->fd >= 0)
+			close(ctx->fd);
+		free(ctx->buf);
+		free(ctx->roots);
+		free(ctx);
+		return NULL;
+	}
 
-bsd_scan_done:
-	closedir(d);
-	ctx->count = i;
-bsd_setup:
-	update_watches(ctx);
+	ctx->buf_capacity = STK_EVENT_BUFFER;
+	memcpy(ctx->roots, roots, root_count * sizeof(*ctx->roots));
+	ctx->root_count = root_count;
+	for (r = 0; r < root_count; r++)
+		watch_add_tree(ctx, r, "", 1);
+
+	if (ctx->count > 0) {
+		*out_files = ctx->files;
+		*out_roots = ctx->file_roots;
+		*out_count = ctx->count;
+		free(ctx->evs);
+		ctx->evs = NULL;
+		ctx->files = NULL;
+		ctx->file_roots = NULL;
+		ctx->count = 0;
+		ctx->capacity = 0;
+	}
+	return ctx;
+#else
+#ifndef _WIN32
+	ctx->kq = kqueue();
+	if (ctx->kq < 0) {
+		free(ctx);
+		return NULL;
+	}
 #endif
+	ctx->roots = calloc(root_count, sizeof(*ctx->roots));
+	if (!ctx->roots)
+		goto fail;
 
+	for (r = 0; r < root_count; r++) {
 #ifdef _WIN32
-done:
+		ctx->roots[r] = watch_start_root(roots[r]);
+#else
+		ctx->roots[r] = watch_start_root(roots[r], ctx->kq);
 #endif
-	return ctx;
+		if (!ctx->roots[r])
+			goto fail;
+		ctx->root_count++;
+		total += ctx->roots[r]->count;
+	}
 
-#ifdef _WIN32
-error_cleanup:
-	if (ctx) {
-		if (ctx->watch.change_handle != INVALID_HANDLE_VALUE)
-			CloseHandle(ctx->watch.change_handle);
-		free(ctx->snaps);
-		free(ctx);
+	if (total == 0)
+		return ctx;
+
+	*out_files = malloc(total * sizeof(**out_files));
+	*out_roots = malloc(total * sizeof(**out_roots));
+	if (!*out_files || !*out_roots) {
+		free(*out_files);
+		free(*out_roots);
+		*out_files = NULL;
+		*out_roots = NULL;
+		return ctx;
+	}
+
+	for (r = 0; r < ctx->root_count; r++) {
+		for (i = 0; i < ctx->roots[r]->count; i++) {
+			memcpy((*out_files)[*out_count],
+			       ctx->roots[r]->snaps[i].filename, STK_PATH_MAX);
+			(*out_roots)[(*out_count)++] = r;
+		}
 	}
+	return ctx;
+
+fail:
+	platform_directory_watch_stop(ctx);
 	return NULL;
 #endif
-#endif
 }
 
 void platform_directory_watch_stop(void *handle)
 {
-#if defined(__linux__)
-	if (handle)
-		close((int)(long)handle);
-#else
-#ifndef _WIN32
-	size_t i;
-#endif
 	platform_watch_context_t *ctx = (platform_watch_context_t *)handle;
+#ifndef __linux__
+	size_t r;
+#endif
 	if (!ctx)
 		return;
-#ifdef _WIN32
-	CloseHandle(ctx->watch.change_handle);
+#if defined(__linux__)
+	close(ctx->fd);
+	free(ctx->buf);
+	free(ctx->evs);
+	free(ctx->files);
+	free(ctx->file_roots);
+	free(ctx->set);
+	free(ctx->dirs);
+	free(ctx->by_wd);
+	free(ctx->roots);
 #else
-	for (i = 0; i < ctx->watch.k.file_fd_count; i++)
-		close(ctx->watch.k.file_fds[i]);
-	free(ctx->watch.k.file_fds);
-	close(ctx->watch.k.kq);
-	close(ctx->watch.k.dir_fd);
+	for (r = 0; r < ctx->root_count; r++)
+		watch_stop_root(ctx->roots[r]);
+	free(ctx->roots);
+#ifndef _WIN32
+	close(ctx->kq);
 #endif
-	free(ctx->snaps);
-	free(ctx);
 #endif
+	free(ctx);
 }
 
-stk_module_event_t *platform_directory_watch_check(
-    void *handle, char (**file_list)[STK_PATH_MAX], size_t *out_count,
-    char (*loaded_ids)[STK_MOD_ID_BUFFER], const size_t loaded_count)
+/* the descriptor that becomes readable when the watch has something to
+ * report: the inotify fd on Linux, the kqueue on BSD and macOS. Windows
+ * has none and returns -1 */
+int platform_directory_watch_fd(void *handle)
 {
 #if defined(__linux__)
-	int fd = (int)(long)handle;
-	char buf[STK_EVENT_BUFFER];
-	ssize_t len;
-	size_t index = 0, count = 0, i, write_index;
-	stk_module_event_t *evs;
-	char *ptr, *end;
-	struct inotify_event *e;
-	int event_type;
-
-	len = read(fd, buf, sizeof(buf));
-	if (len <= 0) {
-		*out_count = 0;
-		return NULL;
-	}
+	return handle ? ((platform_watch_context_t *)handle)->fd : -1;
+#elif defined(_WIN32)
+	(void)handle;
+	return -1;
+#else
+	return handle ? ((platform_watch_context_t *)handle)->kq : -1;
+#endif
+}
 
-	ptr = buf;
-	end = buf + len;
-	while (ptr < end) {
-		e = (struct inotify_event *)ptr;
-		if (e->len && is_valid_module_file(e->name))
-			count++;
-		ptr += sizeof(struct inotify_event) + e->len;
-	}
+/* blocks for up to timeout_ms (forever if negative) until the watch has
+ * something to report or wake, when given, is signalled. Returns 0 on
+ * timeout */
+unsigned char platform_directory_watch_wait(void *handle, void *wake,
+					    int timeout_ms)
+{
+#ifdef _WIN32
+	platform_watch_context_t *ctx = (platform_watch_context_t *)handle;
+	HANDLE h[STK_MOD_ROOTS_MAX + 1];
+	DWORD n = 0, r;
+	size_t i;
 
-	if (count == 0) {
-		*out_count = 0;
-		return NULL;
+	for (i = 0; ctx && i < ctx->root_count; i++)
+		if (ctx->roots[i]->notify_handle != INVALID_HANDLE_VALUE)
+			h[n++] = ctx->roots[i]->notify_handle;
+	if (wake)
+		h[n++] = ((platform_notify_t *)wake)->event;
+	if (n == 0) {
+		Sleep(timeout_ms < 0 ? 100 : (DWORD)timeout_ms);
+		return 1;
 	}
 
-	evs = malloc(count * sizeof(stk_module_event_t));
-	if (!evs) {
-		*out_count = 0;
-		return NULL;
-	}
+	r = WaitForMultipleObjects(n, h, FALSE,
+				   timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms);
+	if (r >= WAIT_OBJECT_0 + n)
+		return 0;
 
-	*file_list = malloc(count * sizeof(**file_list));
-	if (!*file_list) {
-		free(evs);
-		*out_count = 0;
-		return NULL;
+	if (!wake || h[r - WAIT_OBJECT_0] != ((platform_notify_t *)wake)->event)
+		FindNextChangeNotification(h[r - WAIT_OBJECT_0]);
+	return 1;
+#else
+	struct pollfd p[2];
+	nfds_t n = 0;
+
+	p[n].fd = platform_directory_watch_fd(handle);
+	if (p[n].fd >= 0)
+		n++;
+	if (wake) {
+		p[n].fd = ((platform_notify_t *)wake)->fds[0];
+		n++;
 	}
+	if (n == 0)
+		return 0;
 
-	ptr = buf;
-	while (ptr < end && index < count) {
-		e = (struct inotify_event *)ptr;
-		if (e->len && is_valid_module_file(e->name)) {
-			if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
-				char *ptr2 =
-				    ptr + sizeof(struct inotify_event) + e->len;
-				int has_create = 0;
-
-				while (ptr2 < end) {
-					struct inotify_event *e2 =
-					    (struct inotify_event *)ptr2;
-					if (e2->len &&
-					    strcmp(e->name, e2->name) == 0 &&
-					    (e2->mask &
-					     (IN_CLOSE_WRITE | IN_MOVED_TO))) {
-						has_create = 1;
-						break;
-					}
-					ptr2 += sizeof(struct inotify_event) +
-						e2->len;
-				}
-
-				if (has_create) {
-					ptr += sizeof(struct inotify_event) +
-					       e->len;
-					continue;
-				}
-			}
-
-			strncpy((*file_list)[index], e->name, STK_PATH_MAX - 1);
+	p[0].events = p[1].events = POLLIN;
+	p[0].revents = p[1].revents = 0;
+	return poll(p, n, timeout_ms) > 0;
+#endif
+}
 
-			event_type = STK_MOD_UNLOAD;
-			if (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
-				char event_module_name[STK_MOD_ID_BUFFER];
-				extract_module_id(e->name, event_module_name);
+/* size and modification time of path, for the settle window's stability
+ * check. Returns 0 if the file does not exist */
+unsigned char platform_file_state(const char *path, unsigned long *size,
+				  unsigned long *mtime)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
 
-				if (is_mod_loaded(event_module_name) >= 0)
-					event_type = STK_MOD_RELOAD;
-				else
-					event_type = STK_MOD_LOAD;
-			}
+	if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+		return 0;
 
-			evs[index++] = event_type;
-		}
+	*size = (unsigned long)data.nFileSizeLow;
+	*mtime = (unsigned long)data.ftLastWriteTime.dwLowDateTime;
+	return 1;
+#else
+	struct stat st;
 
-		ptr += sizeof(struct inotify_event) + e->len;
-	}
+	if (stat(path, &st) != 0)
+		return 0;
 
-	for (i = 0; i < index; ++i) {
-		size_t j;
-		for (j = i + 1; j < index; ++j) {
-			if (strcmp((*file_list)[i], (*file_list)[j]) == 0) {
-				evs[i] = -1;
-				break;
-			}
-		}
-	}
+	*size = (unsigned long)st.st_size;
+#if defined(__linux__)
+	*mtime = (unsigned long)st.st_mtim.tv_sec * 1000000000UL +
+		 (unsigned long)st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+	*mtime = (unsigned long)st.st_mtimespec.tv_sec * 1000000000UL +
+		 (unsigned long)st.st_mtimespec.tv_nsec;
+#else
+	*mtime = (unsigned long)st.st_mtime;
+#endif
+	return 1;
+#endif
+}
 
-	write_index = 0;
-	for (i = 0; i < index; ++i) {
-		if (evs[i] != -1) {
-			if (write_index != i) {
-				evs[write_index] = evs[i];
-				memmove((*file_list)[write_index],
-					(*file_list)[i], STK_PATH_MAX);
-			}
-			write_index++;
-		}
-	}
-	index = write_index;
+unsigned long platform_time_ms(void)
+{
+#ifdef _WIN32
+	return (unsigned long)GetTickCount();
+#else
+	struct timespec ts;
 
-	*out_count = index;
-	return evs;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000UL +
+	       (unsigned long)(ts.tv_nsec / 1000000L);
+#endif
+}
 
-#else
-	platform_watch_context_t *ctx = (platform_watch_context_t *)handle;
+#ifndef __linux__
+/* diffs one root against its last snapshot */
+static stk_module_event_t *watch_check_root(platform_watch_root_t *ctx,
+					    char (**file_list)[STK_PATH_MAX],
+					    size_t *out_count)
+{
 	platform_snapshot_t *new_snaps = NULL;
 	size_t new_count = 0, i, j, ev_index = 0, name_len;
 	stk_module_event_t *evs = NULL;
@@ -847,17 +2484,12 @@ stk_module_event_t *platform_directory_watch_check(
 
 	FindClose(h);
 #else
-	struct kevent kev;
-	struct timespec ts = {0, 0};
 	DIR *d;
 	struct dirent *e;
 	struct stat st;
 	char f[STK_PATH_MAX_OS];
 	size_t count = 0;
 
-	if (kevent(ctx->watch.k.kq, NULL, 0, &kev, 1, &ts) <= 0)
-		goto no_change;
-
 	d = opendir(ctx->path);
 	if (!d)
 		goto bsd_update;
@@ -1019,11 +2651,373 @@ cleanup_error:
 cleanup_empty:
 	free(new_snaps);
 
+	*out_count = 0;
+	return NULL;
+}
+#endif
+
+/* returns the events since the last check with each file's path
+ * relative to its root in file_list and the root's index in root_list.
+ * rescan is set when events were lost, after which the caller has to
+ * compare the roots against what it knows */
+stk_module_event_t *platform_directory_watch_check(
+    void *handle, char (**file_list)[STK_PATH_MAX], size_t **root_list,
+    size_t *out_count, unsigned char *rescan)
+{
+#if defined(__linux__)
+	platform_watch_context_t *ctx = (platform_watch_context_t *)handle;
+	platform_watch_dir_t *dir;
+	ssize_t len;
+	char *ptr, *end, *grown;
+	char rel[STK_PATH_MAX];
+	struct inotify_event *e;
+	size_t root, r;
+	stk_module_event_t *evs;
+
+	*out_count = 0;
+	*rescan = 0;
+	ctx->count = 0;
+	ctx->rescan = 0;
+	if (ctx->set)
+		memset(ctx->set, 0, ctx->set_capacity * sizeof(size_t));
+
+	/* inotify only returns whole events, so each read is parsed on its
+	 * own. A full buffer is doubled for the next read, and a read that
+	 * cannot fit even one event fails with EINVAL */
+	for (;;) {
+		len = read(ctx->fd, ctx->buf, ctx->buf_capacity);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EINVAL) {
+			grown = realloc(ctx->buf, ctx->buf_capacity * 2);
+			if (!grown)
+				break;
+			ctx->buf = grown;
+			ctx->buf_capacity *= 2;
+			continue;
+		}
+		if (len <= 0)
+			break;
+
+		ptr = ctx->buf;
+		end = ctx->buf + len;
+		while (ptr < end) {
+			e = (struct inotify_event *)ptr;
+			ptr += sizeof(struct inotify_event) + e->len;
+
+			if (e->mask & IN_Q_OVERFLOW) {
+				ctx->rescan = 1;
+				continue;
+			}
+			if (e->mask & IN_IGNORED) {
+				watch_forget(ctx, e->wd);
+				continue;
+			}
+
+			/* watch_add_tree() may move the directory table, so
+			 * the entry is copied out first */
+			dir = watch_dir(ctx, e->wd);
+			if (!dir || !e->len ||
+			    !scan_join(rel, sizeof(rel), dir->rel, e->name))
+				continue;
+			root = dir->root;
+
+			if (e->mask & IN_ISDIR) {
+				if (e->name[0] == '.' ||
+				    scan_skip_dir(ctx->roots[root], rel))
+					continue;
+				if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+					watch_add_tree(ctx, root, rel, 1);
+				} else if (e->mask & IN_MOVED_FROM) {
+					/* the modules under it are gone
+					 * without an event for each */
+					watch_drop_tree(ctx, root, rel);
+					ctx->rescan = 1;
+				}
+				continue;
+			}
+
+			if (!is_valid_module_file(e->name))
+				continue;
+
+			watch_push(ctx, root, rel,
+				   (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+				       ? STK_MOD_LOAD
+				       : STK_MOD_UNLOAD);
+		}
+
+		if ((size_t)len == ctx->buf_capacity) {
+			grown = realloc(ctx->buf, ctx->buf_capacity * 2);
+			if (grown) {
+				ctx->buf = grown;
+				ctx->buf_capacity *= 2;
+			}
+		}
+	}
+
+	/* directories created while the queue was full have no watch yet */
+	if (ctx->rescan)
+		for (r = 0; r < ctx->root_count; r++)
+			watch_add_tree(ctx, r, "", 0);
+	*rescan = ctx->rescan;
+
+	if (ctx->count == 0)
+		return NULL;
+
+	evs = ctx->evs;
+	*file_list = ctx->files;
+	*root_list = ctx->file_roots;
+	*out_count = ctx->count;
+	ctx->evs = NULL;
+	ctx->files = NULL;
+	ctx->file_roots = NULL;
+	ctx->count = 0;
+	ctx->capacity = 0;
+	return evs;
+
+#else
+	platform_watch_context_t *ctx = (platform_watch_context_t *)handle;
+	stk_module_event_t *evs = NULL, *root_evs, *grown_evs;
+	char (*files)[STK_PATH_MAX] = NULL;
+	char (*root_files)[STK_PATH_MAX], (*grown_files)[STK_PATH_MAX];
+	size_t *roots = NULL, *grown_roots;
+	size_t count = 0, root_count, r, i;
 #ifndef _WIN32
-no_change:
+	struct kevent kev[16];
+	struct timespec ts = {0, 0};
+	int n;
 #endif
+
 	*out_count = 0;
-	return NULL;
+	*rescan = 0;
+
+#ifndef _WIN32
+	/* the roots share one queue, so any event means every root is
+	 * diffed; the queue is emptied so the next check starts clean */
+	n = kevent(ctx->kq, NULL, 0, kev, 16, &ts);
+	if (n <= 0)
+		return NULL;
+	while (n == 16)
+		n = kevent(ctx->kq, NULL, 0, kev, 16, &ts);
+#endif
+
+	for (r = 0; r < ctx->root_count; r++) {
+		root_evs =
+		    watch_check_root(ctx->roots[r], &root_files, &root_count);
+		if (!root_evs)
+			continue;
+
+		grown_evs = realloc(evs, (count + root_count) * sizeof(*evs));
+		if (grown_evs)
+			evs = grown_evs;
+		grown_files =
+		    realloc(files, (count + root_count) * sizeof(*files));
+		if (grown_files)
+			files = grown_files;
+		grown_roots =
+		    realloc(roots, (count + root_count) * sizeof(*roots));
+		if (grown_roots)
+			roots = grown_roots;
+
+		if (grown_evs && grown_files && grown_roots) {
+			for (i = 0; i < root_count; i++) {
+				evs[count + i] = root_evs[i];
+				memcpy(files[count + i], root_files[i],
+				       STK_PATH_MAX);
+				roots[count + i] = r;
+			}
+			count += root_count;
+		}
+
+		free(root_evs);
+		free(root_files);
+	}
+
+	if (count == 0) {
+		free(evs);
+		free(files);
+		free(roots);
+		return NULL;
+	}
+
+	*file_list = files;
+	*root_list = roots;
+	*out_count = count;
+	return evs;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI platform_thread_entry(LPVOID arg)
+#else
+static void *platform_thread_entry(void *arg)
+#endif
+{
+	platform_thread_t *t = (platform_thread_t *)arg;
+
+	t->fn(t->arg);
+	return 0;
+}
+
+void *platform_thread_start(void (*fn)(void *), void *arg)
+{
+	platform_thread_t *t = malloc(sizeof(platform_thread_t));
+	if (!t)
+		return NULL;
+
+	t->fn = fn;
+	t->arg = arg;
+#ifdef _WIN32
+	t->thread = CreateThread(NULL, 0, platform_thread_entry, t, 0, NULL);
+	if (!t->thread) {
+#else
+	if (pthread_create(&t->thread, NULL, platform_thread_entry, t) != 0) {
+#endif
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+void platform_thread_join(void *handle)
+{
+	platform_thread_t *t = (platform_thread_t *)handle;
+	if (!t)
+		return;
+#ifdef _WIN32
+	WaitForSingleObject(t->thread, INFINITE);
+	CloseHandle(t->thread);
+#else
+	pthread_join(t->thread, NULL);
+#endif
+	free(t);
+}
+
+void *platform_notify_create(void)
+{
+	platform_notify_t *n = malloc(sizeof(platform_notify_t));
+	if (!n)
+		return NULL;
+#ifdef _WIN32
+	n->event = CreateEventA(NULL, TRUE, FALSE, NULL);
+	if (!n->event) {
+		free(n);
+		return NULL;
+	}
+#else
+	if (pipe(n->fds) != 0) {
+		free(n);
+		return NULL;
+	}
+	fcntl(n->fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(n->fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(n->fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(n->fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+	return n;
+}
+
+void platform_notify_destroy(void *handle)
+{
+	platform_notify_t *n = (platform_notify_t *)handle;
+	if (!n)
+		return;
+#ifdef _WIN32
+	CloseHandle(n->event);
+#else
+	close(n->fds[0]);
+	close(n->fds[1]);
+#endif
+	free(n);
+}
+
+/* a full pipe already reads as signalled, so a failed write is fine */
+void platform_notify_signal(void *handle)
+{
+	platform_notify_t *n = (platform_notify_t *)handle;
+#ifdef _WIN32
+	SetEvent(n->event);
+#else
+	char c = 0;
+	ssize_t r = write(n->fds[1], &c, 1);
+	(void)r;
+#endif
+}
+
+void platform_notify_clear(void *handle)
+{
+	platform_notify_t *n = (platform_notify_t *)handle;
+#ifdef _WIN32
+	ResetEvent(n->event);
+#else
+	char buf[64];
+
+	while (read(n->fds[0], buf, sizeof(buf)) > 0)
+		;
+#endif
+}
+
+int platform_notify_fd(void *handle)
+{
+#ifdef _WIN32
+	(void)handle;
+	return -1;
+#else
+	return handle ? ((platform_notify_t *)handle)->fds[0] : -1;
+#endif
+}
+
+/* blocks for up to timeout_ms (forever if negative) until handle is
+ * signalled. Returns 0 on timeout */
+unsigned char platform_notify_wait(void *handle, int timeout_ms)
+{
+	return platform_directory_watch_wait(NULL, handle, timeout_ms);
+}
+
+/* acquire load and release store of an index shared between exactly two
+ * threads, enough to hand ring slots from a producer to a consumer */
+size_t platform_atomic_load(const volatile size_t *p)
+{
+#if defined(__GNUC__)
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#elif defined(_WIN32)
+	size_t v = *p;
+	MemoryBarrier();
+	return v;
+#else
+	size_t v = *p;
+	__sync_synchronize();
+	return v;
+#endif
+}
+
+void platform_atomic_store(volatile size_t *p, size_t value)
+{
+#if defined(__GNUC__)
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+#elif defined(_WIN32)
+	MemoryBarrier();
+	*p = value;
+#else
+	__sync_synchronize();
+	*p = value;
+#endif
+}
+
+/* adds value to *p and returns what it held before, between any number
+ * of threads */
+size_t platform_atomic_add(volatile size_t *p, size_t value)
+{
+#if defined(__GNUC__)
+	return __atomic_fetch_add(p, value, __ATOMIC_ACQ_REL);
+#elif defined(_WIN64)
+	return (size_t)InterlockedExchangeAdd64((volatile LONG64 *)p,
+						(LONG64)value);
+#elif defined(_WIN32)
+	return (size_t)InterlockedExchangeAdd((volatile LONG *)p, (LONG)value);
+#else
+	return __sync_fetch_and_add(p, value);
 #endif
 }
 
@@ -1037,14 +3031,18 @@ void platform_get_timestamp(char *buffer, size_t size)
 		st.wMilliseconds);
 #else
 	struct timeval tv;
-	struct tm *tm_info;
+	struct tm tm_info;
+	time_t now;
 
+	/* stk_log() runs on preload and init threads too, so not
+	 * localtime() and its shared result */
 	gettimeofday(&tv, NULL);
-	tm_info = localtime(&tv.tv_sec);
+	now = tv.tv_sec;
+	localtime_r(&now, &tm_info);
 
 	sprintf(buffer, "%04d-%02d-%02d %02d:%02d:%02d.%03d",
-		tm_info->tm_year + 1900, tm_info->tm_mon + 1, tm_info->tm_mday,
-		tm_info->tm_hour, tm_info->tm_min, tm_info->tm_sec,
+		tm_info.tm_year + 1900, tm_info.tm_mon + 1, tm_info.tm_mday,
+		tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec,
 		(int)(tv.tv_usec / 1000));
 #endif
 }
@@ -0,0 +1,193 @@
+#include "platform.h"
+#include "stk.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Preload: the part of stk_init() that does not touch the registry.
+ * Copying a module into the temp directory and opening it (loading,
+ * relocation, symbol lookups, metadata) can run on a pool of threads that
+ * take files off a shared counter; the calling thread works alongside
+ * them and, once all are done, registers the opened modules in file
+ * order, so slots, logging and the topological activation that follows
+ * are the same as for a serial preload. The same pool runs the
+ * thread-safe inits of a dependency level. */
+
+#define STK_POOL_THREADS_MAX 64
+
+typedef struct {
+	unsigned long *digest;
+	void *opened;
+	unsigned char copy_result;
+	unsigned char load_result;
+} stk_preload_job_t;
+
+typedef struct {
+	char (*files)[STK_PATH_MAX];
+	const char *tmp_dir;
+	stk_preload_job_t *jobs;
+	size_t count;
+} stk_preload_t;
+
+typedef struct {
+	void (*fn)(void *arg, size_t i);
+	void *arg;
+	size_t count;
+	volatile size_t next;
+} stk_pool_t;
+
+unsigned char platform_copy_file(const char *from, const char *to,
+				 unsigned long *digest);
+void *platform_thread_start(void (*fn)(void *), void *arg);
+void platform_thread_join(void *handle);
+size_t platform_atomic_add(volatile size_t *p, size_t value);
+
+unsigned long *stk_shadow_digest(const char *name);
+unsigned char stk_index_path(const char *name, char *out_path);
+void *stk_module_open(const char *path, unsigned char *out_result);
+void stk_module_close(void *opened);
+
+/* copies the module file name into tmp_dir and opens the copy. Returns
+ * the opened module for stk_module_register(), or NULL with the failing
+ * step's code in *out_copy or *out_load */
+void *stk_preload_open(const char *name, const char *tmp_dir,
+		       unsigned long *digest, unsigned char *out_copy,
+		       unsigned char *out_load)
+{
+	char full_path[STK_PATH_MAX_OS];
+	char tmp_path[STK_PATH_MAX_OS];
+
+	*out_copy = STK_PLATFORM_FILE_COPY_ERROR;
+	*out_load = STK_MOD_LIBRARY_LOAD_ERROR;
+	if (!stk_index_path(name, full_path))
+		return NULL;
+
+	tmp_path[0] = '\0';
+	strncat(tmp_path, tmp_dir, sizeof(tmp_path) - 1);
+	strncat(tmp_path, STK_PATH_SEP_STR,
+		sizeof(tmp_path) - strlen(tmp_path) - 1);
+	strncat(tmp_path, name, sizeof(tmp_path) - strlen(tmp_path) - 1);
+
+	*out_copy = platform_copy_file(full_path, tmp_path, digest);
+	if (*out_copy != STK_PLATFORM_OPERATION_SUCCESS &&
+	    *out_copy != STK_PLATFORM_FILE_UNCHANGED &&
+	    *out_copy != STK_PLATFORM_IMAGE_UNCHANGED)
+		return NULL;
+
+	return stk_module_open(tmp_path, out_load);
+}
+
+static void stk_pool_worker(void *arg)
+{
+	stk_pool_t *pool = (stk_pool_t *)arg;
+	size_t i;
+
+	while ((i = platform_atomic_add(&pool->next, 1)) < pool->count)
+		pool->fn(pool->arg, i);
+}
+
+/* calls fn(arg, i) for every i below count on up to threads threads, the
+ * calling one included, and returns once all calls have. A thread that
+ * fails to start just leaves more for the others */
+void stk_parallel_run(size_t count, size_t threads,
+		      void (*fn)(void *arg, size_t i), void *arg)
+{
+	void *handles[STK_POOL_THREADS_MAX];
+	stk_pool_t pool;
+	size_t i, started;
+
+	if (threads > count)
+		threads = count;
+	if (threads > STK_POOL_THREADS_MAX)
+		threads = STK_POOL_THREADS_MAX;
+
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.count = count;
+	pool.next = 0;
+
+	for (started = 0; started + 1 < threads; started++) {
+		handles[started] = platform_thread_start(stk_pool_worker, &pool);
+		if (!handles[started])
+			break;
+	}
+
+	stk_pool_worker(&pool);
+
+	for (i = 0; i < started; i++)
+		platform_thread_join(handles[i]);
+}
+
+static void stk_preload_worker(void *arg, size_t i)
+{
+	stk_preload_t *p = (stk_preload_t *)arg;
+	stk_preload_job_t *job = &p->jobs[i];
+
+	job->opened = stk_preload_open(p->files[i], p->tmp_dir, job->digest,
+				       &job->copy_result, &job->load_result);
+}
+
+/* preloads files on threads threads, the calling one included, and
+ * returns once every file is done. NULL when there is nothing to gain
+ * from a pool or no memory for one, in which case the caller preloads
+ * serially */
+void *stk_preload_run(char (*files)[STK_PATH_MAX], size_t count,
+		      const char *tmp_dir, size_t threads)
+{
+	stk_preload_t *p;
+	size_t i;
+
+	if (threads < 2 || count < 2)
+		return NULL;
+
+	p = malloc(sizeof(*p));
+	if (!p)
+		return NULL;
+	p->jobs = malloc(count * sizeof(stk_preload_job_t));
+	if (!p->jobs) {
+		free(p);
+		return NULL;
+	}
+
+	/* interning a digest can move the others, so every file gets its
+	 * entry before any pointer is taken */
+	for (i = 0; i < count; i++)
+		stk_shadow_digest(files[i]);
+	for (i = 0; i < count; i++) {
+		p->jobs[i].digest = stk_shadow_digest(files[i]);
+		p->jobs[i].opened = NULL;
+	}
+
+	p->files = files;
+	p->tmp_dir = tmp_dir;
+	p->count = count;
+
+	stk_parallel_run(count, threads, stk_preload_worker, p);
+	return p;
+}
+
+/* hands over what the pool did for file i: the opened module, NULL if a
+ * step failed */
+void *stk_preload_take(void *batch, size_t i, unsigned char *out_copy,
+		       unsigned char *out_load)
+{
+	stk_preload_job_t *job = &((stk_preload_t *)batch)->jobs[i];
+	void *opened = job->opened;
+
+	job->opened = NULL;
+	*out_copy = job->copy_result;
+	*out_load = job->load_result;
+	return opened;
+}
+
+void stk_preload_free(void *batch)
+{
+	stk_preload_t *p = (stk_preload_t *)batch;
+	size_t i;
+
+	if (!p)
+		return;
+	for (i = 0; i < p->count; i++)
+		stk_module_close(p->jobs[i].opened);
+	free(p->jobs);
+	free(p);
+}
@@ -0,0 +1,438 @@
+#include "platform.h"
+#include "stk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Settle window: watch events are held per file until the file has been
+ * quiet for stk_settle_ms and its size and mtime have not moved over that
+ * window. Deadlines live on a hierarchical timer wheel with millisecond
+ * ticks, four levels of 64 slots covering about 4.6 hours. */
+
+#define STK_WHEEL_BITS 6
+#define STK_WHEEL_SIZE (1UL << STK_WHEEL_BITS)
+#define STK_WHEEL_MASK (STK_WHEEL_SIZE - 1)
+#define STK_WHEEL_LEVELS 4
+#define STK_WHEEL_SPAN (1UL << (STK_WHEEL_BITS * STK_WHEEL_LEVELS))
+#define STK_WHEEL_READY (STK_WHEEL_LEVELS * STK_WHEEL_SIZE)
+#define STK_SETTLE_NONE ((size_t)-1)
+#define STK_SETTLE_DEFAULT_MS 50
+
+typedef enum {
+	STK_SETTLE_IDLE,
+	STK_SETTLE_ARMED,
+	STK_SETTLE_EXPIRED
+} stk_settle_state_t;
+
+typedef struct {
+	unsigned long hash;
+	unsigned long deadline;
+	unsigned long size;
+	unsigned long mtime;
+	unsigned char exists;
+	/* digest of the file's shadow copy, all zero until the first copy */
+	unsigned long digest[STK_DIGEST_LANES];
+	stk_settle_state_t state;
+	stk_module_event_t type;
+	size_t bucket;
+	size_t prev;
+	size_t next;
+	char name[STK_PATH_MAX];
+} stk_settle_t;
+
+extern stk_stats_t *stk_watch_stats;
+
+unsigned long stk_hash_id(const char *id);
+unsigned char platform_file_state(const char *path, unsigned long *size,
+				  unsigned long *mtime);
+unsigned char stk_index_path(const char *name, char *out_path);
+
+static unsigned long stk_settle_ms = STK_SETTLE_DEFAULT_MS;
+
+static stk_settle_t *stk_settle = NULL;
+static size_t stk_settle_count = 0;
+static size_t stk_settle_capacity = 0;
+static size_t *stk_settle_table = NULL;
+static size_t stk_settle_table_capacity = 0;
+static size_t stk_settle_armed = 0;
+
+/* one list head per wheel slot, plus the ready list at STK_WHEEL_READY */
+static size_t stk_wheel[STK_WHEEL_READY + 1];
+static unsigned long stk_wheel_now = 0;
+static unsigned char stk_wheel_started = 0;
+
+static void stk_settle_put(size_t e)
+{
+	size_t mask = stk_settle_table_capacity - 1;
+	size_t slot = stk_settle[e].hash & mask;
+
+	while (stk_settle_table[slot] != STK_SETTLE_NONE)
+		slot = (slot + 1) & mask;
+	stk_settle_table[slot] = e;
+}
+
+static unsigned char stk_settle_reserve(size_t count)
+{
+	size_t new_capacity, i;
+	size_t *new_table;
+	stk_settle_t *new_entries;
+
+	if (count > stk_settle_capacity) {
+		new_capacity = stk_settle_capacity ? stk_settle_capacity : 16;
+		while (new_capacity < count)
+			new_capacity *= 2;
+
+		new_entries =
+		    realloc(stk_settle, new_capacity * sizeof(stk_settle_t));
+		if (!new_entries)
+			return 0;
+		stk_settle = new_entries;
+		stk_settle_capacity = new_capacity;
+	}
+
+	if (count * 2 <= stk_settle_table_capacity)
+		return 1;
+
+	new_capacity =
+	    stk_settle_table_capacity ? stk_settle_table_capacity : 32;
+	while (new_capacity < count * 2)
+		new_capacity *= 2;
+
+	new_table = malloc(new_capacity * sizeof(size_t));
+	if (!new_table)
+		return 0;
+
+	free(stk_settle_table);
+	stk_settle_table = new_table;
+	stk_settle_table_capacity = new_capacity;
+	for (i = 0; i < new_capacity; i++)
+		stk_settle_table[i] = STK_SETTLE_NONE;
+	for (i = 0; i < stk_settle_count; i++)
+		stk_settle_put(i);
+
+	return 1;
+}
+
+/* entries are kept per file name for the life of the process, the same
+ * way module ids are interned */
+static size_t stk_settle_intern(const char *name)
+{
+	size_t slot, mask, e;
+	unsigned long hash = stk_hash_id(name);
+
+	if (stk_settle_table_capacity) {
+		mask = stk_settle_table_capacity - 1;
+		slot = hash & mask;
+		while ((e = stk_settle_table[slot]) != STK_SETTLE_NONE) {
+			if (stk_settle[e].hash == hash &&
+			    strcmp(stk_settle[e].name, name) == 0)
+				return e;
+			slot = (slot + 1) & mask;
+		}
+	}
+
+	if (!stk_settle_reserve(stk_settle_count + 1))
+		return STK_SETTLE_NONE;
+
+	e = stk_settle_count++;
+	strncpy(stk_settle[e].name, name, STK_PATH_MAX - 1);
+	stk_settle[e].name[STK_PATH_MAX - 1] = '\0';
+	stk_settle[e].hash = hash;
+	memset(stk_settle[e].digest, 0, sizeof(stk_settle[e].digest));
+	stk_settle[e].state = STK_SETTLE_IDLE;
+	stk_settle[e].bucket = STK_SETTLE_NONE;
+	stk_settle[e].prev = STK_SETTLE_NONE;
+	stk_settle[e].next = STK_SETTLE_NONE;
+	stk_settle_put(e);
+
+	return e;
+}
+
+static void stk_wheel_link(size_t e, size_t bucket)
+{
+	stk_settle[e].bucket = bucket;
+	stk_settle[e].prev = STK_SETTLE_NONE;
+	stk_settle[e].next = stk_wheel[bucket];
+	if (stk_wheel[bucket] != STK_SETTLE_NONE)
+		stk_settle[stk_wheel[bucket]].prev = e;
+	stk_wheel[bucket] = e;
+}
+
+static void stk_wheel_unlink(size_t e)
+{
+	stk_settle_t *s = &stk_settle[e];
+
+	if (s->bucket == STK_SETTLE_NONE)
+		return;
+
+	if (s->prev != STK_SETTLE_NONE)
+		stk_settle[s->prev].next = s->next;
+	else
+		stk_wheel[s->bucket] = s->next;
+	if (s->next != STK_SETTLE_NONE)
+		stk_settle[s->next].prev = s->prev;
+
+	s->bucket = STK_SETTLE_NONE;
+}
+
+/* files the entry under the lowest level whose span still reaches its
+ * deadline, in the slot picked by that level's bits of the deadline */
+static void stk_wheel_insert(size_t e)
+{
+	unsigned long delta = stk_settle[e].deadline - stk_wheel_now;
+	size_t level = 0;
+
+	if (delta == 0 || delta >= STK_WHEEL_SPAN) {
+		stk_wheel_link(e, STK_WHEEL_READY);
+		stk_settle[e].state = STK_SETTLE_EXPIRED;
+		stk_settle_armed--;
+		return;
+	}
+
+	while (level + 1 < STK_WHEEL_LEVELS &&
+	       delta >= 1UL << (STK_WHEEL_BITS * (level + 1)))
+		level++;
+
+	stk_wheel_link(e, level * STK_WHEEL_SIZE +
+			      ((stk_settle[e].deadline >>
+				(STK_WHEEL_BITS * level)) &
+			       STK_WHEEL_MASK));
+}
+
+/* level 0 slots are due now; higher slots cascade into lower levels */
+static void stk_wheel_expire(size_t bucket)
+{
+	size_t e, next;
+
+	e = stk_wheel[bucket];
+	stk_wheel[bucket] = STK_SETTLE_NONE;
+
+	for (; e != STK_SETTLE_NONE; e = next) {
+		next = stk_settle[e].next;
+		stk_settle[e].bucket = STK_SETTLE_NONE;
+		if (bucket < STK_WHEEL_SIZE) {
+			stk_settle[e].state = STK_SETTLE_EXPIRED;
+			stk_settle_armed--;
+			stk_wheel_link(e, STK_WHEEL_READY);
+		} else {
+			stk_wheel_insert(e);
+		}
+	}
+}
+
+static void stk_wheel_advance(unsigned long now)
+{
+	size_t level;
+	unsigned long t;
+
+	if (!stk_settle_armed) {
+		stk_wheel_now = now;
+		return;
+	}
+
+	while (stk_wheel_now != now && stk_settle_armed) {
+		t = ++stk_wheel_now;
+
+		/* when a level's bits roll over, pull the next slot of the
+		 * level above down, highest level first */
+		for (level = STK_WHEEL_LEVELS - 1; level > 0; level--) {
+			if (t & ((1UL << (STK_WHEEL_BITS * level)) - 1))
+				continue;
+			stk_wheel_expire(level * STK_WHEEL_SIZE +
+					 ((t >> (STK_WHEEL_BITS * level)) &
+					  STK_WHEEL_MASK));
+		}
+
+		stk_wheel_expire(t & STK_WHEEL_MASK);
+	}
+
+	stk_wheel_now = now;
+}
+
+/* the file the module file name resolves to through the module index */
+static unsigned char stk_settle_state(const char *name, unsigned long *size,
+				      unsigned long *mtime)
+{
+	char path[STK_PATH_MAX_OS];
+
+	if (!stk_index_path(name, path))
+		return 0;
+	return platform_file_state(path, size, mtime);
+}
+
+static void stk_settle_arm(size_t e)
+{
+	stk_settle_t *s = &stk_settle[e];
+
+	s->exists = stk_settle_state(s->name, &s->size, &s->mtime);
+	s->deadline = stk_wheel_now + stk_settle_ms;
+	s->state = STK_SETTLE_ARMED;
+	stk_settle_armed++;
+	stk_wheel_insert(e);
+}
+
+static void stk_wheel_start(unsigned long now)
+{
+	size_t i;
+
+	if (stk_wheel_started)
+		return;
+
+	for (i = 0; i <= STK_WHEEL_READY; i++)
+		stk_wheel[i] = STK_SETTLE_NONE;
+	stk_wheel_now = now;
+	stk_wheel_started = 1;
+}
+
+void stk_set_settle_ms(unsigned long ms)
+{
+	stk_settle_ms = ms < STK_WHEEL_SPAN ? ms : STK_WHEEL_SPAN - 1;
+}
+
+/* a new event restarts the file's window; the latest event type wins */
+void stk_settle_push(const char *name, stk_module_event_t type,
+		     unsigned long now)
+{
+	size_t e;
+
+	stk_wheel_start(now);
+	stk_wheel_advance(now);
+
+	e = stk_settle_intern(name);
+	if (e == STK_SETTLE_NONE)
+		return;
+
+	if (stk_settle[e].state != STK_SETTLE_IDLE) {
+		stk_watch_stats->coalesced++;
+		if (stk_settle[e].state == STK_SETTLE_ARMED)
+			stk_settle_armed--;
+		stk_wheel_unlink(e);
+	}
+
+	stk_settle[e].type = type;
+	stk_settle_arm(e);
+}
+
+/* hands back every file whose window has run out and whose size and
+ * mtime held still over it. Files that moved get another window. Whether
+ * a present file is a load or a reload is left to stk_poll, which owns
+ * the registry */
+size_t stk_settle_collect(unsigned long now, stk_module_event_t **out_events,
+			  char (**out_files)[STK_PATH_MAX])
+{
+	unsigned long size, mtime;
+	unsigned char exists;
+	size_t e, next, count = 0, capacity = 0;
+	stk_settle_t *s;
+
+	*out_events = NULL;
+	*out_files = NULL;
+
+	if (!stk_wheel_started)
+		return 0;
+
+	stk_wheel_advance(now);
+
+	for (e = stk_wheel[STK_WHEEL_READY]; e != STK_SETTLE_NONE;
+	     e = stk_settle[e].next)
+		capacity++;
+	if (capacity == 0)
+		return 0;
+
+	*out_events = malloc(capacity * sizeof(**out_events));
+	*out_files = malloc(capacity * sizeof(**out_files));
+	if (!*out_events || !*out_files) {
+		free(*out_events);
+		free(*out_files);
+		*out_events = NULL;
+		*out_files = NULL;
+		return 0;
+	}
+
+	for (e = stk_wheel[STK_WHEEL_READY]; e != STK_SETTLE_NONE; e = next) {
+		s = &stk_settle[e];
+		next = s->next;
+		stk_wheel_unlink(e);
+
+		if (s->type != STK_MOD_UNLOAD) {
+			exists = stk_settle_state(s->name, &size, &mtime);
+			if (!exists) {
+				/* its delete event is on the way */
+				s->state = STK_SETTLE_IDLE;
+				continue;
+			}
+			if (!s->exists || size != s->size ||
+			    mtime != s->mtime) {
+				stk_watch_stats->coalesced++;
+				stk_settle_arm(e);
+				continue;
+			}
+		}
+
+		s->state = STK_SETTLE_IDLE;
+		(*out_events)[count] = s->type;
+		memcpy((*out_files)[count], s->name, STK_PATH_MAX);
+		count++;
+	}
+
+	if (count == 0) {
+		free(*out_events);
+		free(*out_files);
+		*out_events = NULL;
+		*out_files = NULL;
+	}
+
+	return count;
+}
+
+/* Content digest of the shadow copy of the module file name, kept on the
+ * file's settle entry so that whichever thread watches the directory also
+ * owns the digests of what it copies. platform_copy_file() compares and
+ * updates it in place, so the pointer must not be held across another
+ * intern. */
+unsigned long *stk_shadow_digest(const char *name)
+{
+	size_t e = stk_settle_intern(name);
+	return e == STK_SETTLE_NONE ? NULL : stk_settle[e].digest;
+}
+
+/* milliseconds until the earliest window closes, 0 if one already has,
+ * -1 if nothing is settling */
+long stk_settle_next(unsigned long now)
+{
+	size_t e, level;
+	unsigned long best = STK_WHEEL_SPAN, delta;
+
+	if (!stk_wheel_started)
+		return -1;
+	if (stk_wheel[STK_WHEEL_READY] != STK_SETTLE_NONE)
+		return 0;
+	if (!stk_settle_armed)
+		return -1;
+
+	for (level = 0; level < STK_WHEEL_READY; level++) {
+		for (e = stk_wheel[level]; e != STK_SETTLE_NONE;
+		     e = stk_settle[e].next) {
+			delta = stk_settle[e].deadline - now;
+			if (delta > STK_WHEEL_SPAN)
+				return 0;
+			if (delta < best)
+				best = delta;
+		}
+	}
+
+	return (long)best;
+}
+
+void stk_settle_free(void)
+{
+	free(stk_settle);
+	free(stk_settle_table);
+	stk_settle = NULL;
+	stk_settle_table = NULL;
+	stk_settle_count = 0;
+	stk_settle_capacity = 0;
+	stk_settle_table_capacity = 0;
+	stk_settle_armed = 0;
+	stk_wheel_started = 0;
+}
@@ -5,65 +5,116 @@
 #include <stdlib.h>
 #include <string.h>
 
-typedef int (*stk_init_mod_func)(void);
-typedef void (*stk_shutdown_mod_func)(void);
-
-typedef struct {
-	char desc[STK_MOD_DESC_BUFFER];
-	char name[STK_MOD_NAME_BUFFER];
-	char id[STK_MOD_ID_BUFFER];
-	char version[STK_MOD_VERSION_BUFFER];
-	void *handle;
-	stk_init_mod_func init;
-	stk_shutdown_mod_func shutdown;
-	stk_dep_t *deps;
-	size_t dep_count;
-} stk_mod_t;
-
-extern stk_mod_t *stk_modules;
 extern size_t module_count;
 
 unsigned char stk_flags = STK_FLAG_LOGGING_ENABLED;
+stk_stats_t stk_stats;
 
 static char stk_mod_dir[STK_PATH_MAX_OS] = "mods";
 static char stk_tmp_name[STK_MOD_ID_BUFFER] = ".tmp";
 static char stk_tmp_dir[STK_PATH_MAX_OS] = "";
+/* stk_mod_dir is root 0; roots added later override earlier ones */
+static char stk_mod_roots[STK_MOD_ROOTS_MAX][STK_PATH_MAX_OS];
+static size_t stk_mod_root_count = 0;
 static void *watch_handle = NULL;
+/* shared directory of content-addressed shadow copies, "" for none */
+static char stk_shadow_store[STK_PATH_MAX_OS] = "";
+/* seconds a store file may go unused before stk_init() deletes it, 0 to
+ * keep them all */
+static unsigned long stk_shadow_store_max_age = 7UL * 24 * 60 * 60;
+/* shadow copies live in memory files or the shadow store rather than the
+ * temp directory */
+static unsigned char stk_shadows_detached = 0;
+/* threads copying and opening modules in stk_init(), 0 or 1 for none */
+static size_t stk_preload_threads = 0;
 
 char (*platform_directory_init_scan(const char *path,
 				    size_t *out_count))[STK_PATH_MAX];
-void *platform_directory_watch_start(const char *path);
+void *platform_directory_watch_start(const char (*roots)[STK_PATH_MAX_OS],
+				     size_t root_count,
+				     char (**out_files)[STK_PATH_MAX],
+				     size_t **out_roots, size_t *out_count);
 void platform_directory_watch_stop(void *handle);
-stk_module_event_t *platform_directory_watch_check(
-    void *handle, char (**file_list)[STK_PATH_MAX], size_t *out_count,
-    char (*loaded_module_ids)[STK_MOD_ID_BUFFER], const size_t loaded_count);
+int platform_directory_watch_fd(void *handle);
+unsigned char platform_directory_watch_wait(void *handle, void *wake,
+					    int timeout_ms);
+unsigned long platform_time_ms(void);
+
+long stk_settle_next(unsigned long now);
+void stk_settle_free(void);
+unsigned long *stk_shadow_digest(const char *name);
+size_t stk_watch_collect(void *handle, const char *tmp_dir,
+			 stk_module_event_t **out_events,
+			 char (**out_files)[STK_PATH_MAX],
+			 unsigned char **out_results);
+unsigned char stk_watcher_start(void *handle, const char *tmp_dir);
+void stk_watcher_stop(void);
+size_t stk_watcher_drain(stk_module_event_t **out_events,
+			 char (**out_files)[STK_PATH_MAX],
+			 unsigned char **out_results);
+unsigned char stk_watcher_running(void);
+unsigned char stk_watcher_wait(int timeout_ms);
+int stk_watcher_fd(void);
 unsigned char platform_mkdir(const char *path);
-unsigned char platform_copy_file(const char *from, const char *to);
+unsigned char platform_copy_file(const char *from, const char *to,
+				 unsigned long *digest);
 unsigned char platform_remove_dir(const char *path);
+unsigned char platform_shadow_memfd_start(void);
+unsigned char platform_shadow_store_start(const char *path,
+					  unsigned long max_age);
+void platform_shadow_stop(void);
+
+size_t stk_index_add_root(const char *path);
+unsigned char stk_index_update(size_t root, const char *rel,
+			       unsigned char present, char *out_name,
+			       stk_module_event_t *out_type);
+unsigned char stk_index_path(const char *name, char *out_path);
+size_t stk_index_winners(char (**out_names)[STK_PATH_MAX]);
+void stk_index_free(void);
 
 void extract_module_id(const char *path, char *out_id);
 int is_mod_loaded(const char *module_id);
 
 size_t stk_module_count(void);
-unsigned char stk_module_preload(const char *path, int index);
-unsigned char stk_module_activate(size_t index);
+unsigned char stk_module_preload(const char *path, size_t *out_index);
+unsigned char stk_module_commit(size_t index, int rc);
+void stk_module_run_inits(const size_t *indices, size_t count, int *out_rc);
+unsigned char stk_module_levels(size_t *order, size_t count,
+				size_t *out_level);
 unsigned char stk_validate_dependencies_single(size_t index);
 void stk_log_dependency_failures(size_t index, const char *action);
 void stk_module_discard(size_t index);
-unsigned char stk_module_load(const char *path, int index);
-unsigned char stk_module_load_init(const char *path, int index);
-unsigned char stk_module_init_memory(size_t capacity);
-unsigned char stk_module_realloc_memory(size_t new_capacity);
+unsigned char stk_module_register(void *opened, size_t *out_index);
+unsigned char stk_module_load(const char *path, size_t *out_index);
+unsigned char stk_module_replace(size_t index, const char *path,
+				 size_t *out_index);
+unsigned char stk_module_reserve(size_t count);
+void stk_module_trim(void);
 void stk_module_unload(size_t index);
+size_t stk_module_slot_count(void);
+unsigned char stk_module_is_loaded(size_t index);
+unsigned char stk_module_deps_missing(size_t index);
+const char *stk_module_id(size_t index);
+const char *stk_module_name(size_t index);
+const char *stk_module_version(size_t index);
+const char *stk_module_desc(size_t index);
 void stk_module_unload_all(void);
-unsigned char stk_validate_dependencies(size_t count);
-unsigned char stk_topo_sort(size_t count, size_t *order);
+unsigned char stk_topo_sort(size_t *order, size_t *count);
 void stk_pending_add(const char *path);
 void stk_pending_add_batch(const char (*paths)[STK_PATH_MAX_OS], size_t count);
 void stk_pending_remove(const char *id);
 size_t stk_pending_retry(void);
 void stk_sort_unload_order(size_t *indices, size_t n);
 void stk_collect_dependents(size_t *indices, size_t *count, size_t capacity);
+size_t stk_collect_broken(size_t *out, size_t capacity);
+void *stk_preload_open(const char *name, const char *tmp_dir,
+		       unsigned long *digest, unsigned char *out_copy,
+		       unsigned char *out_load);
+void *stk_preload_run(char (*files)[STK_PATH_MAX], size_t count,
+		      const char *tmp_dir, size_t threads);
+void *stk_preload_take(void *batch, size_t i, unsigned char *out_copy,
+		       unsigned char *out_load);
+void stk_preload_free(void *batch);
 void stk_sort_load_order(int *file_indices, size_t n,
 			 char (*file_names)[STK_PATH_MAX], const char *tmp_dir);
 
@@ -98,54 +149,90 @@ static const char *stk_error_string(int error_code)
 	}
 }
 
-static void stk_log_module(size_t index)
+static void stk_log_module(const char *prefix, size_t index)
 {
+	const char *id = stk_module_id(index);
+	const char *version = stk_module_version(index);
 	const char *name =
-	    stk_modules[index].name[0] ? stk_modules[index].name : NULL;
+	    stk_module_name(index)[0] ? stk_module_name(index) : NULL;
 	const char *desc =
-	    stk_modules[index].desc[0] ? stk_modules[index].desc : NULL;
+	    stk_module_desc(index)[0] ? stk_module_desc(index) : NULL;
 
 	if (name && desc)
-		stk_log(STK_LOG_INFO, "  %s v%s - %s (%s)",
-			stk_modules[index].id, stk_modules[index].version, desc,
-			name);
+		stk_log(STK_LOG_INFO, "%s%s v%s - %s (%s)", prefix, id, version,
+			desc, name);
 	else if (name)
-		stk_log(STK_LOG_INFO, "  %s v%s (%s)", stk_modules[index].id,
-			stk_modules[index].version, name);
+		stk_log(STK_LOG_INFO, "%s%s v%s (%s)", prefix, id, version,
+			name);
 	else if (desc)
-		stk_log(STK_LOG_INFO, "  %s v%s - %s", stk_modules[index].id,
-			stk_modules[index].version, desc);
+		stk_log(STK_LOG_INFO, "%s%s v%s - %s", prefix, id, version,
+			desc);
 	else
-		stk_log(STK_LOG_INFO, "  %s v%s", stk_modules[index].id,
-			stk_modules[index].version);
+		stk_log(STK_LOG_INFO, "%s%s v%s", prefix, id, version);
 }
 
 static void stk_log_modules(void)
 {
-	size_t i;
+	size_t i, slots = stk_module_slot_count();
 	stk_log(STK_LOG_INFO,
 		"Loaded modules (%lu):", (unsigned long)module_count);
-	for (i = 0; i < module_count; i++)
-		stk_log_module(i);
+	for (i = 0; i < slots; i++)
+		if (stk_module_is_loaded(i))
+			stk_log_module("  ", i);
+}
+
+const char *stk_get_tmp_dir(void)
+{
+	return stk_tmp_dir;
 }
 
 unsigned char stk_init(void)
 {
 	char (*files)[STK_PATH_MAX] = NULL;
 	char (*test_scan)[STK_PATH_MAX];
-	size_t file_count, i, j, write, successful_loads = 0;
+	char name[STK_PATH_MAX];
+	size_t *file_roots = NULL;
+	size_t file_count, i, j, r, order_count = 0;
 	size_t index, test_count;
-	char full_path[STK_PATH_MAX_OS];
-	char tmp_path[STK_PATH_MAX_OS];
-	int load_result;
+	stk_module_event_t type;
+	char mod_id[STK_MOD_ID_BUFFER];
+	void *batch, *opened;
+	unsigned char load_result;
+	unsigned char copy_result;
 	unsigned char dep_result;
 	size_t *order = NULL;
 	char (*init_batch)[STK_PATH_MAX_OS] = NULL;
 	size_t init_batch_count = 0;
+	size_t *group, *levels, one_index, group_count, k, end;
+	int *group_rc, one_rc;
+	unsigned char by_level;
+	char *deferred;
 
 	platform_mkdir(stk_mod_dir);
 	build_path(stk_tmp_dir, sizeof(stk_tmp_dir), stk_mod_dir, stk_tmp_name);
-	if (platform_mkdir(stk_tmp_dir) != STK_PLATFORM_OPERATION_SUCCESS) {
+
+	stk_shadows_detached = 0;
+	if (stk_shadow_store[0]) {
+		stk_shadows_detached =
+		    platform_shadow_store_start(stk_shadow_store,
+						stk_shadow_store_max_age);
+		if (!stk_shadows_detached)
+			stk_log(STK_LOG_WARN,
+				"Warning: cannot use shadow store %s",
+				stk_shadow_store);
+	}
+
+	if (!stk_shadows_detached && (stk_flags & STK_FLAG_MEMFD_SHADOWS)) {
+		stk_shadows_detached = platform_shadow_memfd_start();
+		if (!stk_shadows_detached)
+			stk_log(STK_LOG_WARN,
+				"Warning: cannot keep shadow copies in memory, "
+				"copying into %s instead",
+				stk_tmp_dir);
+	}
+
+	if (!stk_shadows_detached &&
+	    platform_mkdir(stk_tmp_dir) != STK_PLATFORM_OPERATION_SUCCESS) {
 		test_scan =
 		    platform_directory_init_scan(stk_tmp_dir, &test_count);
 		if (test_scan)
@@ -158,43 +245,84 @@ unsigned char stk_init(void)
 		}
 	}
 
-	files = platform_directory_init_scan(stk_mod_dir, &file_count);
+	/* root 0 is the module directory itself */
+	strncpy(stk_mod_roots[0], stk_mod_dir, STK_PATH_MAX_OS - 1);
+	stk_mod_roots[0][STK_PATH_MAX_OS - 1] = '\0';
+	if (stk_mod_root_count == 0)
+		stk_mod_root_count = 1;
+
+	for (r = 0; r < stk_mod_root_count; r++) {
+		platform_mkdir(stk_mod_roots[r]);
+		stk_index_add_root(stk_mod_roots[r]);
+	}
+
+	/* the watch lists the roots as it starts; that listing is the
+	 * startup scan, and changes made while the modules below load are
+	 * picked up by the first poll */
+	watch_handle = platform_directory_watch_start(
+	    (const char (*)[STK_PATH_MAX_OS])stk_mod_roots, stk_mod_root_count,
+	    &files, &file_roots, &file_count);
+	if (!watch_handle) {
+		stk_log(STK_LOG_ERROR,
+			"FATAL: Cannot start directory watch on %s",
+			stk_mod_dir);
+		stk_index_free();
+		platform_shadow_stop();
+		return STK_INIT_WATCH_ERROR;
+	}
 
-	if (file_count > 0 && stk_module_init_memory(file_count) != 0) {
+	for (i = 0; i < file_count; i++)
+		stk_index_update(file_roots[i], files[i], 1, name, &type);
+	free(files);
+	free(file_roots);
+
+	file_count = stk_index_winners(&files);
+
+	if (file_count > 0 &&
+	    stk_module_reserve(file_count) != STK_MOD_INIT_SUCCESS) {
 		stk_log(STK_LOG_ERROR, "FATAL: Memory allocation failed");
+		free(files);
+		platform_directory_watch_stop(watch_handle);
+		watch_handle = NULL;
+		stk_index_free();
+		platform_shadow_stop();
 		return STK_INIT_MEMORY_ERROR;
 	}
 
 	if (!files)
 		goto scanned;
 
-	for (i = 0; i < file_count; ++i) {
-		build_path(full_path, sizeof(full_path), stk_mod_dir, files[i]);
-		build_path(tmp_path, sizeof(tmp_path), stk_tmp_dir, files[i]);
+	batch = stk_preload_run(files, file_count, stk_tmp_dir,
+				stk_preload_threads);
 
-		if (platform_copy_file(full_path, tmp_path) !=
-		    STK_PLATFORM_OPERATION_SUCCESS) {
+	for (i = 0; i < file_count; ++i) {
+		if (batch)
+			opened = stk_preload_take(batch, i, &copy_result,
+						  &load_result);
+		else
+			opened = stk_preload_open(
+			    files[i], stk_tmp_dir, stk_shadow_digest(files[i]),
+			    &copy_result, &load_result);
+
+		if (copy_result != STK_PLATFORM_OPERATION_SUCCESS &&
+		    copy_result != STK_PLATFORM_FILE_UNCHANGED &&
+		    copy_result != STK_PLATFORM_IMAGE_UNCHANGED) {
 			stk_log(STK_LOG_ERROR,
 				"Failed to copy %s to temp directory",
 				files[i]);
 			continue;
 		}
 
-		load_result = stk_module_preload(tmp_path, successful_loads);
+		if (opened)
+			load_result = stk_module_register(opened, &index);
 
-		if (load_result != STK_MOD_INIT_SUCCESS) {
+		if (load_result != STK_MOD_INIT_SUCCESS)
 			stk_log(STK_LOG_ERROR,
 				"Failed to preload module %s: %s", files[i],
 				stk_error_string(load_result));
-		} else {
-			successful_loads++;
-			module_count++;
-		}
 	}
 
-	if (successful_loads < file_count)
-		stk_module_realloc_memory(successful_loads);
-
+	stk_preload_free(batch);
 	free(files);
 
 	if (module_count == 0)
@@ -202,41 +330,82 @@ unsigned char stk_init(void)
 
 	order = malloc(module_count * sizeof(size_t));
 	if (order) {
-		dep_result = stk_topo_sort(module_count, order);
+		dep_result = stk_topo_sort(order, &order_count);
 		if (dep_result != STK_MOD_INIT_SUCCESS)
 			stk_log(STK_LOG_ERROR, "Dependency sort failed: %s",
 				stk_error_string(dep_result));
+		if (order_count == 0) {
+			free(order);
+			order = NULL;
+		}
 	}
+	if (!order)
+		order_count = stk_module_slot_count();
 
 	init_batch = malloc(module_count * sizeof(*init_batch));
+	group = malloc(module_count * sizeof(size_t));
+	group_rc = malloc(module_count * sizeof(int));
+	levels = malloc(order_count * sizeof(size_t));
+
+	/* with init threads, a dependency level at a time: its modules only
+	 * depend on earlier levels, which are fully activated, so their
+	 * inits can run together. Otherwise one module at a time */
+	by_level = order && group && group_rc && levels &&
+		   stk_module_levels(order, order_count, levels);
+	if (!by_level) {
+		free(group);
+		free(group_rc);
+		group = &one_index;
+		group_rc = &one_rc;
+	}
 
-	for (j = 0; j < module_count; j++) {
-		index = order ? order[j] : j;
-		dep_result = stk_validate_dependencies_single(index);
-		if (dep_result != STK_MOD_INIT_SUCCESS) {
-			stk_log_dependency_failures(index, "Deferring");
-			if (init_batch) {
-				build_path(init_batch[init_batch_count],
-					   sizeof(init_batch[init_batch_count]),
-					   stk_tmp_dir, stk_modules[index].id);
-				strncat(
-				    init_batch[init_batch_count],
-				    STK_MODULE_EXT,
-				    sizeof(init_batch[init_batch_count]) -
-					strlen(init_batch[init_batch_count]) -
-					1);
-				init_batch_count++;
+	for (j = 0; j < order_count; j = end) {
+		end = j + 1;
+		while (by_level && end < order_count && levels[end] == levels[j])
+			end++;
+
+		group_count = 0;
+		for (k = j; k < end; k++) {
+			index = order ? order[k] : k;
+			if (!stk_module_is_loaded(index))
+				continue;
+			dep_result = stk_validate_dependencies_single(index);
+			if (dep_result != STK_MOD_INIT_SUCCESS) {
+				stk_log_dependency_failures(index, "Deferring");
+				if (init_batch) {
+					deferred =
+					    init_batch[init_batch_count++];
+					build_path(deferred, STK_PATH_MAX_OS,
+						   stk_tmp_dir, stk_module_id(index));
+					strncat(deferred, STK_MODULE_EXT,
+						STK_PATH_MAX_OS - strlen(deferred) -
+						    1);
+				}
+				stk_module_discard(index);
+				continue;
 			}
-			stk_module_discard(index);
-			continue;
+			group[group_count++] = index;
 		}
-		if (stk_module_activate(index) != STK_MOD_INIT_SUCCESS) {
-			stk_log(STK_LOG_ERROR, "Failed to init module %s",
-				stk_modules[index].id);
-			stk_module_discard(index);
+
+		stk_module_run_inits(group, group_count, group_rc);
+
+		for (k = 0; k < group_count; k++) {
+			strncpy(mod_id, stk_module_id(group[k]),
+				STK_MOD_ID_BUFFER - 1);
+			mod_id[STK_MOD_ID_BUFFER - 1] = '\0';
+			if (stk_module_commit(group[k], group_rc[k]) !=
+			    STK_MOD_INIT_SUCCESS)
+				stk_log(STK_LOG_ERROR,
+					"Failed to init module %s", mod_id);
 		}
 	}
 
+	if (by_level) {
+		free(group);
+		free(group_rc);
+	}
+	free(levels);
+
 	if (init_batch_count > 0)
 		stk_pending_add_batch(
 		    (const char (*)[STK_PATH_MAX_OS])init_batch,
@@ -250,30 +419,19 @@ unsigned char stk_init(void)
 		order = NULL;
 	}
 
-	write = 0;
-	for (j = 0; j < module_count; j++) {
-		if (stk_modules[j].handle != NULL) {
-			if (write != j)
-				stk_modules[write] = stk_modules[j];
-			write++;
-		}
-	}
-	module_count = write;
-
 scanned:
-	watch_handle = platform_directory_watch_start(stk_mod_dir);
-	if (!watch_handle) {
-		stk_log(STK_LOG_ERROR,
-			"FATAL: Cannot start directory watch on %s",
-			stk_mod_dir);
-		stk_module_unload_all();
-		return STK_INIT_WATCH_ERROR;
-	}
+	if ((stk_flags & STK_FLAG_WATCH_THREAD) &&
+	    !stk_watcher_start(watch_handle, stk_tmp_dir))
+		stk_log(STK_LOG_WARN,
+			"Warning: cannot start watcher thread, watching from "
+			"stk_poll() instead");
 
 	stk_pending_retry();
 
 	stk_log(STK_LOG_INFO, "stk v%s initialized, watching %s/",
 		STK_VERSION_STRING, stk_mod_dir);
+	for (r = 1; r < stk_mod_root_count; r++)
+		stk_log(STK_LOG_INFO, "  and %s/", stk_mod_roots[r]);
 	if (module_count > 0)
 		stk_log_modules();
 
@@ -283,15 +441,22 @@ scanned:
 
 void stk_shutdown(void)
 {
+	stk_watcher_stop();
+
 	if (watch_handle) {
 		platform_directory_watch_stop(watch_handle);
 		watch_handle = NULL;
 	}
 
 	stk_module_unload_all();
-
-	if (platform_remove_dir(stk_tmp_dir) !=
-	    STK_PLATFORM_OPERATION_SUCCESS) {
+	stk_settle_free();
+	stk_index_free();
+
+	if (stk_shadows_detached) {
+		platform_shadow_stop();
+		stk_shadows_detached = 0;
+	} else if (platform_remove_dir(stk_tmp_dir) !=
+		   STK_PLATFORM_OPERATION_SUCCESS) {
 		stk_log(STK_LOG_WARN,
 			"Warning: failed to remove temp directory %s",
 			stk_tmp_dir);
@@ -307,53 +472,53 @@ size_t stk_poll(void)
 	stk_module_event_t *events = NULL;
 	size_t i, file_count = 0, reload_count = 0, load_count = 0,
 		  unload_count = 0;
-	int *reloaded_mod_indices = NULL, *reloaded_mod_file_indices = NULL,
-	    *unloaded_mod_indices = NULL, *loaded_mod_indices = NULL;
-	size_t new_capacity;
-	char full_path[STK_PATH_MAX_OS], tmp_path[STK_PATH_MAX_OS];
+	int *reloaded_mod_file_indices = NULL, *unloaded_mod_indices = NULL,
+	    *loaded_mod_indices = NULL;
+	stk_module_handle_t *reloaded_mods = NULL;
+	char tmp_path[STK_PATH_MAX_OS];
 	char mod_id[STK_MOD_ID_BUFFER];
 	int load_result;
-	size_t successful_appends = 0;
-	char (*module_ids)[STK_MOD_ID_BUFFER] = NULL;
-	unsigned char dep_result;
-	size_t *order = NULL;
+	unsigned char copy_result;
 	size_t *unload_order = NULL;
 	size_t expanded_count;
 	size_t index, oi;
 	int is_orig;
-	size_t write;
 	int file_index, mod_index;
 	size_t *cascade_indices = NULL;
 	size_t cascade_count;
-	size_t j, k, cascade_write;
+	size_t j;
 	char (*dep_batch)[STK_PATH_MAX_OS] = NULL;
 	size_t dep_batch_count = 0;
 	char (*cascade_batch)[STK_PATH_MAX_OS] = NULL;
 	size_t cascade_batch_count = 0;
 	char (*load_batch)[STK_PATH_MAX_OS] = NULL;
 	size_t load_batch_count = 0;
+	unsigned char *copy_results = NULL;
 
-	if (module_count > 0) {
-		module_ids = malloc(module_count * sizeof(*module_ids));
-		if (module_ids) {
-			for (i = 0; i < module_count; i++) {
-				strncpy(module_ids[i], stk_modules[i].id,
-					STK_MOD_ID_BUFFER - 1);
-				module_ids[i][STK_MOD_ID_BUFFER - 1] = '\0';
-			}
-		}
-	}
-
-	events = platform_directory_watch_check(
-	    watch_handle, &file_list, &file_count, module_ids, module_count);
-
-	if (module_ids)
-		free(module_ids);
+	memset(&stk_stats, 0, sizeof(stk_stats));
 
+	/* the watcher has already settled these events and refreshed their
+	 * shadow copies, on its thread or right here */
+	if (stk_watcher_running())
+		file_count = stk_watcher_drain(&events, &file_list,
+					       &copy_results);
+	else
+		file_count =
+		    stk_watch_collect(watch_handle, stk_tmp_dir,
+				      &events, &file_list, &copy_results);
 	if (!events)
 		goto finish_poll;
 
+	stk_stats.events = file_count;
+
 	for (i = 0; i < file_count; ++i) {
+		if (events[i] != STK_MOD_UNLOAD) {
+			/* the watcher cannot see the registry */
+			extract_module_id(file_list[i], mod_id);
+			events[i] = is_mod_loaded(mod_id) >= 0 ? STK_MOD_RELOAD
+								: STK_MOD_LOAD;
+		}
+
 		switch (events[i]) {
 		case STK_MOD_LOAD:
 			++load_count;
@@ -367,10 +532,11 @@ size_t stk_poll(void)
 		}
 	}
 
-	reloaded_mod_indices = malloc(reload_count * sizeof(int));
+	reloaded_mods = malloc(reload_count * sizeof(*reloaded_mods));
 	reloaded_mod_file_indices = malloc(reload_count * sizeof(int));
 	unloaded_mod_indices = malloc(unload_count * sizeof(int));
-	loaded_mod_indices = malloc(load_count * sizeof(int));
+	/* a reload whose module the unload cascade takes becomes a load */
+	loaded_mod_indices = malloc((load_count + reload_count) * sizeof(int));
 
 	reload_count = 0;
 	unload_count = 0;
@@ -381,13 +547,22 @@ size_t stk_poll(void)
 		extract_module_id(file_list[i], mod_id);
 		switch (events[i]) {
 		case STK_MOD_LOAD:
+			if (copy_results[i] != STK_PLATFORM_OPERATION_SUCCESS &&
+			    copy_results[i] != STK_PLATFORM_FILE_UNCHANGED &&
+			    copy_results[i] != STK_PLATFORM_IMAGE_UNCHANGED) {
+				stk_log(STK_LOG_ERROR,
+					"Failed to copy %s to temp directory",
+					file_list[i]);
+				break;
+			}
 			loaded_mod_indices[load_count++] = i;
 			break;
 		case STK_MOD_RELOAD:
 			mod_index = is_mod_loaded(mod_id);
 			if (mod_index >= 0) {
 				reloaded_mod_file_indices[reload_count] = i;
-				reloaded_mod_indices[reload_count] = mod_index;
+				reloaded_mods[reload_count] =
+				    stk_module_find(mod_id);
 				reload_count++;
 			}
 			break;
@@ -396,22 +571,13 @@ size_t stk_poll(void)
 			if (mod_index >= 0) {
 				unloaded_mod_indices[unload_count] = mod_index;
 				unload_count++;
+			} else {
+				stk_pending_remove(mod_id);
 			}
 			break;
 		}
 	}
 
-	if (load_count > unload_count)
-		goto handle_grow;
-
-	goto begin_operations;
-
-handle_grow:
-	new_capacity = module_count + load_count;
-	if (stk_module_realloc_memory(new_capacity) != STK_MOD_INIT_SUCCESS)
-		goto free_poll;
-
-begin_operations:
 	unload_order = malloc(module_count * sizeof(size_t));
 	if (unload_order) {
 		expanded_count = unload_count;
@@ -430,8 +596,8 @@ begin_operations:
 			index = unload_order[i];
 
 			stk_log(STK_LOG_INFO, "Unloaded module: %s",
-				stk_modules[index].id);
-			stk_pending_remove(stk_modules[index].id);
+				stk_module_id(index));
+			stk_pending_remove(stk_module_id(index));
 
 			is_orig = 0;
 			for (oi = 0; oi < unload_count; oi++) {
@@ -443,7 +609,7 @@ begin_operations:
 			if (!is_orig && dep_batch) {
 				build_path(dep_batch[dep_batch_count],
 					   sizeof(dep_batch[dep_batch_count]),
-					   stk_tmp_dir, stk_modules[index].id);
+					   stk_tmp_dir, stk_module_id(index));
 				strncat(
 				    dep_batch[dep_batch_count], STK_MODULE_EXT,
 				    sizeof(dep_batch[dep_batch_count]) -
@@ -466,59 +632,75 @@ begin_operations:
 	} else {
 		for (i = 0; i < unload_count; ++i) {
 			stk_log(STK_LOG_INFO, "Unloaded module: %s",
-				stk_modules[unloaded_mod_indices[i]].id);
+				stk_module_id(unloaded_mod_indices[i]));
 			stk_pending_remove(
-			    stk_modules[unloaded_mod_indices[i]].id);
+			    stk_module_id(unloaded_mod_indices[i]));
 			stk_module_unload(unloaded_mod_indices[i]);
 		}
 	}
 
-	if (unload_count > 0) {
-		write = 0;
-		for (i = 0; i < module_count; i++) {
-			if (stk_modules[i].handle != NULL) {
-				if (write != i)
-					stk_modules[write] = stk_modules[i];
-				write++;
-			}
-		}
-		module_count = write;
-		if (module_count > 0)
-			stk_module_realloc_memory(module_count);
-	}
-
 	for (i = 0; i < reload_count; ++i) {
 		file_index = reloaded_mod_file_indices[i];
-		mod_index = reloaded_mod_indices[i];
 
-		build_path(full_path, sizeof(full_path), stk_mod_dir,
-			   file_list[file_index]);
+		/* indices taken before the unload cascade may have been freed
+		 * by it, and their slots reused by an earlier reload */
+		if (!stk_module_valid(reloaded_mods[i])) {
+			if (copy_results[file_index] ==
+				STK_PLATFORM_OPERATION_SUCCESS ||
+			    copy_results[file_index] ==
+				STK_PLATFORM_FILE_UNCHANGED ||
+			    copy_results[file_index] ==
+				STK_PLATFORM_IMAGE_UNCHANGED)
+				loaded_mod_indices[load_count++] = file_index;
+			else
+				stk_log(STK_LOG_ERROR,
+					"Failed to copy %s to temp directory",
+					file_list[file_index]);
+			continue;
+		}
+		mod_index = (int)reloaded_mods[i].slot;
+
 		build_path(tmp_path, sizeof(tmp_path), stk_tmp_dir,
 			   file_list[file_index]);
 
-		stk_module_unload(mod_index);
-
-		if (platform_copy_file(full_path, tmp_path) !=
-		    STK_PLATFORM_OPERATION_SUCCESS) {
-			stk_log(STK_LOG_ERROR, "Failed to copy %s for reload",
+		copy_result = copy_results[file_index];
+		if (copy_result == STK_PLATFORM_FILE_UNCHANGED) {
+			stk_stats.skipped++;
+			stk_log(STK_LOG_INFO,
+				"Skipped reload of %s: contents unchanged",
+				stk_module_id(mod_index));
+			continue;
+		}
+		if (copy_result == STK_PLATFORM_IMAGE_UNCHANGED) {
+			stk_stats.skipped++;
+			stk_log(STK_LOG_INFO,
+				"Skipped reload of %s: loadable image "
+				"unchanged (debug info and notes ignored)",
+				stk_module_id(mod_index));
+			continue;
+		}
+		if (copy_result != STK_PLATFORM_OPERATION_SUCCESS) {
+			stk_log(STK_LOG_ERROR,
+				"Failed to copy %s for reload, keeping the "
+				"loaded version",
 				file_list[file_index]);
 			continue;
 		}
 
-		load_result = stk_module_load(tmp_path, mod_index);
-		if (load_result != STK_MOD_INIT_SUCCESS)
-			stk_log(STK_LOG_ERROR, "Failed to reload module %s: %s",
+		load_result = stk_module_replace(mod_index, tmp_path, &index);
+		if (load_result != STK_MOD_INIT_SUCCESS) {
+			extract_module_id(file_list[file_index], mod_id);
+			stk_log(STK_LOG_ERROR, "Failed to reload module %s: %s%s",
 				file_list[file_index],
-				stk_error_string(load_result));
-	}
+				stk_error_string(load_result),
+				is_mod_loaded(mod_id) >= 0
+				    ? ", keeping the loaded version"
+				    : "");
+			continue;
+		}
 
-	for (i = 0; i < load_count; i++) {
-		file_index = loaded_mod_indices[i];
-		build_path(full_path, sizeof(full_path), stk_mod_dir,
-			   file_list[file_index]);
-		build_path(tmp_path, sizeof(tmp_path), stk_tmp_dir,
-			   file_list[file_index]);
-		platform_copy_file(full_path, tmp_path);
+		stk_stats.reloaded++;
+		stk_log_module("Reloaded module: ", index);
 	}
 
 	if (load_count > 1)
@@ -534,9 +716,10 @@ begin_operations:
 		build_path(tmp_path, sizeof(tmp_path), stk_tmp_dir,
 			   file_list[file_index]);
 
-		load_result = stk_module_load(tmp_path, module_count +
-							    successful_appends);
-		if (load_result == STK_MOD_DEP_NOT_FOUND_ERROR ||
+		load_result = stk_module_load(tmp_path, &index);
+		if (load_result == STK_MOD_INIT_SUCCESS) {
+			stk_log_module("Loaded module: ", index);
+		} else if (load_result == STK_MOD_DEP_NOT_FOUND_ERROR ||
 		    load_result == STK_MOD_DEP_VERSION_MISMATCH_ERROR) {
 			if (load_batch)
 				memcpy(load_batch[load_batch_count++], tmp_path,
@@ -545,16 +728,9 @@ begin_operations:
 			stk_log(STK_LOG_ERROR, "Failed to load module %s: %s",
 				file_list[file_index],
 				stk_error_string(load_result));
-		} else {
-			successful_appends++;
 		}
 	}
 
-	module_count += successful_appends;
-
-	if (successful_appends < load_count)
-		stk_module_realloc_memory(module_count);
-
 	if (load_batch_count > 0)
 		stk_pending_add_batch(
 		    (const char (*)[STK_PATH_MAX_OS])load_batch,
@@ -576,17 +752,7 @@ validate_deps:
 		if (!cascade_indices)
 			break;
 
-		for (j = 0; j < module_count; j++) {
-			if (stk_modules[j].dep_count == 0)
-				continue;
-			for (k = 0; k < stk_modules[j].dep_count; k++) {
-				if (is_mod_loaded(stk_modules[j].deps[k].id) <
-				    0) {
-					cascade_indices[cascade_count++] = j;
-					break;
-				}
-			}
-		}
+		cascade_count = stk_collect_broken(cascade_indices, module_count);
 
 		if (cascade_count == 0) {
 			free(cascade_indices);
@@ -604,7 +770,7 @@ validate_deps:
 				build_path(
 				    cascade_batch[cascade_batch_count],
 				    sizeof(cascade_batch[cascade_batch_count]),
-				    stk_tmp_dir, stk_modules[index].id);
+				    stk_tmp_dir, stk_module_id(index));
 				strncat(
 				    cascade_batch[cascade_batch_count],
 				    STK_MODULE_EXT,
@@ -625,49 +791,102 @@ validate_deps:
 		free(cascade_batch);
 		cascade_batch = NULL;
 
-		cascade_write = 0;
-		for (j = 0; j < module_count; j++) {
-			if (stk_modules[j].handle != NULL) {
-				if (cascade_write != j)
-					stk_modules[cascade_write] =
-					    stk_modules[j];
-				cascade_write++;
-			}
-		}
-		module_count = cascade_write;
-
 		free(cascade_indices);
 		cascade_indices = NULL;
 
 	} while (cascade_count > 0);
 
-	if (module_count > 0)
-		stk_module_realloc_memory(module_count);
-
-	order = malloc(module_count * sizeof(size_t));
-	if (order) {
-		dep_result = stk_topo_sort(module_count, order);
-		if (dep_result != STK_MOD_INIT_SUCCESS)
-			stk_log(STK_LOG_ERROR, "Dependency sort failed: %s",
-				stk_error_string(dep_result));
-		free(order);
-	}
-
 free_poll:
 	stk_pending_retry();
+	stk_module_trim();
 
-	if (module_count > 0)
-		stk_log_modules();
+	/* a reload skipped as unchanged is counted under skipped only */
+	stk_stats.events -= stk_stats.skipped;
 
-	free(reloaded_mod_indices);
+	free(reloaded_mods);
 	free(reloaded_mod_file_indices);
 	free(unloaded_mod_indices);
 	free(loaded_mod_indices);
 	free(events);
 	free(file_list);
+	free(copy_results);
 
 finish_poll:
-	return file_count;
+	return stk_stats.events;
+}
+
+size_t stk_wait(int timeout_ms)
+{
+	unsigned long start, elapsed;
+	int remaining = timeout_ms;
+	long due;
+	size_t events;
+
+	if (!watch_handle)
+		return 0;
+
+	start = platform_time_ms();
+	for (;;) {
+		/* the watcher thread keeps its own settle deadlines */
+		if (stk_watcher_running()) {
+			if (stk_watcher_wait(remaining)) {
+				events = stk_poll();
+				if (events > 0)
+					return events;
+			}
+			goto waited;
+		}
+
+		/* wake early for the next settle deadline. Changes to files
+		 * that are not modules wake the watch too; keep waiting until
+		 * a poll actually handles something */
+		due = stk_settle_next(platform_time_ms());
+		if (due >= 0 && (remaining < 0 || due < remaining))
+			remaining = (int)due;
+
+		if (platform_directory_watch_wait(watch_handle, NULL,
+						  remaining) ||
+		    due >= 0) {
+			events = stk_poll();
+			if (events > 0)
+				return events;
+		}
+
+	waited:
+		if (timeout_ms < 0) {
+			remaining = -1;
+			continue;
+		}
+
+		elapsed = platform_time_ms() - start;
+		if (elapsed >= (unsigned long)timeout_ms)
+			return 0;
+		remaining = timeout_ms - (int)elapsed;
+	}
+}
+
+int stk_get_wait_fd(void)
+{
+	if (stk_watcher_running())
+		return stk_watcher_fd();
+	return platform_directory_watch_fd(watch_handle);
+}
+
+int stk_get_wait_timeout(void)
+{
+	long due;
+
+	if (stk_watcher_running())
+		return -1;
+
+	due = stk_settle_next(platform_time_ms());
+	return due < 0 ? -1 : (int)due;
+}
+
+void stk_get_stats(stk_stats_t *out)
+{
+	if (out)
+		*out = stk_stats;
 }
 
 void stk_set_mod_dir(const char *path)
@@ -688,6 +907,26 @@ void stk_set_mod_dir(const char *path)
 		STK_PATH_MAX_OS - strlen(stk_tmp_dir) - 1);
 }
 
+void stk_add_mod_dir(const char *path)
+{
+	if (!path || (stk_flags & STK_FLAG_INITIALIZED))
+		return;
+
+	if (stk_mod_root_count == 0)
+		stk_mod_root_count = 1;
+	if (stk_mod_root_count == STK_MOD_ROOTS_MAX) {
+		stk_log(STK_LOG_WARN,
+			"Warning: ignoring module directory %s, at most %d "
+			"are watched",
+			path, STK_MOD_ROOTS_MAX);
+		return;
+	}
+
+	strncpy(stk_mod_roots[stk_mod_root_count], path, STK_PATH_MAX_OS - 1);
+	stk_mod_roots[stk_mod_root_count][STK_PATH_MAX_OS - 1] = '\0';
+	stk_mod_root_count++;
+}
+
 void stk_set_tmp_dir_name(const char *name)
 {
 	if (!name || (stk_flags & STK_FLAG_INITIALIZED))
@@ -704,6 +943,58 @@ void stk_set_tmp_dir_name(const char *name)
 		STK_PATH_MAX_OS - strlen(stk_tmp_dir) - 1);
 }
 
+void stk_set_memfd_shadows(unsigned char enabled)
+{
+	if (stk_flags & STK_FLAG_INITIALIZED)
+		return;
+
+	if (enabled)
+		stk_flags |= STK_FLAG_MEMFD_SHADOWS;
+	else
+		stk_flags &= ~STK_FLAG_MEMFD_SHADOWS;
+}
+
+void stk_set_shadow_store(const char *path)
+{
+	if (stk_flags & STK_FLAG_INITIALIZED)
+		return;
+
+	if (!path) {
+		stk_shadow_store[0] = '\0';
+		return;
+	}
+
+	strncpy(stk_shadow_store, path, STK_PATH_MAX_OS - 1);
+	stk_shadow_store[STK_PATH_MAX_OS - 1] = '\0';
+}
+
+void stk_set_shadow_store_max_age(unsigned long seconds)
+{
+	if (stk_flags & STK_FLAG_INITIALIZED)
+		return;
+
+	stk_shadow_store_max_age = seconds;
+}
+
+void stk_set_preload_threads(size_t count)
+{
+	if (stk_flags & STK_FLAG_INITIALIZED)
+		return;
+
+	stk_preload_threads = count;
+}
+
+void stk_set_watch_thread(unsigned char enabled)
+{
+	if (stk_flags & STK_FLAG_INITIALIZED)
+		return;
+
+	if (enabled)
+		stk_flags |= STK_FLAG_WATCH_THREAD;
+	else
+		stk_flags &= ~STK_FLAG_WATCH_THREAD;
+}
+
 void stk_set_logging_enabled(unsigned char enabled)
 {
 	if (enabled)
@@ -0,0 +1,393 @@
+#include "platform.h"
+#include "stk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Watcher: the part of a poll that does not touch the registry. Reads the
+ * directory watch, runs events through the settle window and refreshes
+ * the shadow copies, either inline from stk_poll() or on a thread of its
+ * own. The thread hands its results to stk_poll() through a bounded
+ * single-producer, single-consumer ring; only the producer moves the tail
+ * and only the consumer moves the head. */
+
+#define STK_RING_SIZE 256
+#define STK_RING_MASK (STK_RING_SIZE - 1)
+
+typedef struct {
+	stk_module_event_t type;
+	unsigned char copy_result;
+	/* watcher side stats gathered since the previous entry */
+	stk_stats_t work;
+	char name[STK_PATH_MAX];
+} stk_ring_entry_t;
+
+extern stk_stats_t stk_stats;
+
+/* where platform_copy_file() and the settle window count their work:
+ * stk_stats when they run inside stk_poll(), the watcher's own counters
+ * while the thread runs */
+stk_stats_t *stk_watch_stats = &stk_stats;
+
+stk_module_event_t *platform_directory_watch_check(
+    void *handle, char (**file_list)[STK_PATH_MAX], size_t **root_list,
+    size_t *out_count, unsigned char *rescan);
+char (*platform_directory_init_scan(const char *dir_path,
+				    size_t *out_count))[STK_PATH_MAX];
+unsigned char platform_directory_watch_wait(void *handle, void *wake,
+					    int timeout_ms);
+unsigned char platform_copy_file(const char *from, const char *to,
+				 unsigned long *digest);
+unsigned long platform_time_ms(void);
+void *platform_thread_start(void (*fn)(void *), void *arg);
+void platform_thread_join(void *handle);
+void *platform_notify_create(void);
+void platform_notify_destroy(void *handle);
+void platform_notify_signal(void *handle);
+void platform_notify_clear(void *handle);
+int platform_notify_fd(void *handle);
+unsigned char platform_notify_wait(void *handle, int timeout_ms);
+size_t platform_atomic_load(const volatile size_t *p);
+void platform_atomic_store(volatile size_t *p, size_t value);
+
+void stk_settle_push(const char *name, stk_module_event_t type,
+		     unsigned long now);
+size_t stk_settle_collect(unsigned long now, stk_module_event_t **out_events,
+			  char (**out_files)[STK_PATH_MAX]);
+long stk_settle_next(unsigned long now);
+unsigned long *stk_shadow_digest(const char *name);
+
+size_t stk_index_root_count(void);
+const char *stk_index_root(size_t root);
+unsigned char stk_index_update(size_t root, const char *rel,
+			       unsigned char present, char *out_name,
+			       stk_module_event_t *out_type);
+unsigned char stk_index_path(const char *name, char *out_path);
+void stk_index_mark(void);
+size_t stk_index_sweep(stk_module_event_t **out_events,
+		       char (**out_names)[STK_PATH_MAX]);
+
+static stk_ring_entry_t stk_ring[STK_RING_SIZE];
+static volatile size_t stk_ring_head = 0;
+static volatile size_t stk_ring_tail = 0;
+static volatile size_t stk_watcher_stopping = 0;
+
+static void *stk_watcher_thread = NULL;
+static void *stk_watcher_ready = NULL;
+static void *stk_watcher_wake = NULL;
+static void *stk_watcher_handle = NULL;
+static char stk_watcher_tmp_dir[STK_PATH_MAX_OS];
+static stk_stats_t stk_watcher_work;
+
+static void stk_watcher_path(char *out, const char *dir, const char *name)
+{
+	out[0] = '\0';
+	strncat(out, dir, STK_PATH_MAX_OS - 1);
+	strncat(out, STK_PATH_SEP_STR, STK_PATH_MAX_OS - strlen(out) - 1);
+	strncat(out, name, STK_PATH_MAX_OS - strlen(out) - 1);
+}
+
+/* After lost events: reports every file under every root to the index
+ * again and drops the ones it no longer finds */
+static void stk_watch_rescan(unsigned long now)
+{
+	char (*files)[STK_PATH_MAX];
+	char name[STK_PATH_MAX];
+	stk_module_event_t *events, type;
+	size_t r, i, count;
+
+	stk_watch_stats->rescans++;
+	stk_index_mark();
+
+	for (r = 0; r < stk_index_root_count(); r++) {
+		files = platform_directory_init_scan(stk_index_root(r), &count);
+		for (i = 0; files && i < count; i++)
+			if (stk_index_update(r, files[i], 1, name, &type))
+				stk_settle_push(name, type, now);
+		free(files);
+	}
+
+	count = stk_index_sweep(&events, &files);
+	for (i = 0; i < count; i++)
+		stk_settle_push(files[i], events[i], now);
+	free(events);
+	free(files);
+}
+
+/* Reads the watch, folds its events into the module index, settles what
+ * the index reports and refreshes the shadow copy of every module that is
+ * still provided. Files are named by module file name from here on.
+ * out_results holds the copy result per event,
+ * STK_PLATFORM_OPERATION_SUCCESS for unloads. */
+size_t stk_watch_collect(void *handle, const char *tmp_dir,
+			 stk_module_event_t **out_events,
+			 char (**out_files)[STK_PATH_MAX],
+			 unsigned char **out_results)
+{
+	char (*files)[STK_PATH_MAX] = NULL;
+	char from[STK_PATH_MAX_OS], to[STK_PATH_MAX_OS], name[STK_PATH_MAX];
+	stk_module_event_t *events, type;
+	size_t *roots = NULL;
+	size_t i, count = 0;
+	unsigned long now;
+	unsigned char rescan = 0;
+
+	*out_results = NULL;
+
+	events = platform_directory_watch_check(handle, &files, &roots, &count,
+						&rescan);
+
+	now = platform_time_ms();
+	if (events) {
+		for (i = 0; i < count; i++)
+			if (stk_index_update(roots[i], files[i],
+					     events[i] != STK_MOD_UNLOAD, name,
+					     &type))
+				stk_settle_push(name, type, now);
+		free(events);
+		free(files);
+		free(roots);
+	}
+
+	if (rescan)
+		stk_watch_rescan(now);
+
+	count = stk_settle_collect(now, out_events, out_files);
+	if (!*out_events)
+		return 0;
+
+	*out_results = malloc(count);
+	if (!*out_results) {
+		free(*out_events);
+		free(*out_files);
+		*out_events = NULL;
+		*out_files = NULL;
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		(*out_results)[i] = STK_PLATFORM_OPERATION_SUCCESS;
+		if ((*out_events)[i] == STK_MOD_UNLOAD)
+			continue;
+
+		(*out_results)[i] = STK_PLATFORM_FILE_COPY_ERROR;
+		if (!stk_index_path((*out_files)[i], from))
+			continue;
+
+		stk_watcher_path(to, tmp_dir, (*out_files)[i]);
+		(*out_results)[i] = platform_copy_file(
+		    from, to, stk_shadow_digest((*out_files)[i]));
+	}
+
+	return count;
+}
+
+/* waits for the consumer while the ring is full */
+static void stk_ring_publish(stk_ring_entry_t *entry)
+{
+	size_t tail = stk_ring_tail;
+
+	while (tail - platform_atomic_load(&stk_ring_head) >= STK_RING_SIZE) {
+		if (platform_atomic_load(&stk_watcher_stopping))
+			return;
+		platform_notify_signal(stk_watcher_ready);
+		platform_notify_wait(stk_watcher_wake, 1);
+	}
+
+	entry->work = stk_watcher_work;
+	memset(&stk_watcher_work, 0, sizeof(stk_watcher_work));
+
+	stk_ring[tail & STK_RING_MASK] = *entry;
+	platform_atomic_store(&stk_ring_tail, tail + 1);
+}
+
+static void stk_watcher_main(void *arg)
+{
+	stk_module_event_t *events;
+	char (*files)[STK_PATH_MAX];
+	unsigned char *results;
+	stk_ring_entry_t entry;
+	size_t i, count;
+	long due;
+
+	(void)arg;
+
+	while (!platform_atomic_load(&stk_watcher_stopping)) {
+		due = stk_settle_next(platform_time_ms());
+		platform_directory_watch_wait(stk_watcher_handle,
+					      stk_watcher_wake,
+					      due < 0 ? -1 : (int)due);
+		platform_notify_clear(stk_watcher_wake);
+
+		count = stk_watch_collect(stk_watcher_handle,
+					  stk_watcher_tmp_dir, &events, &files,
+					  &results);
+
+		memset(&entry, 0, sizeof(entry));
+
+		for (i = 0; i < count; i++) {
+			entry.type = events[i];
+			entry.copy_result = results[i];
+			memcpy(entry.name, files[i], STK_PATH_MAX);
+			stk_ring_publish(&entry);
+		}
+
+		if (count > 0)
+			platform_notify_signal(stk_watcher_ready);
+
+		free(events);
+		free(files);
+		free(results);
+	}
+}
+
+unsigned char stk_watcher_start(void *handle, const char *tmp_dir)
+{
+	stk_watcher_ready = platform_notify_create();
+	stk_watcher_wake = platform_notify_create();
+	if (!stk_watcher_ready || !stk_watcher_wake)
+		goto fail;
+
+	strncpy(stk_watcher_tmp_dir, tmp_dir, STK_PATH_MAX_OS - 1);
+	stk_watcher_tmp_dir[STK_PATH_MAX_OS - 1] = '\0';
+
+	stk_watcher_handle = handle;
+	stk_ring_head = 0;
+	stk_ring_tail = 0;
+	stk_watcher_stopping = 0;
+	memset(&stk_watcher_work, 0, sizeof(stk_watcher_work));
+	stk_watch_stats = &stk_watcher_work;
+
+	stk_watcher_thread = platform_thread_start(stk_watcher_main, NULL);
+	if (stk_watcher_thread)
+		return 1;
+
+	stk_watch_stats = &stk_stats;
+
+fail:
+	platform_notify_destroy(stk_watcher_ready);
+	platform_notify_destroy(stk_watcher_wake);
+	stk_watcher_ready = NULL;
+	stk_watcher_wake = NULL;
+	return 0;
+}
+
+void stk_watcher_stop(void)
+{
+	if (!stk_watcher_thread)
+		return;
+
+	platform_atomic_store(&stk_watcher_stopping, 1);
+	platform_notify_signal(stk_watcher_wake);
+	platform_thread_join(stk_watcher_thread);
+	stk_watcher_thread = NULL;
+
+	platform_notify_destroy(stk_watcher_ready);
+	platform_notify_destroy(stk_watcher_wake);
+	stk_watcher_ready = NULL;
+	stk_watcher_wake = NULL;
+	stk_watch_stats = &stk_stats;
+}
+
+static void stk_watcher_merge(const stk_stats_t *work)
+{
+	size_t i;
+
+	stk_stats.rescans += work->rescans;
+	stk_stats.coalesced += work->coalesced;
+	for (i = 0; i < STK_COPY_STRATEGY_COUNT; i++)
+		stk_stats.copies[i] += work->copies[i];
+	stk_stats.reused += work->reused;
+}
+
+/* a file published twice before the consumer got to it: the later event
+ * wins, but a fresh copy made for the earlier one still has to be loaded
+ * even if the later copy found nothing new */
+static size_t stk_watcher_find(char (*files)[STK_PATH_MAX], size_t count,
+			       const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (strcmp(files[i], name) == 0)
+			return i;
+	return count;
+}
+
+/* Takes everything the watcher thread has published so far, in the same
+ * shape stk_watch_collect() returns. Called by stk_poll() only. */
+size_t stk_watcher_drain(stk_module_event_t **out_events,
+			 char (**out_files)[STK_PATH_MAX],
+			 unsigned char **out_results)
+{
+	size_t head, tail, capacity, count = 0, i, j;
+	stk_ring_entry_t *entry;
+
+	*out_events = NULL;
+	*out_files = NULL;
+	*out_results = NULL;
+
+	platform_notify_clear(stk_watcher_ready);
+
+	head = stk_ring_head;
+	tail = platform_atomic_load(&stk_ring_tail);
+	if (head == tail)
+		return 0;
+
+	capacity = tail - head;
+
+	*out_events = malloc(capacity * sizeof(**out_events));
+	*out_files = malloc(capacity * sizeof(**out_files));
+	*out_results = malloc(capacity);
+	if (!*out_events || !*out_files || !*out_results) {
+		free(*out_events);
+		free(*out_files);
+		free(*out_results);
+		*out_events = NULL;
+		*out_files = NULL;
+		*out_results = NULL;
+		return 0;
+	}
+
+	for (i = head; i != tail; i++) {
+		entry = &stk_ring[i & STK_RING_MASK];
+		stk_watcher_merge(&entry->work);
+
+		j = stk_watcher_find(*out_files, count, entry->name);
+		if (j == count) {
+			memcpy((*out_files)[count], entry->name, STK_PATH_MAX);
+			(*out_results)[count] = entry->copy_result;
+			(*out_events)[count++] = entry->type;
+			continue;
+		}
+
+		if (entry->type == STK_MOD_UNLOAD ||
+		    (*out_events)[j] == STK_MOD_UNLOAD ||
+		    (*out_results)[j] != STK_PLATFORM_OPERATION_SUCCESS)
+			(*out_results)[j] = entry->copy_result;
+		(*out_events)[j] = entry->type;
+	}
+
+	platform_atomic_store(&stk_ring_head, tail);
+	if (tail - head >= STK_RING_SIZE)
+		platform_notify_signal(stk_watcher_wake);
+
+	return count;
+}
+
+unsigned char stk_watcher_running(void)
+{
+	return stk_watcher_thread != NULL;
+}
+
+/* blocks until the watcher thread has published something or timeout_ms
+ * passes. Returns 0 on timeout */
+unsigned char stk_watcher_wait(int timeout_ms)
+{
+	return platform_notify_wait(stk_watcher_ready, timeout_ms);
+}
+
+int stk_watcher_fd(void)
+{
+	return platform_notify_fd(stk_watcher_ready);
+}
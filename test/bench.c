@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stk.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <windows.h>
+#define bench_mkdir(p) _mkdir(p)
+#else
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#define bench_mkdir(p) mkdir(p, 0755)
+#endif
+
+#define BENCH_DIR "bench_mods"
+#define BENCH_PART "bench_mods.part"
+#define BENCH_BASE BENCH_DIR "/bench_base" BENCH_EXT
+#define BENCH_ROUNDS 20
+#define BENCH_IDLE_POLLS 200
+#define BENCH_SCAN_DIR "bench_scan"
+#define BENCH_SCAN_ROUNDS 10
+#define BENCH_PRELOAD_MODULES 400
+#define BENCH_PRELOAD_ROUNDS 5
+#define BENCH_SYMBOL_CALLS 10000000L
+#define BENCH_SYMBOL "stk_mod_name"
+#define BENCH_RELOAD BENCH_DIR "/test_mod_reload" BENCH_EXT
+#define BENCH_RELOAD_EXPECTED 202
+
+#if defined(_WIN32)
+#define BENCH_EXT ".dll"
+#elif defined(__APPLE__)
+#define BENCH_EXT ".dylib"
+#else
+#define BENCH_EXT ".so"
+#endif
+
+static const size_t bench_sizes[] = {50, 100, 200, 400, 800};
+static const size_t bench_scan_sizes[] = {1000, 10000};
+static const size_t bench_preload_threads[] = {1, 2, 4, 8};
+
+static int copy_file(const char *from, const char *to)
+{
+	char buf[65536];
+	size_t n;
+	FILE *src, *dst;
+
+	src = fopen(from, "rb");
+	if (!src)
+		return 1;
+
+	dst = fopen(to, "wb");
+	if (!dst) {
+		fclose(src);
+		return 1;
+	}
+
+	while ((n = fread(buf, 1, sizeof(buf), src)) > 0)
+		fwrite(buf, 1, n, dst);
+
+	fclose(src);
+	fclose(dst);
+	return 0;
+}
+
+static void dep_name(char *out, size_t i)
+{
+	sprintf(out, "%s/bench_dep_%04lu%s", BENCH_DIR, (unsigned long)i,
+		BENCH_EXT);
+}
+
+static void populate(size_t count)
+{
+	char path[256];
+	size_t i;
+
+	bench_mkdir(BENCH_DIR);
+	copy_file("test_mod" BENCH_EXT, BENCH_DIR "/test_mod" BENCH_EXT);
+	for (i = 1; i < count; i++) {
+		dep_name(path, i);
+		copy_file("test_mod_dep" BENCH_EXT, path);
+	}
+}
+
+static void depopulate(size_t count)
+{
+	char path[256];
+	size_t i;
+
+	remove(BENCH_DIR "/test_mod" BENCH_EXT);
+	remove(BENCH_BASE);
+	for (i = 1; i < count; i++) {
+		dep_name(path, i);
+		remove(path);
+	}
+}
+
+static double elapsed_us(clock_t start, clock_t end)
+{
+	return (double)(end - start) * 1000000.0 / CLOCKS_PER_SEC;
+}
+
+/* clock() adds up the CPU time of every thread, which hides what a
+ * preload pool saves */
+static double wall_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER now, freq;
+
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return (double)now.QuadPart * 1000000.0 / (double)freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1000000.0 + (double)tv.tv_usec;
+#endif
+}
+
+static void replace_file(const char *from, const char *to)
+{
+	copy_file(from, BENCH_PART);
+	remove(to);
+	rename(BENCH_PART, to);
+}
+
+/* a skipped reload is not an event, so stop on one of those as well */
+static double poll_until_event(void)
+{
+	size_t spins = 0;
+	clock_t start = clock();
+	stk_stats_t stats;
+
+	while (stk_poll() == 0 && spins++ < 1000) {
+		stk_get_stats(&stats);
+		if (stats.skipped)
+			break;
+	}
+	return elapsed_us(start, clock());
+}
+
+static void bench_poll(size_t count)
+{
+	char path[256];
+	size_t r, i, loaded, work = 0, checked = 0, skipped = 0;
+	clock_t start;
+	double reload_us = 0.0, idle_us = 0.0, pending_us = 0.0;
+	stk_stats_t stats;
+
+	populate(count);
+
+	stk_set_mod_dir(BENCH_DIR);
+	if (stk_init() != STK_INIT_SUCCESS) {
+		fprintf(stderr, "stk_init failed for %lu modules\n",
+			(unsigned long)count);
+		depopulate(count);
+		return;
+	}
+
+	start = clock();
+	for (i = 0; i < BENCH_IDLE_POLLS; i++)
+		stk_poll();
+	idle_us = elapsed_us(start, clock()) / BENCH_IDLE_POLLS;
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		dep_name(path, 1 + r % (count - 1));
+		replace_file("test_mod_dep_alt" BENCH_EXT, path);
+		reload_us += poll_until_event();
+
+		stk_get_stats(&stats);
+		work += stats.revalidated + stats.reordered;
+	}
+
+	loaded = stk_module_count();
+
+	/* every dependent is deferred once test_mod goes away; polls for an
+	 * unrelated module should not look at them again. After the first
+	 * round bench_base is rewritten with identical bytes, so its reloads
+	 * should be skipped */
+	remove(BENCH_DIR "/test_mod" BENCH_EXT);
+	poll_until_event();
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		replace_file("test_mod" BENCH_EXT, BENCH_BASE);
+		pending_us += poll_until_event();
+
+		stk_get_stats(&stats);
+		checked += stats.pending_checked;
+		skipped += stats.skipped;
+	}
+
+	fprintf(stderr, "%8lu %8lu %16.1f %16.1f %12.1f %16.1f %8lu %8lu\n",
+		(unsigned long)count, (unsigned long)loaded, idle_us,
+		reload_us / BENCH_ROUNDS, (double)work / BENCH_ROUNDS,
+		pending_us / BENCH_ROUNDS, (unsigned long)checked,
+		(unsigned long)skipped);
+
+	stk_shutdown();
+	depopulate(count);
+}
+
+static void scan_entry(char *out, size_t i)
+{
+	sprintf(out, "%s/entry_%05lu.dat", BENCH_SCAN_DIR, (unsigned long)i);
+}
+
+/* a module directory full of files that are not modules, so that
+ * stk_init() spends its time listing the directory rather than loading */
+static void bench_scan(size_t count)
+{
+	char path[256];
+	size_t i, r;
+	clock_t start;
+	double init_us = 0.0;
+	FILE *f;
+
+	bench_mkdir(BENCH_SCAN_DIR);
+	for (i = 0; i < count; i++) {
+		scan_entry(path, i);
+		f = fopen(path, "wb");
+		if (f)
+			fclose(f);
+	}
+
+	stk_set_mod_dir(BENCH_SCAN_DIR);
+	for (r = 0; r < BENCH_SCAN_ROUNDS; r++) {
+		start = clock();
+		if (stk_init() != STK_INIT_SUCCESS) {
+			fprintf(stderr, "stk_init failed for %lu entries\n",
+				(unsigned long)count);
+			break;
+		}
+		init_us += elapsed_us(start, clock());
+		stk_shutdown();
+	}
+
+	if (r == BENCH_SCAN_ROUNDS)
+		fprintf(stderr, "%8lu %16.1f\n", (unsigned long)count,
+			init_us / BENCH_SCAN_ROUNDS);
+
+	for (i = 0; i < count; i++) {
+		scan_entry(path, i);
+		remove(path);
+	}
+}
+
+static void bench_preload(size_t threads)
+{
+	size_t r;
+	double start, init_us = 0.0;
+
+	stk_set_mod_dir(BENCH_DIR);
+	stk_set_preload_threads(threads);
+	for (r = 0; r < BENCH_PRELOAD_ROUNDS; r++) {
+		start = wall_us();
+		if (stk_init() != STK_INIT_SUCCESS) {
+			fprintf(stderr, "stk_init failed with %lu threads\n",
+				(unsigned long)threads);
+			break;
+		}
+		init_us += wall_us() - start;
+		stk_shutdown();
+	}
+	stk_set_preload_threads(0);
+
+	if (r == BENCH_PRELOAD_ROUNDS)
+		fprintf(stderr, "%8lu %16.1f\n", (unsigned long)threads,
+			init_us / BENCH_PRELOAD_ROUNDS);
+}
+
+static double per_call_ns(clock_t start, clock_t end)
+{
+	return elapsed_us(start, end) * 1000.0 / BENCH_SYMBOL_CALLS;
+}
+
+/* looking one function up in a loaded module every call: raw dlsym on a
+ * handle of the host's own, the cached lookup by name, and the cached
+ * lookup through a registered id */
+static void bench_symbols(void)
+{
+	stk_module_handle_t handle;
+	stk_symbol_id_t id;
+	volatile size_t sink = 0;
+	clock_t start;
+	double raw_ns, name_ns, id_ns;
+	long i;
+#ifdef _WIN32
+	HMODULE raw = LoadLibraryA("test_mod" BENCH_EXT);
+#else
+	void *raw = dlopen("./test_mod" BENCH_EXT, RTLD_NOW);
+#endif
+
+	populate(2);
+	stk_set_mod_dir(BENCH_DIR);
+	if (!raw || stk_init() != STK_INIT_SUCCESS) {
+		fprintf(stderr, "cannot load test_mod for the symbol bench\n");
+		depopulate(2);
+		return;
+	}
+
+	handle = stk_module_find("test_mod");
+	id = stk_symbol_register(BENCH_SYMBOL);
+
+	start = clock();
+	for (i = 0; i < BENCH_SYMBOL_CALLS; i++)
+#ifdef _WIN32
+		sink += (size_t)GetProcAddress(raw, BENCH_SYMBOL);
+#else
+		sink += (size_t)dlsym(raw, BENCH_SYMBOL);
+#endif
+	raw_ns = per_call_ns(start, clock());
+
+	start = clock();
+	for (i = 0; i < BENCH_SYMBOL_CALLS; i++)
+		sink += (size_t)stk_module_symbol(handle, BENCH_SYMBOL);
+	name_ns = per_call_ns(start, clock());
+
+	start = clock();
+	for (i = 0; i < BENCH_SYMBOL_CALLS; i++)
+		sink += (size_t)stk_module_symbol_id(handle, id);
+	id_ns = per_call_ns(start, clock());
+
+	fprintf(stderr, "%16.2f %16.2f %16.2f\n", raw_ns, name_ns, id_ns);
+
+	stk_shutdown();
+	depopulate(2);
+#ifdef _WIN32
+	FreeLibrary(raw);
+#else
+	dlclose(raw);
+#endif
+	(void)sink;
+}
+
+/* reloads test_mod_reload from version 1 to 2 and returns what the new
+ * version's test_mod_reload_get() reports, -1 if it cannot be called. It
+ * is opened while version 1 is still loaded, and must still reach its own
+ * exported helper and counter rather than the old version's */
+static int bench_reload(void)
+{
+	stk_module_handle_t handle;
+	int value = -1;
+	union {
+		void *obj;
+		int (*get)(void);
+	} u;
+
+	bench_mkdir(BENCH_DIR);
+	copy_file("test_mod_reload" BENCH_EXT, BENCH_RELOAD);
+	stk_set_mod_dir(BENCH_DIR);
+	if (stk_init() != STK_INIT_SUCCESS) {
+		fprintf(stderr, "cannot load test_mod_reload\n");
+		remove(BENCH_RELOAD);
+		return value;
+	}
+
+	replace_file("test_mod_reload_v2" BENCH_EXT, BENCH_RELOAD);
+	poll_until_event();
+
+	handle = stk_module_find("test_mod_reload");
+	u.obj = stk_module_symbol(handle, "test_mod_reload_get");
+	if (u.obj)
+		value = u.get();
+
+	stk_shutdown();
+	remove(BENCH_RELOAD);
+	return value;
+}
+
+int main(void)
+{
+	size_t i;
+	int reloaded;
+
+	stk_set_logging_enabled(0);
+	/* files are replaced by rename, so there is nothing to settle */
+	stk_set_settle_ms(0);
+
+	fprintf(stderr, "stk_poll() cost vs module count (%d reload rounds)\n",
+		BENCH_ROUNDS);
+	fprintf(stderr, "%8s %8s %16s %16s %12s %16s %8s %8s\n", "files",
+		"loaded", "idle poll (us)", "reload poll (us)", "graph work",
+		"deferred (us)", "checked", "skipped");
+
+	for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++)
+		bench_poll(bench_sizes[i]);
+
+	fprintf(stderr, "\nstk_init() cost vs directory entries (%d rounds)\n",
+		BENCH_SCAN_ROUNDS);
+	fprintf(stderr, "%8s %16s\n", "entries", "init (us)");
+
+	for (i = 0;
+	     i < sizeof(bench_scan_sizes) / sizeof(bench_scan_sizes[0]); i++)
+		bench_scan(bench_scan_sizes[i]);
+
+	fprintf(stderr,
+		"\nstk_init() cost vs preload threads (%d modules, %d rounds)\n",
+		BENCH_PRELOAD_MODULES, BENCH_PRELOAD_ROUNDS);
+	fprintf(stderr, "%8s %16s\n", "threads", "init (us)");
+
+	populate(BENCH_PRELOAD_MODULES);
+	for (i = 0;
+	     i < sizeof(bench_preload_threads) / sizeof(bench_preload_threads[0]);
+	     i++)
+		bench_preload(bench_preload_threads[i]);
+	depopulate(BENCH_PRELOAD_MODULES);
+
+	fprintf(stderr, "\nsymbol lookup cost (%ld calls)\n", BENCH_SYMBOL_CALLS);
+	fprintf(stderr, "%16s %16s %16s\n", "dlsym (ns)", "by name (ns)",
+		"by id (ns)");
+	bench_symbols();
+
+	reloaded = bench_reload();
+	fprintf(stderr, "\nvalue after a reload: %d (expected %d)\n", reloaded,
+		BENCH_RELOAD_EXPECTED);
+
+	return reloaded == BENCH_RELOAD_EXPECTED ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,6 +1,7 @@
 CC ?= cc
 CFLAGS = -Wall -Wpedantic -I../include -std=c89
 LDFLAGS = -L../bin/debug -lstk
+BENCH_LDFLAGS = -L../bin/release -lstk -Wl,-rpath,../bin/release -ldl
 
 UNAME_S != uname -s
 
@@ -12,37 +13,63 @@ LDFLAGS += -Wl,-rpath,../bin/debug
 MODULE_EXT = .so
 .endif
 
-.PHONY: all test clean
+.PHONY: all test bench clean
 
 all: test
 
 test_program: test.c
 	$(CC) $(CFLAGS) -o $@ test.c $(LDFLAGS)
 
+bench_program: bench.c
+	$(CC) $(CFLAGS) -O2 -o $@ bench.c $(BENCH_LDFLAGS)
+
 test_mod$(MODULE_EXT): test_mod.c
 	$(CC) $(CFLAGS) -fPIC -shared -o $@ test_mod.c
 
 test_mod_dep$(MODULE_EXT): test_mod_dep.c
 	$(CC) $(CFLAGS) -fPIC -shared -o $@ test_mod_dep.c
 
+test_mod_dep_alt$(MODULE_EXT): test_mod_dep.c
+	$(CC) $(CFLAGS) -O2 -fPIC -shared -o $@ test_mod_dep.c
+
+test_mod_desc$(MODULE_EXT): test_mod_desc.c
+	$(CC) $(CFLAGS) -fPIC -shared -o $@ test_mod_desc.c
+
+test_mod_reload$(MODULE_EXT): test_mod_reload.c
+	$(CC) $(CFLAGS) -fPIC -shared -o $@ test_mod_reload.c
+
+test_mod_reload_v2$(MODULE_EXT): test_mod_reload.c
+	$(CC) $(CFLAGS) -DTEST_MOD_RELOAD_VERSION=2 -fPIC -shared -o $@ \
+	    test_mod_reload.c
+
 setup:
 	@mkdir -p mods
 	@cp -f test_mod$(MODULE_EXT) mods/ 2>/dev/null || true
 	@cp -f test_mod_dep$(MODULE_EXT) mods/ 2>/dev/null || true
+	@cp -f test_mod_desc$(MODULE_EXT) mods/ 2>/dev/null || true
 	@echo "Test environment ready: mods/ directory with test modules"
 
-run: test_program test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) setup
+run: test_program test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) \
+     test_mod_desc$(MODULE_EXT) setup
 	@echo "Running integration test (CTRL+C to exit)..."
 	@./test_program
 
-test: test_program test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) setup
+test: test_program test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) \
+      test_mod_desc$(MODULE_EXT) setup
 	@echo "=== stk Integration Test ==="
 	@echo "1. Starting test program"
-	@echo "2. Will load test_mod and test_mod_dep from mods/"
+	@echo "2. Will load test_mod, test_mod_dep and test_mod_desc from mods/"
 	@echo "3. Press CTRL+C to exit"
 	@echo "============================="
 	@./test_program || echo "Test completed."
 
+bench: bench_program test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) \
+       test_mod_dep_alt$(MODULE_EXT) test_mod_reload$(MODULE_EXT) \
+       test_mod_reload_v2$(MODULE_EXT)
+	@./bench_program > /dev/null
+
 clean:
-	rm -f test_program test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT)
-	rm -rf mods/
+	rm -f test_program bench_program test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) \
+	      test_mod_dep_alt$(MODULE_EXT) test_mod_desc$(MODULE_EXT) \
+	      test_mod_reload$(MODULE_EXT) test_mod_reload_v2$(MODULE_EXT)
+	rm -rf mods/ bench_mods/
@@ -1,6 +1,7 @@
 CC := cc
 CFLAGS = -Wall -Wpedantic -I../include -std=c89
 LDFLAGS = -L../bin/debug -lstk
+BENCH_LDFLAGS = -L../bin/release -lstk
 
 ifeq ($(OS),Windows_NT)
     SHELL := cmd.exe
@@ -11,44 +12,75 @@ else
     MODULE_EXT = .so
     EXE_EXT =
     LDFLAGS += -Wl,-rpath,../bin/debug
+    BENCH_LDFLAGS += -Wl,-rpath,../bin/release -ldl
 endif
 
-.PHONY: all test clean
+.PHONY: all test bench clean
 
 all: test
 
 test_program$(EXE_EXT): test.c
 	$(CC) $(CFLAGS) -o $@ test.c $(LDFLAGS)
 
+bench_program$(EXE_EXT): bench.c
+	$(CC) $(CFLAGS) -O2 -o $@ bench.c $(BENCH_LDFLAGS)
+
 test_mod$(MODULE_EXT): test_mod.c
 	$(CC) $(CFLAGS) -fPIC -shared -o $@ test_mod.c
 
 test_mod_dep$(MODULE_EXT): test_mod_dep.c
 	$(CC) $(CFLAGS) -fPIC -shared -o $@ test_mod_dep.c
 
+test_mod_dep_alt$(MODULE_EXT): test_mod_dep.c
+	$(CC) $(CFLAGS) -O2 -fPIC -shared -o $@ test_mod_dep.c
+
+test_mod_desc$(MODULE_EXT): test_mod_desc.c
+	$(CC) $(CFLAGS) -fPIC -shared -o $@ test_mod_desc.c
+
+test_mod_reload$(MODULE_EXT): test_mod_reload.c
+	$(CC) $(CFLAGS) -fPIC -shared -o $@ test_mod_reload.c
+
+test_mod_reload_v2$(MODULE_EXT): test_mod_reload.c
+	$(CC) $(CFLAGS) -DTEST_MOD_RELOAD_VERSION=2 -fPIC -shared -o $@ \
+	    test_mod_reload.c
+
 setup:
 ifeq ($(OS),Windows_NT)
 	@if not exist mods mkdir mods
 	@if exist test_mod.dll copy /Y test_mod.dll mods\ >nul 2>&1
 	@if exist test_mod_dep.dll copy /Y test_mod_dep.dll mods\ >nul 2>&1
+	@if exist test_mod_desc.dll copy /Y test_mod_desc.dll mods\ >nul 2>&1
 else
 	@mkdir -p mods
 	@cp -f test_mod.so mods/ 2>/dev/null || true
 	@cp -f test_mod_dep.so mods/ 2>/dev/null || true
+	@cp -f test_mod_desc.so mods/ 2>/dev/null || true
 endif
 
-test: test_program$(EXE_EXT) test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) setup
+test: test_program$(EXE_EXT) test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) \
+      test_mod_desc$(MODULE_EXT) setup
 ifeq ($(OS),Windows_NT)
 	@set PATH=../bin/debug;%PATH% && cmd /C "test_program.exe"
 else
 	@./test_program
 endif
 
+bench: bench_program$(EXE_EXT) test_mod$(MODULE_EXT) test_mod_dep$(MODULE_EXT) \
+       test_mod_dep_alt$(MODULE_EXT) test_mod_reload$(MODULE_EXT) \
+       test_mod_reload_v2$(MODULE_EXT)
+ifeq ($(OS),Windows_NT)
+	@set PATH=../bin/release;%PATH% && cmd /C "bench_program.exe >nul"
+else
+	@./bench_program > /dev/null
+endif
+
 clean:
 ifeq ($(OS),Windows_NT)
-	@del /Q test_program.exe test_mod.dll test_mod_dep.dll 2>nul || true
+	@del /Q test_program.exe bench_program.exe test_mod.dll test_mod_dep.dll test_mod_dep_alt.dll test_mod_desc.dll test_mod_reload.dll test_mod_reload_v2.dll 2>nul || true
 	@rmdir /S /Q mods 2>nul || true
+	@rmdir /S /Q bench_mods 2>nul || true
 else
-	@rm -f test_program test_mod.so test_mod_dep.so
-	@rm -rf mods
+	@rm -f test_program bench_program test_mod.so test_mod_dep.so test_mod_dep_alt.so \
+	      test_mod_desc.so test_mod_reload.so test_mod_reload_v2.so
+	@rm -rf mods bench_mods
 endif
@@ -5,8 +5,6 @@
 
 #ifdef _WIN32
 #include <windows.h>
-#else
-#include <unistd.h>
 #endif
 
 volatile sig_atomic_t stop;
@@ -53,7 +51,7 @@ int main(int argc, char **argv)
 	}
 
 	while (!stop) {
-		size_t events = stk_poll();
+		size_t events = stk_wait(1000);
 		if (events > 0)
 			printf("Poll: %lu module event(s) detected\n",
 			       (unsigned long)events);
@@ -63,11 +61,6 @@ int main(int argc, char **argv)
 			printf("Still running... (iteration %lu)\n",
 			       (unsigned long)iterations);
 		}
-#ifdef _WIN32
-		Sleep(1000);
-#else
-		sleep(1);
-#endif
 	}
 
 	printf("Shutting down stk...\n");
@@ -0,0 +1,21 @@
+#include <stdio.h>
+#include <stk.h>
+
+static int desc_init(void)
+{
+	printf("test_mod_desc initialized!\n");
+	return 0;
+}
+
+static void desc_shutdown(void) { printf("test_mod_desc shut down.\n"); }
+
+/* no terminating entry: the descriptor carries the count, and reading
+ * the table from the file has to stop at the end of the array */
+const stk_dep_t stk_mod_deps[] = {{"test_mod", ">=1.0.0"}};
+
+/* laid out right after stk_mod_deps, where a reader that runs past the
+ * end of it would find a dependency on a module that does not exist */
+const stk_dep_t test_mod_desc_unused[] = {{"test_mod_missing", ">=1.0.0"}};
+
+STK_MOD_DESCRIPTOR_DEPS(desc_init, desc_shutdown, "Descriptor Test Module",
+			"1.0.0", NULL, 0, stk_mod_deps);
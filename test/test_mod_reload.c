@@ -0,0 +1,31 @@
+#include <stdio.h>
+
+#ifndef TEST_MOD_RELOAD_VERSION
+#define TEST_MOD_RELOAD_VERSION 1
+#endif
+
+/* exported, so a new version that bound its own names to the version it
+ * replaces would run the old helper against the old counter */
+int test_mod_reload_counter = 0;
+
+int test_mod_reload_helper(void)
+{
+	return TEST_MOD_RELOAD_VERSION * 100 + test_mod_reload_counter;
+}
+
+int test_mod_reload_get(void) { return test_mod_reload_helper(); }
+
+int stk_mod_init(void)
+{
+	test_mod_reload_counter = TEST_MOD_RELOAD_VERSION;
+	printf("test_mod_reload v%d initialized!\n", TEST_MOD_RELOAD_VERSION);
+	return 0;
+}
+
+void stk_mod_shutdown(void) { printf("test_mod_reload shut down.\n"); }
+
+const char *stk_mod_name(void) { return "Reload Test Module"; }
+const char *stk_mod_version(void)
+{
+	return TEST_MOD_RELOAD_VERSION == 1 ? "1.0.0" : "2.0.0";
+}